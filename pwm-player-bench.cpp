@@ -0,0 +1,83 @@
+/*
+ * Melody front-ends throughput benchmark (make bench)
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <stdlib.h>
+
+#include "pwm-player.h"
+#include "pwm-player-melody.h"
+#include "pwm-player-rtttl.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+//
+// Make the same pseudo-random melody in both notations
+//
+static void MakeMelodies(int count, string &imy, string &rtttl) {
+	static const char durImy[] = { '2', '3', '4' };
+	static const char *const durRtttl[] = { "4", "8", "16" };
+	unsigned int seed = 1;
+	char buf[16];
+
+	imy.clear();
+	rtttl = "bench:d=4,o=5,b=120:";
+	for (int i = 0; i < count; ++i) {
+		seed = seed * 1103515245 + 12345;
+		char note = "cdefgab"[(seed >> 8) % 7];
+		int d = (seed >> 16) % 3;
+		int octave = 4 + (seed >> 20) % 3;
+		snprintf(buf, sizeof(buf), "*%d%c%c", octave, note, durImy[d]);
+		imy += buf;
+		snprintf(buf, sizeof(buf), "%s%s%c%d", i ? "," : "", durRtttl[d], note, octave);
+		rtttl += buf;
+	}
+}
+
+static void Report(const char *name, int notes, size_t bytes, int iterations, TPoint t0) {
+	double s = duration_cast<microseconds>(NOW - t0).count() / 1e6;
+	printf("%-8s %10.0f notes/s %8.1f MB/s (%d notes, %d bytes, %d iterations, %.3f s)\n", name,
+		(double)notes * iterations / s, (double)bytes * iterations / s / 1e6, notes, (int)bytes, iterations, s);
+}
+
+int main(int argc, char *argv[]) {
+	int count = (argc > 1) ? atoi(argv[1]) : 10000;
+	int iterations = (argc > 2) ? atoi(argv[2]) : 100;
+	string imy, rtttl;
+	TTimeline tlImy, tlRtttl;
+	TPoint t0;
+
+	if ((count <= 0) || (iterations <= 0)) {
+		fprintf(stderr, "usage: %s [<notes> [<iterations>]]\n", argv[0]);
+		exit(1);
+	}
+	MakeMelodies(count, imy, rtttl);
+
+	t0 = NOW;
+	for (int i = 0; i < iterations; ++i) {
+		TMelody *m = NewMelody();
+		if ((PrepareMelodyString(m, imy.c_str(), 'I') < 0) || (CompileMelody(m, tlImy) < 0)) {
+			exit(1);
+		}
+		DeleteMelody(m);
+	}
+	Report("iMelody", count, imy.size(), iterations, t0);
+
+	t0 = NOW;
+	for (int i = 0; i < iterations; ++i) {
+		if (CompileRTTTLString(rtttl.c_str(), tlRtttl) < 0) {
+			exit(1);
+		}
+	}
+	Report("RTTTL", count, rtttl.size(), iterations, t0);
+
+	// both front-ends must have produced the same melody
+	if ((tlImy.notes.size() != tlRtttl.notes.size()) || (tlImy.length != tlRtttl.length)) {
+		fprintf(stderr, "Timelines differ: %d notes %lu us vs %d notes %lu us\n", (int)tlImy.notes.size(), tlImy.length,
+			(int)tlRtttl.notes.size(), tlRtttl.length);
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Built-in melodies
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include "pwm-player.h"
+#include "pwm-player-builtin.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+#define MELODY(name, beat, str) \
+	static constexpr auto name##Notes = BUILTIN_MELODY(beat, str); \
+	static const TBuiltinMelody name##Melody = { #name, name##Notes.data(), name##Notes.size(), BUILTIN_LENGTH(beat, str) };
+#define EMELODY(name, beat, str) \
+	static constexpr auto name##Notes = BUILTIN_EMELODY(beat, str); \
+	static const TBuiltinMelody name##Melody = { #name, name##Notes.data(), name##Notes.size(), BUILTIN_ELENGTH(beat, str) };
+
+typedef struct {
+	const char *name;
+	const TNote *notes;
+	size_t count;
+	unsigned long length;      // microseconds
+} TBuiltinMelody;
+
+//
+// the melodies are parsed by the compiler, so a typo here is a build error
+//
+MELODY(beep, 120, "*5a3")
+MELODY(ok, 160, "*5c4e4g3")
+MELODY(error, 120, "*4g3r4c2")
+MELODY(chime, 100, "*5e3c3*4g3*5c2")
+MELODY(alarm, 200, "*6a4*5a4*6a4*5a4*6a4*5a4r3*6a4*5a4*6a4*5a4*6a4*5a4")
+MELODY(doorbell, 120, "*5#g3e2r4#g3e2")
+MELODY(elka, 120, "*5b3g3b2b3#f3b2b3*4b3*5#d3#f3b2*4b1b1;")
+EMELODY(jingle, 120, "+e+e+E+e+e+E+e+g+c.+dP+E.")
+
+static const TBuiltinMelody *const Melodies[] = {
+	&beepMelody, &okMelody, &errorMelody, &chimeMelody, &alarmMelody, &doorbellMelody, &elkaMelody, &jingleMelody
+};
+
+//
+// Get built-in melody by name
+//
+int GetBuiltinMelody(const char *name, TTimeline &tl) {
+	for (size_t i = 0; i < sizeof(Melodies) / sizeof(Melodies[0]); ++i) {
+		if (strcmp(Melodies[i]->name, name) == 0) {
+			tl.notes.assign(Melodies[i]->notes, Melodies[i]->notes + Melodies[i]->count);
+			tl.length = Melodies[i]->length;
+			return 1;
+		}
+	}
+	return -1;
+}
+
+void ListBuiltinMelodies() {
+	for (size_t i = 0; i < sizeof(Melodies) / sizeof(Melodies[0]); ++i) {
+		printf("%-12s %3d notes, %lu ms\n", Melodies[i]->name, (int)Melodies[i]->count, Melodies[i]->length / 1000);
+	}
+}
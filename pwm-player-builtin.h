@@ -0,0 +1,231 @@
+/*
+ * Compile-time iMelody/eMelody parser for built-in melodies
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_BUILTIN_H_
+#define _PWM_PLAYER_BUILTIN_H_
+
+#include <array>
+
+#include "pwm-player-timeline.h"
+
+/*
+ * Melody body (the part after "MELODY:") is turned into std::array<TNote, N>
+ * entirely at compile time, so built-in melodies need neither file access nor
+ * parsing at run time. Supported subset of iMelody:
+ *   *<0..8>                      octave prefix
+ *   # &                          sharp and flat for the next note
+ *   a..g <0..5> [. : ;]          note with duration and its modifier
+ *   r <0..5> [. : ;]             rest
+ *   V<0..15> V+ V-               volume
+ * and of eMelody:
+ *   +                            next note an octave higher (up to two)
+ *   # &                          sharp and flat for the next note
+ *   A..G a..g [.]                long and short note, '.' doubles the duration
+ *   P p [.]                      long and short rest
+ *   V<0..15> V+ V-               volume
+ * Anything else (including repeats) is a syntax error that fails the build.
+ * Note style is continuous (STYLE:S1), as for -I and -E strings.
+ *
+ * BUILTIN_MELODY(beat, "...") / BUILTIN_EMELODY(beat, "...") give std::array of notes,
+ * BUILTIN_LENGTH(beat, "...") / BUILTIN_ELENGTH(beat, "...") give total melody length
+ * in microseconds.
+ */
+namespace Builtin {
+
+/* same conversion constants as in the iMelody run-time parser */
+const unsigned long TICK_CONVERT = 1920000;   // 32nd note length in 1/256 msec = TICK_CONVERT / beat
+const int DEFAULT_VOLUME = 7;
+const int VELOCITY_MUL = 8;
+const int E_OCTAVE = 48;                      // MIDI number of C in eMelody octave without '+'
+
+constexpr bool IsSpace(char c) {
+	return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+constexpr bool IsDigit(char c) {
+	return (c >= '0') && (c <= '9');
+}
+
+/* semitone offset of a note name from C */
+constexpr int NoteOffset(char c) {
+	return (c == 'a') ? 9 : (c == 'b') ? 11 : (c == 'c') ? 0 : (c == 'd') ? 2 :
+		(c == 'e') ? 4 : (c == 'f') ? 5 : (c == 'g') ? 7 : throw "invalid note name in built-in melody";
+}
+
+constexpr unsigned long BaseDuration(char c, unsigned long tick) {
+	return ((c >= '0') && (c <= '5')) ? (tick << ('5' - c)) : throw "invalid note duration in built-in melody";
+}
+
+constexpr unsigned long ModDuration(char m, unsigned long d) {
+	return (m == '.') ? d + (d >> 1) : (m == ':') ? d + (d >> 1) + (d >> 2) : (m == ';') ? (d * 683) >> 10 : d;
+}
+
+constexpr int ModLength(char m) {
+	return ((m == '.') || (m == ':') || (m == ';')) ? 1 : 0;
+}
+
+/* eMelody: uppercase is a long note (1/2), lowercase a short one (1/8) */
+constexpr bool IsUpper(char c) {
+	return (c >= 'A') && (c <= 'Z');
+}
+
+constexpr char Lower(char c) {
+	return IsUpper(c) ? c - 'A' + 'a' : c;
+}
+
+constexpr unsigned long EDuration(char c, char m, unsigned long tick) {
+	return (tick << (IsUpper(c) ? 4 : 2)) << ((m == '.') ? 1 : 0);
+}
+
+constexpr int Volume(int v) {
+	return ((v >= 0) && (v <= 15)) ? v : throw "invalid volume in built-in melody";
+}
+
+/*
+ * parser state; every step returns a new one
+ */
+struct TState {
+	int pos;                // position in the melody string
+	int octave;             // MIDI number of C in current octave
+	int modifier;           // sharp/flat for the next note
+	int volume;             // 0..15
+	unsigned long time;     // current time, 1/256 msec
+	int notes;              // notes found so far
+	int pitch;              // last found note
+	unsigned long start;    // last found note onset, 1/256 msec
+	unsigned long duration; // last found note duration, 1/256 msec
+
+	constexpr TState(int pos_, int octave_, int modifier_, int volume_, unsigned long time_, int notes_,
+		int pitch_, unsigned long start_, unsigned long duration_) :
+		pos(pos_), octave(octave_), modifier(modifier_), volume(volume_), time(time_), notes(notes_),
+		pitch(pitch_), start(start_), duration(duration_) { }
+
+	constexpr TState Skip(int n) const {
+		return TState(pos + n, octave, modifier, volume, time, notes, pitch, start, duration);
+	}
+	constexpr TState Octave(char c) const {
+		return IsDigit(c) ? TState(pos + 2, (c - '0' + 1) * 12, modifier, volume, time, notes, pitch, start, duration) :
+			throw "invalid octave in built-in melody";
+	}
+	constexpr TState Modifier(int m) const {
+		return TState(pos + 1, octave, m, volume, time, notes, pitch, start, duration);
+	}
+	constexpr TState SetVolume(const char *s) const {
+		return (s[pos + 1] == '+') ? TState(pos + 2, octave, modifier, (volume < 15) ? volume + 1 : 15, time, notes, pitch, start, duration) :
+			(s[pos + 1] == '-') ? TState(pos + 2, octave, modifier, (volume > 0) ? volume - 1 : 0, time, notes, pitch, start, duration) :
+			!IsDigit(s[pos + 1]) ? throw "invalid volume in built-in melody" :
+			IsDigit(s[pos + 2]) ? TState(pos + 3, octave, modifier, Volume((s[pos + 1] - '0') * 10 + s[pos + 2] - '0'), time, notes, pitch, start, duration) :
+			TState(pos + 2, octave, modifier, s[pos + 1] - '0', time, notes, pitch, start, duration);
+	}
+	constexpr TState Rest(const char *s, unsigned long tick) const {
+		return TState(pos + 2 + ModLength(s[pos + 2]), octave, modifier, volume,
+			time + ModDuration(s[pos + 2], BaseDuration(s[pos + 1], tick)), notes, pitch, start, duration);
+	}
+	constexpr TState Note(const char *s, unsigned long tick) const {
+		return TState(pos + 2 + ModLength(s[pos + 2]), octave, 0, volume,
+			time + ModDuration(s[pos + 2], BaseDuration(s[pos + 1], tick)), notes + 1,
+			octave + NoteOffset(s[pos]) + modifier, time, ModDuration(s[pos + 2], BaseDuration(s[pos + 1], tick)));
+	}
+	/* eMelody keeps the octave shifted by '+' in octave, it is back to E_OCTAVE after a note */
+	constexpr TState Shift() const {
+		return TState(pos + 1, (octave < E_OCTAVE + 24) ? octave + 12 : octave, modifier, volume, time, notes, pitch, start, duration);
+	}
+	constexpr TState ERest(const char *s, unsigned long tick) const {
+		return TState(pos + 1 + (s[pos + 1] == '.'), octave, modifier, volume,
+			time + EDuration(s[pos], s[pos + 1], tick), notes, pitch, start, duration);
+	}
+	constexpr TState ENote(const char *s, unsigned long tick) const {
+		return TState(pos + 1 + (s[pos + 1] == '.'), E_OCTAVE, 0, volume,
+			time + EDuration(s[pos], s[pos + 1], tick), notes + 1,
+			octave + NoteOffset(Lower(s[pos])) + modifier, time, EDuration(s[pos], s[pos + 1], tick));
+	}
+};
+
+constexpr TState Start(char type) {
+	return TState(0, (type == 'E') ? E_OCTAVE : 60, 0, DEFAULT_VOLUME, 0, 0, 0, 0, 0);
+}
+
+/* advance past the next note (or up to the end of the melody) */
+constexpr TState Next(const char *s, TState st, unsigned long tick) {
+	return (s[st.pos] == 0) ? st :
+		IsSpace(s[st.pos]) ? Next(s, st.Skip(1), tick) :
+		(s[st.pos] == '*') ? Next(s, st.Octave(s[st.pos + 1]), tick) :
+		(s[st.pos] == '#') ? Next(s, st.Modifier(1), tick) :
+		(s[st.pos] == '&') ? Next(s, st.Modifier(-1), tick) :
+		(s[st.pos] == 'V') ? Next(s, st.SetVolume(s), tick) :
+		(s[st.pos] == 'r') ? Next(s, st.Rest(s, tick), tick) :
+		((s[st.pos] >= 'a') && (s[st.pos] <= 'g')) ? st.Note(s, tick) :
+		throw "unexpected character in built-in melody";
+}
+
+constexpr TState ENext(const char *s, TState st, unsigned long tick) {
+	return (s[st.pos] == 0) ? st :
+		IsSpace(s[st.pos]) ? ENext(s, st.Skip(1), tick) :
+		(s[st.pos] == '+') ? ENext(s, st.Shift(), tick) :
+		(s[st.pos] == '#') ? ENext(s, st.Modifier(1), tick) :
+		(s[st.pos] == '&') ? ENext(s, st.Modifier(-1), tick) :
+		(s[st.pos] == 'V') ? ENext(s, st.SetVolume(s), tick) :
+		((s[st.pos] == 'P') || (s[st.pos] == 'p')) ? ENext(s, st.ERest(s, tick), tick) :
+		((Lower(s[st.pos]) >= 'a') && (Lower(s[st.pos]) <= 'g')) ? st.ENote(s, tick) :
+		throw "unexpected character in built-in melody";
+}
+
+constexpr TState Step(char type, const char *s, TState st, unsigned long tick) {
+	return (type == 'E') ? ENext(s, st, tick) : Next(s, st, tick);
+}
+
+constexpr TState Final(char type, const char *s, TState st, unsigned long tick) {
+	return (s[st.pos] == 0) ? st : Final(type, s, Step(type, s, st, tick), tick);
+}
+
+constexpr TState Nth(char type, const char *s, TState st, unsigned long tick, int n) {
+	return (st.notes > n) ? st : Nth(type, s, Step(type, s, st, tick), tick, n);
+}
+
+constexpr unsigned long Tick(int beat) {
+	return ((beat >= 25) && (beat <= 900)) ? TICK_CONVERT / beat : throw "invalid beat of built-in melody";
+}
+
+constexpr unsigned long ToUs(unsigned long t) {
+	return (unsigned long)(((unsigned long long)t * 1000) / 256);
+}
+
+constexpr int Count(char type, int beat, const char *s) {
+	return Final(type, s, Start(type), Tick(beat)).notes;
+}
+
+constexpr unsigned long Length(char type, int beat, const char *s) {
+	return ToUs(Final(type, s, Start(type), Tick(beat)).time);
+}
+
+constexpr TNote MakeNote(TState st) {
+	return { ToUs(st.start), ToUs(st.duration), (unsigned char)st.pitch,
+		(unsigned char)(st.volume * VELOCITY_MUL), 0, 0, 0, 0 };
+}
+
+template<int... I> struct TSeq { };
+template<int N, int... I> struct TMakeSeq : TMakeSeq<N - 1, N - 1, I...> { };
+template<int... I> struct TMakeSeq<0, I...> { typedef TSeq<I...> type; };
+
+template<int... I>
+constexpr std::array<TNote, sizeof...(I)> Notes(char type, int beat, const char *s, TSeq<I...>) {
+	return {{ MakeNote(Nth(type, s, Start(type), Tick(beat), I))... }};
+}
+
+} // namespace Builtin
+
+#define BUILTIN_MELODY(beat, str) Builtin::Notes('I', beat, str, Builtin::TMakeSeq<Builtin::Count('I', beat, str)>::type())
+#define BUILTIN_LENGTH(beat, str) Builtin::Length('I', beat, str)
+#define BUILTIN_EMELODY(beat, str) Builtin::Notes('E', beat, str, Builtin::TMakeSeq<Builtin::Count('E', beat, str)>::type())
+#define BUILTIN_ELENGTH(beat, str) Builtin::Length('E', beat, str)
+
+/*
+ * built-in melodies handling functions
+ */
+int GetBuiltinMelody(const char *name, TTimeline &tl);
+void ListBuiltinMelodies();
+
+#endif
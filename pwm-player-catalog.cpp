@@ -0,0 +1,201 @@
+/*
+ * Melody library catalog
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <algorithm>
+
+#include "pwm-player.h"
+#include "pwm-player-catalog.h"
+#include "pwm-player-compiled.h"
+#include "pwm-player-melody.h"
+#include "pwm-player-midi.h"
+#include "pwm-player-rtttl.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+//
+// Append string as a JSON string literal
+//
+static void AppendJSONString(string &out, const char *s) {
+	char buf[8];
+
+	out += '"';
+	for (; *s; ++s) {
+		unsigned char c = *s;
+		if ((c == '"') || (c == '\\')) {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20) {
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		} else {
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+//
+// iMelody and eMelody share the extension space, so look at the BEGIN line
+//
+static const char *MelodyFormat(const char *data, size_t size) {
+	static const char begin[] = "BEGIN:";
+	const char *p = data, *end = data + size;
+
+	while ((p < end) && isspace((unsigned char)*p)) {
+		++p;
+	}
+	if ((end - p > (long)sizeof(begin)) && (strncasecmp(p, begin, sizeof(begin) - 1) == 0) &&
+			(toupper((unsigned char)p[sizeof(begin) - 1]) == 'E')) {
+		return "emelody";
+	}
+	return "imelody";
+}
+
+//
+// Largest number of notes sounding at once (a note ending frees its voice for one starting at the same time)
+//
+static int MaxPolyphony(const vector<TNote> &notes) {
+	vector<pair<unsigned long, int> > points;
+	int cur = 0, best = 0;
+
+	points.reserve(notes.size() * 2);
+	for (size_t i = 0; i < notes.size(); ++i) {
+		points.push_back(make_pair(notes[i].start, 1));
+		points.push_back(make_pair(notes[i].start + notes[i].duration, -1));
+	}
+	sort(points.begin(), points.end());
+	for (size_t i = 0; i < points.size(); ++i) {
+		cur += points[i].second;
+		best = max(best, cur);
+	}
+	return best;
+}
+
+//
+// Parse one file and describe it as a JSON record
+//
+static int CatalogFile(const char *source, string &out) {
+	const char *format;
+	const void *data;
+	size_t size;
+	TMIDINotes mn;
+	TTimeline tl;
+	TPoint t0;
+	int rc;
+	char buf[64];
+
+	out = "{\"file\":";
+	AppendJSONString(out, source);
+	if ((data = MapFile(source, &size)) == NULL) {
+		snprintf(buf, sizeof(buf), ",\"error\":\"%s\"}", strerror(errno));
+		out += buf;
+		return -1;
+	}
+
+	t0 = NOW;
+	mn.format = -1;
+	mn.tracks = 1;
+	if ((size >= 4) && (memcmp(data, "MThd", 4) == 0)) {
+		format = "midi";
+		rc = ReadMIDINotes(source, mn);
+	} else if (IsRTTTLFile(source)) {
+		format = "rtttl";
+		rc = CompileRTTTL((const char*)data, size, source, tl);
+	} else {
+		format = MelodyFormat((const char*)data, size);
+		rc = CompileMelodyFile(source, tl);
+	}
+	long long parseUs = duration_cast<microseconds>(NOW - t0).count();
+	munmap((void*)data, size);
+
+	out += ",\"format\":\"";
+	out += format;
+	out += '"';
+	if (rc < 0) {
+		snprintf(buf, sizeof(buf), ",\"error\":\"unable to compile\",\"parse_us\":%lld}", parseUs);
+		out += buf;
+		return -1;
+	}
+	if (mn.format < 0) {
+		mn.notes.swap(tl.notes);
+		mn.length = tl.length;
+	}
+
+	vector<int> trackNotes(mn.tracks, 0);
+	int channelNotes[16] = { 0 };
+	int pitchMin = 127, pitchMax = 0;
+	for (size_t i = 0; i < mn.notes.size(); ++i) {
+		const TNote &n = mn.notes[i];
+		if (n.track < trackNotes.size()) {
+			++trackNotes[n.track];
+		}
+		++channelNotes[n.channel & 0x0F];
+		pitchMin = min(pitchMin, (int)n.pitch);
+		pitchMax = max(pitchMax, (int)n.pitch);
+	}
+
+	snprintf(buf, sizeof(buf), ",\"size\":%lu", (unsigned long)size);
+	out += buf;
+	if (mn.format >= 0) {
+		snprintf(buf, sizeof(buf), ",\"midi_format\":%d", mn.format);
+		out += buf;
+	}
+	snprintf(buf, sizeof(buf), ",\"tracks\":%d,\"notes\":%d,\"track_notes\":[", mn.tracks, (int)mn.notes.size());
+	out += buf;
+	for (size_t k = 0; k < trackNotes.size(); ++k) {
+		snprintf(buf, sizeof(buf), "%s%d", k ? "," : "", trackNotes[k]);
+		out += buf;
+	}
+	out += "],\"channel_notes\":{";
+	for (int ch = 0, first = 1; ch < 16; ++ch) {
+		if (channelNotes[ch]) {
+			snprintf(buf, sizeof(buf), "%s\"%d\":%d", first ? "" : ",", ch, channelNotes[ch]);
+			out += buf;
+			first = 0;
+		}
+	}
+	out += '}';
+	if (!mn.notes.empty()) {
+		snprintf(buf, sizeof(buf), ",\"pitch_min\":%d,\"pitch_max\":%d", pitchMin, pitchMax);
+		out += buf;
+	}
+	snprintf(buf, sizeof(buf), ",\"duration_ms\":%.1f,\"polyphony\":%d,\"parse_us\":%lld}", mn.length / 1000.0,
+		MaxPolyphony(mn.notes), parseUs);
+	out += buf;
+	return 1;
+}
+
+//
+// Describe all melody files of the directory (or a single file) using all CPU cores.
+// Records are written in the directory order once every file has been parsed.
+//
+int CatalogFiles(const char *path) {
+	vector<string> files;
+	vector<string> records;
+	std::atomic<int> failed(0);
+
+	if (ListMelodyFiles(path, files) < 0) {
+		return -1;
+	}
+	records.resize(files.size());
+	RunParallel(files.size(), [&](size_t i) {
+		if (CatalogFile(files[i].c_str(), records[i]) < 0) {
+			++failed;
+		}
+	});
+	for (size_t i = 0; i < records.size(); ++i) {
+		printf("%s\n", records[i].c_str());
+	}
+	if (failed) {
+		fprintf(stderr, "Unable to parse %d of %d files\n", (int)failed, (int)files.size());
+	}
+	return failed ? -1 : 1;
+}
@@ -0,0 +1,29 @@
+/*
+ * Melody library catalog
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_CATALOG_H_
+#define _PWM_PLAYER_CATALOG_H_
+
+/*
+ * --catalog writes one JSON object per line (and per file) to stdout:
+ *   {"file":"...","format":"midi|imelody|emelody|rtttl","size":<bytes>,
+ *    "midi_format":<0..2>,                      (MIDI only)
+ *    "tracks":<n>,"notes":<n>,
+ *    "track_notes":[<notes of track 0>,...],
+ *    "channel_notes":{"<channel>":<notes>,...},
+ *    "pitch_min":<midi note>,"pitch_max":<midi note>,
+ *    "duration_ms":<through the tempo map>,"polyphony":<max sounding notes>,
+ *    "parse_us":<time spent parsing>}
+ * or {"file":"...","error":"..."} if the file could not be parsed.
+ * Notes are counted before voice reduction (MIDI percussion included).
+ */
+
+/*
+ * catalog functions
+ */
+int CatalogFiles(const char *path);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Self-checks of the melody front-ends (make check)
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pwm-player.h"
+#include "pwm-player-midi.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+//
+// Open the MIDI data as a file of no name (the reader takes a path only):
+// the temporary file is unlinked at once and read through /proc/self/fd
+//
+static int OpenMIDIData(const unsigned char *data, size_t size, char *path, size_t pathSize) {
+	const char *dir = getenv("TMPDIR");
+	char tmpName[PATH_MAX];
+	int f;
+
+	snprintf(tmpName, sizeof(tmpName), "%s/pwm-player-check.XXXXXX", dir ? dir : "/tmp");
+	if ((f = mkstemp(tmpName)) < 0) {
+		fprintf(stderr, "Error creating %s(%d): %s\n", tmpName, errno, strerror(errno));
+		return -1;
+	}
+	unlink(tmpName);
+	if (write(f, data, size) != (ssize_t)size) {
+		fprintf(stderr, "Error writing %s(%d): %s\n", tmpName, errno, strerror(errno));
+		close(f);
+		return -1;
+	}
+	snprintf(path, pathSize, "/proc/self/fd/%d", f);
+	return f;
+}
+
+//
+// The arpeggiator has to get over the rest before the first chord and the one
+// between chords: two chords of 500 ms at 20 Hz, after 500 ms of silence each
+//
+static int CheckArpeggio() {
+	static const unsigned char midi[] = {
+		0x4d, 0x54, 0x68, 0x64, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x01, 0x01, 0xe0, 0x4d, 0x54,
+		0x72, 0x6b, 0x00, 0x00, 0x00, 0x38, 0x83, 0x60, 0x90, 0x3c, 0x64, 0x00, 0x90, 0x40, 0x64, 0x00,
+		0x90, 0x43, 0x64, 0x83, 0x60, 0x80, 0x3c, 0x00, 0x00, 0x80, 0x40, 0x00, 0x00, 0x80, 0x43, 0x00,
+		0x83, 0x60, 0x90, 0x3e, 0x64, 0x00, 0x90, 0x41, 0x64, 0x00, 0x90, 0x45, 0x64, 0x83, 0x60, 0x80,
+		0x3e, 0x00, 0x00, 0x80, 0x41, 0x00, 0x00, 0x80, 0x45, 0x00, 0x00, 0xff, 0x2f, 0x00
+	};
+	char path[32];
+	vector<int> chanOrder;
+	TTimeline tl;
+	int f, rc = 1;
+
+	if ((f = OpenMIDIData(midi, sizeof(midi), path, sizeof(path))) < 0) {
+		return -1;
+	}
+	if ((PrepareMIDIFile(path) < 0) || (PrepareMIDIArpeggio(tl, VOICE_HIGHEST, chanOrder, 20) < 0)) {
+		rc = -1;
+	}
+	CleanupMIDIFile();
+	close(f);
+	if (rc < 0) {
+		fprintf(stderr, "Unable to arpeggiate the test melody\n");
+		return -1;
+	}
+	for (size_t i = 0; i < tl.notes.size(); ++i) {
+		unsigned long t = tl.notes[i].start;
+		if ((t < 500000) || ((t >= 1000000) && (t < 1500000))) {
+			fprintf(stderr, "Arpeggio note at %lu us sounds in a rest\n", t);
+			return -1;
+		}
+	}
+	if ((tl.notes.size() != 20) || (tl.length != 2000000)) {
+		fprintf(stderr, "Arpeggio of %d notes %lu us, 20 notes 2000000 us expected\n", (int)tl.notes.size(), tl.length);
+		return -1;
+	}
+	printf("Arpeggio check passed\n");
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	if (CheckArpeggio() < 0) {
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,372 @@
+/*
+ * Compiled melody timelines and their on-disk cache
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "pwm-player.h"
+#include "pwm-player-compiled.h"
+#include "pwm-player-midi.h"
+#include "pwm-player-melody.h"
+#include "pwm-player-rtttl.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+#define CACHE_SUBDIR "/pwm-player"
+#define CACHE_RUNDIR "/run/pwm-player"
+#define CACHE_SUFFIX ".pwmt"
+
+#define DEFAULT_VOICE_SPEC "high"
+
+
+size_t CompiledSize(const TTimeline &tl) {
+	return sizeof(TCompiledHeader) + tl.notes.size() * (2 * sizeof(uint32_t) + 2 * sizeof(uint8_t));
+}
+
+//
+// Store timeline into the compiled form (data should have CompiledSize() bytes)
+//
+void EncodeCompiled(const TTimeline &tl, void *data) {
+	TCompiledHeader *hdr = (TCompiledHeader*)data;
+	uint32_t count = tl.notes.size();
+	uint32_t *onset = (uint32_t*)(hdr + 1);
+	uint32_t *duration = onset + count;
+	uint8_t *pitch = (uint8_t*)(duration + count);
+	uint8_t *velocity = pitch + count;
+	unsigned long prev = 0;
+
+	memcpy(hdr->magic, COMPILED_MAGIC, sizeof(hdr->magic));
+	hdr->version = COMPILED_VERSION;
+	hdr->count = count;
+	hdr->length = tl.length;
+	for (uint32_t i = 0; i < count; ++i) {
+		const TNote &n = tl.notes[i];
+		onset[i] = n.start - prev;
+		prev = n.start;
+		duration[i] = n.duration;
+		pitch[i] = n.pitch;
+		velocity[i] = n.velocity;
+	}
+}
+
+//
+// Restore timeline from the compiled form, checking it fits into size bytes
+//
+int DecodeCompiled(const void *data, size_t size, TTimeline &tl) {
+	const TCompiledHeader *hdr = (const TCompiledHeader*)data;
+
+	if ((size < sizeof(TCompiledHeader)) || (memcmp(hdr->magic, COMPILED_MAGIC, sizeof(hdr->magic)) != 0) ||
+			(hdr->version != COMPILED_VERSION)) {
+		return -1;
+	}
+	uint32_t count = hdr->count;
+	if ((size - sizeof(TCompiledHeader)) / (2 * sizeof(uint32_t) + 2 * sizeof(uint8_t)) < count) {
+		return -1;
+	}
+	const uint32_t *onset = (const uint32_t*)(hdr + 1);
+	const uint32_t *duration = onset + count;
+	const uint8_t *pitch = (const uint8_t*)(duration + count);
+	const uint8_t *velocity = pitch + count;
+	unsigned long t = 0;
+
+	tl.notes.resize(count);
+	tl.length = hdr->length;
+	for (uint32_t i = 0; i < count; ++i) {
+		TNote &n = tl.notes[i];
+		t += onset[i];
+		n.start = t;
+		n.duration = duration[i];
+		n.pitch = pitch[i];
+		n.velocity = velocity[i];
+		n.channel = 0;
+		n.track = 0;
+		n.voice = 0;
+		n.arpeggio = 0;
+	}
+	return 1;
+}
+
+//
+// Map the whole file into memory (read only)
+//
+const void *MapFile(const char *filename, size_t *size) {
+	struct stat fs;
+	void *p;
+	int f;
+
+	if ((f = open(filename, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if ((fstat(f, &fs) != 0) || (fs.st_size == 0)) {
+		close(f);
+		return NULL;
+	}
+	p = mmap(NULL, fs.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+	close(f);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	*size = fs.st_size;
+	return p;
+}
+
+int LoadCompiled(const char *filename, TTimeline &tl) {
+	size_t size;
+	const void *p;
+	int rc;
+
+	if ((p = MapFile(filename, &size)) == NULL) {
+		return -1;
+	}
+	rc = DecodeCompiled(p, size, tl);
+	munmap((void*)p, size);
+	return rc;
+}
+
+//
+// Write the data into a temporary file next to the target
+//
+static int WriteTemp(const char *filename, char *tmpName, size_t tmpSize, const void *data, size_t size) {
+	int f;
+
+	snprintf(tmpName, tmpSize, "%s.%d.%lx.tmp", filename, (int)getpid(), (unsigned long)pthread_self());
+	if ((f = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		return -1;
+	}
+	if (write(f, data, size) != (ssize_t)size) {
+		close(f);
+		unlink(tmpName);
+		return -1;
+	}
+	close(f);
+	return 1;
+}
+
+//
+// Write the file, replacing the target atomically
+//
+int WriteFileAtomic(const char *filename, const void *data, size_t size) {
+	char tmpName[FILENAME_MAX];
+
+	if (WriteTemp(filename, tmpName, sizeof(tmpName), data, size) < 0) {
+		return -1;
+	}
+	if (rename(tmpName, filename) != 0) {
+		unlink(tmpName);
+		return -1;
+	}
+	return 1;
+}
+
+//
+// Write the file only if there is none of that name (errno is EEXIST then),
+// the complete file appears at once
+//
+int WriteFileNew(const char *filename, const void *data, size_t size) {
+	char tmpName[FILENAME_MAX];
+	int rc = 1, err;
+
+	if (WriteTemp(filename, tmpName, sizeof(tmpName), data, size) < 0) {
+		return -1;
+	}
+	if (link(tmpName, filename) != 0) {
+		rc = -1;
+	}
+	err = errno;
+	unlink(tmpName);
+	errno = err;
+	return rc;
+}
+
+int SaveCompiled(const char *filename, const TTimeline &tl) {
+	vector<char> data(CompiledSize(tl));
+
+	EncodeCompiled(tl, &data[0]);
+	return WriteFileAtomic(filename, &data[0], data.size());
+}
+
+static bool IsMIDI(const void *data, size_t size) {
+	return (size >= 4) && (memcmp(data, "MThd", 4) == 0);
+}
+
+//
+// RTTTL has no signature, so it is recognized by the file name
+//
+bool IsRTTTLFile(const char *name) {
+	const char *p = strrchr(name, '.');
+	return (p != NULL) && ((strcasecmp(p, ".rtttl") == 0) || (strcasecmp(p, ".rtx") == 0));
+}
+
+//
+// Compile any supported melody file into a timeline
+//
+int CompileSource(const char *source, const char *voiceSpec, TTimeline &tl) {
+	char magic[4];
+	FILE *f;
+	bool midi;
+
+	if (IsRTTTLFile(source)) {
+		return CompileRTTTLFile(source, tl);
+	}
+	if ((f = fopen(source, "rb")) == NULL) {
+		fprintf(stderr, "Error opening %s(%d): %s\n", source, errno, strerror(errno));
+		return -1;
+	}
+	midi = IsMIDI(magic, fread(magic, 1, sizeof(magic), f));
+	fclose(f);
+	if (midi) {
+		TVoicePolicy policy;
+		vector<int> chanOrder;
+		if (ParseVoicePolicy(voiceSpec ? voiceSpec : DEFAULT_VOICE_SPEC, &policy, chanOrder) < 0) {
+			return -1;
+		}
+		return CompileMIDIFile(source, tl, policy, chanOrder);
+	}
+	return CompileMelodyFile(source, tl);
+}
+
+//
+// Cache entry name for the source file: FNV-1a hash of the file content and of
+// the options its timeline depends on, under $XDG_CACHE_HOME or /run.
+// Returns empty string if there is no usable cache directory.
+//
+string CacheFileName(const char *source, const char *voiceSpec) {
+	string dir;
+	const char *p;
+	const void *data;
+	size_t size;
+	uint64_t h = 14695981039346656037ULL;
+	char name[32];
+
+	if ((p = getenv("XDG_CACHE_HOME")) != NULL && *p) {
+		dir = string(p) + CACHE_SUBDIR;
+	} else {
+		dir = CACHE_RUNDIR;
+	}
+	if ((mkdir(dir.c_str(), 0755) != 0) && (errno != EEXIST)) {
+		return "";
+	}
+
+	if ((data = MapFile(source, &size)) == NULL) {
+		return "";
+	}
+	for (size_t i = 0; i < size; ++i) {
+		h = (h ^ ((const unsigned char*)data)[i]) * 1099511628211ULL;
+	}
+	// MIDI timeline also depends on the voice reduction options
+	if (IsMIDI(data, size)) {
+		for (p = voiceSpec ? voiceSpec : DEFAULT_VOICE_SPEC; *p; ++p) {
+			h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+		}
+	}
+	munmap((void*)data, size);
+	snprintf(name, sizeof(name), "/%016llx", (unsigned long long)h);
+	return dir + name + CACHE_SUFFIX;
+}
+
+static bool IsMelodyFile(const char *name) {
+	static const char *const exts[] = { ".mid", ".midi", ".imy", ".emy", ".rtttl", ".rtx" };
+	const char *p = strrchr(name, '.');
+
+	if (p == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); ++i) {
+		if (strcasecmp(p, exts[i]) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//
+// Collect melody files of the directory (or the file itself if it is not a directory)
+//
+int ListMelodyFiles(const char *path, vector<string> &files) {
+	DIR *d;
+	struct dirent *de;
+
+	if ((d = opendir(path)) == NULL) {
+		if (errno == ENOTDIR) {
+			files.push_back(path);
+			return 1;
+		}
+		fprintf(stderr, "Error opening directory %s(%d): %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (IsMelodyFile(de->d_name)) {
+			files.push_back(string(path) + "/" + de->d_name);
+		}
+	}
+	closedir(d);
+	return 1;
+}
+
+//
+// Run job(0..count-1) on all CPU cores
+//
+void RunParallel(size_t count, const std::function<void(size_t)> &job) {
+	std::atomic<size_t> next(0);
+	unsigned int nThreads = thread::hardware_concurrency();
+	vector<thread> workers;
+
+	if (nThreads == 0) {
+		nThreads = 1;
+	}
+	if (nThreads > count) {
+		nThreads = count;
+	}
+	for (unsigned int k = 0; k < nThreads; ++k) {
+		workers.push_back(thread([&]() {
+			size_t i;
+			while ((i = next++) < count) {
+				job(i);
+			}
+		}));
+	}
+	for (size_t k = 0; k < workers.size(); ++k) {
+		workers[k].join();
+	}
+}
+
+//
+// Precompile all melody files of the directory into the cache using all CPU cores
+//
+int CompileDirectory(const char *dir, const char *voiceSpec) {
+	vector<string> files;
+	std::atomic<int> failed(0);
+
+	if (ListMelodyFiles(dir, files) < 0) {
+		return -1;
+	}
+	RunParallel(files.size(), [&](size_t i) {
+		const char *source = files[i].c_str();
+		string cacheName = CacheFileName(source, voiceSpec);
+		TTimeline tl;
+		if (cacheName.empty()) {
+			fprintf(stderr, "No cache directory for %s\n", source);
+			++failed;
+		} else if ((CompileSource(source, voiceSpec, tl) < 0) || (SaveCompiled(cacheName.c_str(), tl) < 0)) {
+			fprintf(stderr, "Unable to compile %s\n", source);
+			++failed;
+		} else {
+			printf("%s: %d notes -> %s\n", source, (int)tl.notes.size(), cacheName.c_str());
+		}
+	});
+	printf("Compiled %d of %d files\n", (int)files.size() - failed, (int)files.size());
+	return failed ? -1 : 1;
+}
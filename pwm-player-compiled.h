@@ -0,0 +1,54 @@
+/*
+ * Compiled melody timelines and their on-disk cache
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_COMPILED_H_
+#define _PWM_PLAYER_COMPILED_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "pwm-player-timeline.h"
+
+#define COMPILED_MAGIC      "PWMT"
+#define COMPILED_VERSION    1
+
+/*
+ * compiled timeline layout (host byte order):
+ *   TCompiledHeader
+ *   uint32_t onset[count]      - delta from the previous note onset, microseconds
+ *   uint32_t duration[count]   - microseconds
+ *   uint8_t  pitch[count]
+ *   uint8_t  velocity[count]
+ */
+typedef struct {
+	char     magic[4];          // COMPILED_MAGIC
+	uint32_t version;           // COMPILED_VERSION
+	uint32_t count;             // number of notes
+	uint32_t length;            // melody length, microseconds
+} TCompiledHeader;
+
+/*
+ * compiled timeline handling functions
+ */
+size_t CompiledSize(const TTimeline &tl);
+void EncodeCompiled(const TTimeline &tl, void *data);
+int DecodeCompiled(const void *data, size_t size, TTimeline &tl);
+int LoadCompiled(const char *filename, TTimeline &tl);
+int SaveCompiled(const char *filename, const TTimeline &tl);
+int WriteFileAtomic(const char *filename, const void *data, size_t size);
+int WriteFileNew(const char *filename, const void *data, size_t size);
+
+const void *MapFile(const char *filename, size_t *size);
+bool IsRTTTLFile(const char *name);
+int CompileSource(const char *source, const char *voiceSpec, TTimeline &tl);
+std::string CacheFileName(const char *source, const char *voiceSpec);
+int ListMelodyFiles(const char *path, std::vector<std::string> &files);
+void RunParallel(size_t count, const std::function<void(size_t)> &job);
+int CompileDirectory(const char *dir, const char *voiceSpec);
+
+#endif
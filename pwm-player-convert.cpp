@@ -0,0 +1,579 @@
+/*
+ * Melody format converter
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <algorithm>
+
+#include "pwm-player.h"
+#include "pwm-player-convert.h"
+#include "pwm-player-compiled.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+#define MIN_BEAT            25
+#define MAX_BEAT            900
+#define MAX_LINE_SIZE       75          // iMelody/eMelody lines are kept within the spec limit
+#define MIDI_DIVISION       500         // with 500000 us per quarter a tick is 1 ms
+#define MIDI_TEMPO          500000
+#define DEFAULT_VOLUME      7
+#define EVENT_COST          2000        // every extra rest is worth that much onset error, us
+
+static const struct {
+	const char *name;
+	const char *suffix;
+	TConvertFormat format;
+} Formats[] = {
+	{ "imy", ".imy", CONVERT_IMELODY },
+	{ "emy", ".emy", CONVERT_EMELODY },
+	{ "rtttl", ".rtttl", CONVERT_RTTTL },
+	{ "mid", ".mono.mid", CONVERT_MIDI },
+	{ "pwmt", ".pwmt", CONVERT_COMPILED }
+};
+
+/* note names by semitone from C */
+static const char NoteLetter[] = "ccddeffggaab";
+static const bool NoteSharp[] = { false, true, false, true, false, false, true, false, true, false, true, false };
+
+namespace {
+
+// representable duration: iMelody <base digit><modifier>, eMelody short/long with '.',
+// RTTTL <divisor>['.']
+struct TStep {
+	unsigned long us;
+	int base;
+	char mod;
+
+	bool operator<(const TStep &s) const {
+		return us < s.us;
+	}
+};
+
+struct TEvent {
+	bool rest;
+	unsigned char pitch;
+	unsigned char velocity;
+	TStep step;
+};
+
+} // namespace
+
+int ParseConvertFormat(const char *spec, TConvertFormat *format) {
+	for (size_t i = 0; i < sizeof(Formats) / sizeof(Formats[0]); ++i) {
+		if (strcmp(spec, Formats[i].name) == 0) {
+			*format = Formats[i].format;
+			return 1;
+		}
+	}
+	fprintf(stderr, "Invalid conversion format '%s' (imy, emy, rtttl, mid or pwmt expected)\n", spec);
+	return -1;
+}
+
+//
+// Durations available for the format at the given tempo, with the same
+// integer arithmetic as the parsers use
+//
+static void MakeGrid(TConvertFormat format, int beat, vector<TStep> &grid) {
+	static const char mods[] = { 0, '.', ':', ';' };
+	unsigned long tick = 1920000 / beat;        // iMelody 32nd note, 1/256 msec
+	TStep s;
+
+	grid.clear();
+	if (format == CONVERT_IMELODY) {
+		for (int base = 0; base <= 5; ++base) {
+			for (size_t m = 0; m < sizeof(mods); ++m) {
+				unsigned long d = tick << (5 - base);
+				if (mods[m] == '.') {
+					d += d >> 1;
+				} else if (mods[m] == ':') {
+					d += (d >> 1) + (d >> 2);
+				} else if (mods[m] == ';') {
+					d = (d * 683) >> 10;
+				}
+				s.us = (unsigned long)(((unsigned long long)d * 1000) / 256);
+				s.base = base;
+				s.mod = mods[m];
+				grid.push_back(s);
+			}
+		}
+	} else if (format == CONVERT_EMELODY) {
+		for (int base = 0; base <= 1; ++base) {
+			unsigned long d = base ? tick * 16 : tick * 4;
+			s.base = base;
+			s.mod = 0;
+			s.us = (unsigned long)(((unsigned long long)d * 1000) / 256);
+			grid.push_back(s);
+			s.mod = '.';
+			s.us = (unsigned long)(((unsigned long long)d * 2 * 1000) / 256);
+			grid.push_back(s);
+		}
+	} else {
+		unsigned long whole = 4UL * 60 * 1000000 / beat;
+		for (int d = 1; d <= 32; d *= 2) {
+			s.base = d;
+			s.mod = 0;
+			s.us = whole / d;
+			grid.push_back(s);
+			s.mod = '.';
+			s.us += s.us / 2;
+			grid.push_back(s);
+		}
+	}
+	sort(grid.begin(), grid.end());
+}
+
+static const TStep &Closest(const vector<TStep> &grid, long long us) {
+	TStep key;
+	key.us = (us > 0) ? (unsigned long)us : 0;
+	vector<TStep>::const_iterator it = lower_bound(grid.begin(), grid.end(), key);
+	if (it == grid.end()) {
+		return grid.back();
+	}
+	if ((it != grid.begin()) && (us - (long long)(it - 1)->us < (long long)it->us - us)) {
+		return *(it - 1);
+	}
+	return *it;
+}
+
+//
+// Place notes and rests on the grid, aiming at absolute onsets so that the
+// rounding never accumulates. Returns the sum of onset errors plus EVENT_COST
+// for every rest, microseconds.
+//
+static unsigned long long Quantize(const TTimeline &tl, const vector<TStep> &grid, vector<TEvent> *events) {
+	unsigned long long cost = 0;
+	long long q = 0;
+	TEvent e;
+
+	for (size_t i = 0; i < tl.notes.size(); ++i) {
+		const TNote &n = tl.notes[i];
+		long long r;
+		while ((r = (long long)n.start - q) > 0) {
+			const TStep &s = Closest(grid, r);
+			if (llabs(r - (long long)s.us) >= r) {
+				break;
+			}
+			if (events) {
+				e.rest = true;
+				e.pitch = e.velocity = 0;
+				e.step = s;
+				events->push_back(e);
+			}
+			q += s.us;
+			cost += EVENT_COST;
+		}
+		cost += llabs((long long)n.start - q);
+		unsigned long end = n.start + n.duration;
+		if ((i + 1 < tl.notes.size()) && (tl.notes[i + 1].start < end)) {
+			end = tl.notes[i + 1].start;
+		}
+		const TStep &s = Closest(grid, (long long)end - q);
+		if (events) {
+			e.rest = false;
+			e.pitch = n.pitch;
+			e.velocity = n.velocity;
+			e.step = s;
+			events->push_back(e);
+		}
+		q += s.us;
+	}
+	return cost;
+}
+
+//
+// Find the tempo giving the smallest onset error with the fewest rests
+//
+static int BestBeat(const TTimeline &tl, TConvertFormat format, vector<TEvent> &events) {
+	vector<TStep> grid;
+	unsigned long long best = ~0ULL;
+	int bestBeat = 120;
+
+	for (int beat = MIN_BEAT; beat <= MAX_BEAT; ++beat) {
+		MakeGrid(format, beat, grid);
+		unsigned long long cost = Quantize(tl, grid, NULL);
+		if (cost < best) {
+			best = cost;
+			bestBeat = beat;
+		}
+	}
+	MakeGrid(format, bestBeat, grid);
+	events.clear();
+	Quantize(tl, grid, &events);
+	return bestBeat;
+}
+
+//
+// Append token to the melody, wrapping lines at the spec limit
+//
+static void AddToken(string &out, size_t &lineLen, const string &token) {
+	if (lineLen + token.size() > MAX_LINE_SIZE) {
+		out += "\r\n";
+		lineLen = 0;
+	}
+	out += token;
+	lineLen += token.size();
+}
+
+static void EncodeIMelody(const TTimeline &tl, string &out) {
+	vector<TEvent> events;
+	int beat = BestBeat(tl, CONVERT_IMELODY, events);
+	int octave = -1;
+	int volume = DEFAULT_VOLUME;
+	size_t lineLen;
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "BEAT:%d\r\n", beat);
+	out = string("BEGIN:IMELODY\r\nVERSION:1.2\r\nFORMAT:CLASS1.0\r\n") + buf + "STYLE:S1\r\nMELODY:";
+	lineLen = 7;
+	for (size_t i = 0; i < events.size(); ++i) {
+		const TEvent &e = events[i];
+		string token;
+		if (e.rest) {
+			token = "r";
+		} else {
+			int p = e.pitch;
+			int v = (e.velocity + 4) / 8;
+			while (p < 12) {
+				p += 12;
+			}
+			while (p >= 9 * 12 + 12) {
+				p -= 12;
+			}
+			if (v < 1) {
+				v = 1;
+			} else if (v > 15) {
+				v = 15;
+			}
+			if (v != volume) {
+				snprintf(buf, sizeof(buf), "V%d", v);
+				token += buf;
+				volume = v;
+			}
+			if (p / 12 - 1 != octave) {
+				octave = p / 12 - 1;
+				snprintf(buf, sizeof(buf), "*%d", octave);
+				token += buf;
+			}
+			if (NoteSharp[p % 12]) {
+				token += '#';
+			}
+			token += NoteLetter[p % 12];
+		}
+		token += (char)('0' + e.step.base);
+		if (e.step.mod) {
+			token += e.step.mod;
+		}
+		AddToken(out, lineLen, token);
+	}
+	out += "\r\nEND:IMELODY\r\n";
+}
+
+static void EncodeEMelody(const TTimeline &tl, string &out) {
+	vector<TEvent> events;
+	int beat = BestBeat(tl, CONVERT_EMELODY, events);
+	size_t lineLen;
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "BEAT:%d\r\n", beat);
+	out = string("BEGIN:EMELODY\r\nVERSION:1.0\r\n") + buf + "MELODY:";
+	lineLen = 7;
+	for (size_t i = 0; i < events.size(); ++i) {
+		const TEvent &e = events[i];
+		string token;
+		if (e.rest) {
+			token = e.step.base ? "P" : "p";
+		} else {
+			// eMelody has three octaves only
+			int p = e.pitch;
+			while (p < 48) {
+				p += 12;
+			}
+			while (p >= 84) {
+				p -= 12;
+			}
+			token.append((p - 48) / 12, '+');
+			if (NoteSharp[p % 12]) {
+				token += '#';
+			}
+			token += e.step.base ? (char)toupper(NoteLetter[p % 12]) : NoteLetter[p % 12];
+		}
+		if (e.step.mod) {
+			token += e.step.mod;
+		}
+		AddToken(out, lineLen, token);
+	}
+	out += "\r\nEND:EMELODY\r\n";
+}
+
+static void EncodeRTTTL(const TTimeline &tl, const char *name, string &out) {
+	vector<TEvent> events;
+	int beat = BestBeat(tl, CONVERT_RTTTL, events);
+	char buf[32];
+
+	// Nokia phones take up to 10 characters of the name
+	out.clear();
+	for (const char *p = name; *p && (out.size() < 10); ++p) {
+		if ((*p != ':') && (*p != ',') && !isspace((unsigned char)*p)) {
+			out += *p;
+		}
+	}
+	snprintf(buf, sizeof(buf), ":d=4,o=5,b=%d:", beat);
+	out += buf;
+	for (size_t i = 0; i < events.size(); ++i) {
+		const TEvent &e = events[i];
+		if (i) {
+			out += ',';
+		}
+		if (e.step.base != 4) {
+			snprintf(buf, sizeof(buf), "%d", e.step.base);
+			out += buf;
+		}
+		if (e.rest) {
+			out += 'p';
+		} else {
+			int p = e.pitch;
+			while (p < 12) {
+				p += 12;
+			}
+			while (p >= 9 * 12 + 12) {
+				p -= 12;
+			}
+			out += NoteLetter[p % 12];
+			if (NoteSharp[p % 12]) {
+				out += '#';
+			}
+			if (p / 12 - 1 != 5) {
+				out += (char)('0' + p / 12 - 1);
+			}
+		}
+		if (e.step.mod) {
+			out += '.';
+		}
+	}
+	out += "\n";
+}
+
+static void PutBE(string &out, unsigned long v, int bytes) {
+	while (bytes--) {
+		out += (char)((v >> (bytes * 8)) & 0xff);
+	}
+}
+
+static void PutVLQ(string &out, unsigned long v) {
+	char buf[5];
+	int n = 0;
+
+	buf[n++] = v & 0x7f;
+	while ((v >>= 7) != 0) {
+		buf[n++] = 0x80 | (v & 0x7f);
+	}
+	while (n--) {
+		out += buf[n];
+	}
+}
+
+static void EncodeMIDI(const TTimeline &tl, string &out) {
+	string trk;
+	unsigned long now = 0;
+
+	PutVLQ(trk, 0);
+	trk += "\xff\x51\x03";
+	PutBE(trk, MIDI_TEMPO, 3);
+	for (size_t i = 0; i < tl.notes.size(); ++i) {
+		const TNote &n = tl.notes[i];
+		unsigned long on = (n.start + 500) / 1000;
+		unsigned long off = (n.start + n.duration + 500) / 1000;
+		if (on < now) {
+			on = now;
+		}
+		if (off <= on) {
+			off = on + 1;
+		}
+		PutVLQ(trk, on - now);
+		trk += (char)0x90;
+		trk += (char)(n.pitch & 0x7f);
+		trk += (char)(n.velocity ? (n.velocity & 0x7f) : 1);
+		PutVLQ(trk, off - on);
+		trk += (char)0x80;
+		trk += (char)(n.pitch & 0x7f);
+		trk += (char)0;
+		now = off;
+	}
+	PutVLQ(trk, 0);
+	trk += string("\xff\x2f\x00", 3);
+
+	out = "MThd";
+	PutBE(out, 6, 4);
+	PutBE(out, 0, 2);                   // format 0
+	PutBE(out, 1, 2);                   // one track
+	PutBE(out, MIDI_DIVISION, 2);
+	out += "MTrk";
+	PutBE(out, trk.size(), 4);
+	out += trk;
+}
+
+//
+// Render the timeline in the given format
+//
+int EncodeMelody(const TTimeline &tl, TConvertFormat format, const char *name, string &out) {
+	if (tl.notes.empty() && (format != CONVERT_COMPILED)) {
+		return -1;
+	}
+	switch (format) {
+	case CONVERT_IMELODY:
+		EncodeIMelody(tl, out);
+		break;
+	case CONVERT_EMELODY:
+		EncodeEMelody(tl, out);
+		break;
+	case CONVERT_RTTTL:
+		EncodeRTTTL(tl, name, out);
+		break;
+	case CONVERT_MIDI:
+		EncodeMIDI(tl, out);
+		break;
+	case CONVERT_COMPILED:
+		out.resize(CompiledSize(tl));
+		EncodeCompiled(tl, &out[0]);
+		break;
+	}
+	return 1;
+}
+
+static string OutputName(const string &source, TConvertFormat format, string &base) {
+	size_t slash = source.rfind('/');
+	size_t dot = source.rfind('.');
+	string stem = ((dot != string::npos) && ((slash == string::npos) || (dot > slash))) ? source.substr(0, dot) : source;
+
+	base = (slash != string::npos) ? stem.substr(slash + 1) : stem;
+	for (size_t i = 0; i < sizeof(Formats) / sizeof(Formats[0]); ++i) {
+		if (Formats[i].format == format) {
+			return stem + Formats[i].suffix;
+		}
+	}
+	return stem;
+}
+
+//
+// Pick the files to convert before anything is written: a target may be neither
+// an input nor an existing file, and two inputs may not share a target (song.mid
+// and song.rtttl both make song.imy). An input that is the target of another one
+// is the output of an earlier run and is not converted again. The skipped files
+// are reported, they are not failures (a directory may be converted again).
+//
+static void CheckTargets(const vector<string> &files, const vector<string> &targets, vector<bool> &convert) {
+	map<string, size_t> inputs, owners;
+	struct stat fs;
+
+	for (size_t i = 0; i < files.size(); ++i) {
+		inputs[files[i]] = i;
+	}
+	for (size_t i = 0; i < files.size(); ++i) {
+		convert[i] = false;
+		if (targets[i] == files[i]) {
+			fprintf(stderr, "%s is already in the target format, skipped\n", files[i].c_str());
+		} else if (inputs.count(targets[i])) {
+			fprintf(stderr, "%s: target %s is one of the inputs, skipped\n", files[i].c_str(), targets[i].c_str());
+		} else if (owners.count(targets[i])) {
+			fprintf(stderr, "%s: target %s is also made from %s, skipped\n", files[i].c_str(), targets[i].c_str(),
+				files[owners[targets[i]]].c_str());
+		} else if (stat(targets[i].c_str(), &fs) == 0) {
+			fprintf(stderr, "%s: target %s already exists, skipped\n", files[i].c_str(), targets[i].c_str());
+		} else {
+			owners[targets[i]] = i;
+			convert[i] = true;
+		}
+	}
+	// outputs of an earlier run are not converted again
+	for (size_t i = 0; i < files.size(); ++i) {
+		if (inputs.count(targets[i])) {
+			size_t k = inputs[targets[i]];
+			if (convert[k]) {
+				fprintf(stderr, "%s is the output of an earlier conversion, skipped\n", files[k].c_str());
+				convert[k] = false;
+			}
+		}
+	}
+}
+
+//
+// Convert every source file, in parallel. The result is read back by the
+// regular parser and compared with the source timeline to report the timing error.
+//
+int ConvertFiles(const vector<string> &sources, TConvertFormat format, const char *voiceSpec) {
+	vector<string> files, targets, bases;
+	vector<bool> convert;
+	std::atomic<int> failed(0), converted(0);
+
+	for (size_t i = 0; i < sources.size(); ++i) {
+		if (ListMelodyFiles(sources[i].c_str(), files) < 0) {
+			return -1;
+		}
+	}
+	targets.resize(files.size());
+	bases.resize(files.size());
+	convert.resize(files.size());
+	for (size_t i = 0; i < files.size(); ++i) {
+		targets[i] = OutputName(files[i], format, bases[i]);
+	}
+	CheckTargets(files, targets, convert);
+	RunParallel(files.size(), [&](size_t i) {
+		const char *source = files[i].c_str();
+		const string &base = bases[i];
+		const string &target = targets[i];
+		TTimeline tl, check;
+		string data;
+
+		if (!convert[i]) {
+			return;
+		}
+		if (CompileSource(source, voiceSpec, tl) < 0) {
+			fprintf(stderr, "Unable to read %s\n", source);
+			++failed;
+			return;
+		}
+		if (EncodeMelody(tl, format, base.c_str(), data) < 0) {
+			fprintf(stderr, "Nothing to convert in %s\n", source);
+			++failed;
+			return;
+		}
+		// created exclusively: a file that appeared since the check is kept
+		if (WriteFileNew(target.c_str(), data.data(), data.size()) < 0) {
+			if (errno == EEXIST) {
+				fprintf(stderr, "%s: target %s already exists, skipped\n", source, target.c_str());
+				return;
+			}
+			fprintf(stderr, "Error writing %s(%d): %s\n", target.c_str(), errno, strerror(errno));
+			++failed;
+			return;
+		}
+		if (((format == CONVERT_COMPILED) ? LoadCompiled(target.c_str(), check) : CompileSource(target.c_str(), voiceSpec, check)) < 0) {
+			fprintf(stderr, "Unable to read back %s\n", target.c_str());
+			++failed;
+			return;
+		}
+
+		unsigned long maxErr = 0;
+		unsigned long long sumErr = 0;
+		size_t n = min(tl.notes.size(), check.notes.size());
+		for (size_t k = 0; k < n; ++k) {
+			unsigned long a = tl.notes[k].start, b = check.notes[k].start;
+			unsigned long err = (a > b) ? a - b : b - a;
+			maxErr = max(maxErr, err);
+			sumErr += err;
+		}
+		printf("%s: %d notes -> %s, %d bytes, onset error max %.1f ms, mean %.2f ms%s\n", source, (int)tl.notes.size(),
+			target.c_str(), (int)data.size(), maxErr / 1000.0, n ? sumErr / 1000.0 / n : 0.0,
+			(check.notes.size() != tl.notes.size()) ? " (note count differs)" : "");
+		++converted;
+	});
+	printf("Converted %d of %d files\n", (int)converted, (int)files.size());
+	return failed ? -1 : 1;
+}
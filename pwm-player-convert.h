@@ -0,0 +1,33 @@
+/*
+ * Melody format converter
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_CONVERT_H_
+#define _PWM_PLAYER_CONVERT_H_
+
+#include <string>
+#include <vector>
+
+#include "pwm-player-timeline.h"
+
+/*
+ * output formats of --convert
+ */
+typedef enum {
+	CONVERT_IMELODY,        // imy
+	CONVERT_EMELODY,        // emy
+	CONVERT_RTTTL,          // rtttl
+	CONVERT_MIDI,           // mid: format 0, single channel, 1 ms ticks
+	CONVERT_COMPILED        // pwmt: compiled timeline (exact)
+} TConvertFormat;
+
+/*
+ * melody conversion functions
+ */
+int ParseConvertFormat(const char *spec, TConvertFormat *format);
+int EncodeMelody(const TTimeline &tl, TConvertFormat format, const char *name, std::string &out);
+int ConvertFiles(const std::vector<std::string> &sources, TConvertFormat format, const char *voiceSpec);
+
+#endif
@@ -0,0 +1,752 @@
+/*
+ * Playback daemon and its client
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <deque>
+#include <memory>
+
+#include "pwm-player.h"
+#include "pwm-player-pwm.h"
+#include "pwm-player-daemon.h"
+#include "pwm-player-playlist.h"
+#include "pwm-player-status.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+#define MAX_REQUEST_SIZE    4096
+#define MAX_CACHED          64          // parsed melodies kept in memory
+#define CLIENT_TIMEOUT      1           // seconds a client may take to send its request
+#define MAX_BUCKETS         256         // full token buckets are forgotten above that
+
+typedef std::shared_ptr<const TTimeline> TTimelinePtr;
+
+typedef struct {
+	TTimelinePtr timeline;
+	string source;
+	TPoint received;            // when the request came in (for the latency report)
+	int priority;               // higher priority requests preempt lower ones
+	bool resume;                // continue after preemption rather than be dropped
+	unsigned long offset;       // position to (re)start from, microseconds
+} TRequest;
+
+// why the melody being played has to stop
+typedef enum {
+	ABORT_NONE,
+	ABORT_STOP,                 // stopped or replaced: dropped
+	ABORT_PREEMPT               // higher priority request came: dropped or requeued
+} TAbort;
+
+typedef struct {
+	double tokens;
+	TPoint last;                // when the bucket was refilled
+} TBucket;
+
+typedef struct {
+	unsigned long requests;     // play and queue requests
+	unsigned long coalesced;    // same melody was already pending
+	unsigned long limitedMelody;
+	unsigned long limitedSource;
+	unsigned long preempted;
+	unsigned long dropped;      // removed by stop, play or preemption
+	unsigned long played;       // played to the end
+} TCounters;
+
+typedef struct {
+	TTimelinePtr timeline;
+	time_t mtime;               // of the source file (0 for melodies given in the request itself)
+	off_t size;
+} TCached;
+
+typedef struct {
+	TPWMDevice *dev;
+	std::deque<TRequest> queue;     // by priority, then by arrival
+	TRequest current;               // melody being played
+	bool playing;
+	TPoint t0;                      // when the melody being played started
+	size_t next;                    // its next note
+	unsigned long end;              // end of the note sounding (ULONG_MAX for silence), microseconds
+	TPoint deadline;                // of the next output change while playing
+} TZone;
+
+typedef struct {
+	string id;                  // requests are rate limited per client id
+	string buf;                 // request text got so far
+	TPoint expires;             // the client is dropped after CLIENT_TIMEOUT of silence
+} TClient;
+
+static vector<TZone> Zones;
+static map<int, TClient> Clients;     // by socket
+static TCounters Counters;
+
+static TRateLimit MelodyLimit, SourceLimit;
+static map<string, TBucket> MelodyBuckets, SourceBuckets;
+
+// parsed melodies by source, shared by all the zones
+static map<string, TCached> Cache;
+
+static const char *SocketPath = NULL;
+
+static void RemoveSocket() {
+	if (SocketPath) {
+		unlink(SocketPath);
+	}
+}
+
+//
+// Release the devices of the zones but the first one (the player's own)
+//
+static void CloseZones() {
+	for (size_t i = 1; i < Zones.size(); ++i) {
+		ClosePWMDevice(Zones[i].dev);
+		delete Zones[i].dev;
+	}
+	Zones.resize(Zones.empty() ? 0 : 1);
+}
+
+//
+// Put request into the queue after the ones of the same or higher priority
+// (or before the ones of the same priority if it was preempted)
+//
+static void Enqueue(TZone &z, const TRequest &r, bool ahead) {
+	std::deque<TRequest>::iterator i = z.queue.begin();
+
+	while ((i != z.queue.end()) && ((i->priority > r.priority) || (!ahead && (i->priority == r.priority)))) {
+		++i;
+	}
+	z.queue.insert(i, r);
+}
+
+//
+// Sound (or mute with velocity < 0) on the device of the zone
+//
+static void ZoneSound(TZone &z, int pitch, int velocity) {
+	TPWMDevice *cur = PWM;
+
+	PWM = z.dev;
+	if (velocity < 0) {
+		Mute();
+	} else {
+		Sound(pitch, velocity);
+	}
+	PWM = cur;
+}
+
+static unsigned long ZonePosition(const TZone &z) {
+	TPoint now = NOW;
+
+	return (now > z.t0) ? (unsigned long)duration_cast<microseconds>(now - z.t0).count() : 0;
+}
+
+//
+// Finish the melody being played: played to the end, stopped or preempted
+//
+static void EndCurrent(TZone &z, TAbort why) {
+	unsigned long pos = (why == ABORT_NONE) ? z.current.timeline->length : ZonePosition(z);
+
+	ZoneSound(z, 0, -1);
+	z.playing = false;
+	if (why == ABORT_NONE) {
+		++Counters.played;
+	} else if ((why == ABORT_PREEMPT) && z.current.resume && (pos < z.current.timeline->length)) {
+		if (Debug) {
+			printf("%s preempted at %lu ms, will resume\n", z.current.source.c_str(), pos / 1000);
+		}
+		++Counters.preempted;
+		z.current.offset = pos;
+		z.current.received = NOW;
+		Enqueue(z, z.current, true);
+	} else {
+		if (Debug) {
+			printf("%s %s at %lu ms\n", z.current.source.c_str(), (why == ABORT_PREEMPT) ? "preempted" : "stopped", pos / 1000);
+		}
+		Counters.preempted += (why == ABORT_PREEMPT);
+		++Counters.dropped;
+	}
+	z.current.timeline.reset();
+	if (z.queue.empty()) {
+		StatusState(STATE_IDLE);
+	}
+}
+
+//
+// Start the first queued melody from its offset (the note sounding at a
+// resume point is restarted for its rest)
+//
+static void StartNext(TZone &z) {
+	if (z.playing || z.queue.empty()) {
+		return;
+	}
+	z.current = z.queue.front();
+	z.queue.pop_front();
+	z.playing = true;
+	z.t0 = NOW - microseconds(z.current.offset);
+	z.next = SeekTimeline(*z.current.timeline, z.current.offset) - 1;
+	z.end = ULONG_MAX;
+	const vector<TNote> &notes = z.current.timeline->notes;
+	if ((z.next > 0) && (notes[z.next - 1].start + notes[z.next - 1].duration > z.current.offset)) {
+		--z.next;
+	}
+	if (Debug) {
+		printf("Zone %d: playing %s from %lu ms (priority %d), %ld us after the request\n", (int)(&z - &Zones[0]),
+			z.current.source.c_str(), z.current.offset / 1000, z.current.priority,
+			(long)duration_cast<microseconds>(NOW - z.current.received).count());
+	}
+	StatusMelody(z.current.source.c_str(), z.current.timeline->length, z.t0);
+}
+
+//
+// Make the output changes of the zone that are due and find its next deadline.
+// Every change is scheduled against the absolute start time like PlayTimeline
+// does, so a late wakeup never accumulates into a tempo drift.
+//
+static void StepZone(TZone &z) {
+	StartNext(z);
+	while (z.playing) {
+		const vector<TNote> &notes = z.current.timeline->notes;
+		unsigned long pos = ZonePosition(z);
+
+		if ((z.end != ULONG_MAX) && ((z.next >= notes.size()) || (notes[z.next].start > z.end))) {
+			// silence (or the melody end) follows the sounding note
+			if (pos < z.end) {
+				z.deadline = z.t0 + microseconds(z.end);
+				return;
+			}
+			ZoneSound(z, 0, -1);
+			z.end = ULONG_MAX;
+		} else if (z.next < notes.size()) {
+			const TNote &n = notes[z.next];
+			if (pos < n.start) {
+				z.deadline = z.t0 + microseconds(n.start);
+				return;
+			}
+			StatusLate(pos - n.start);
+			ZoneSound(z, n.pitch, n.velocity);
+			z.end = n.start + n.duration;
+			++z.next;
+		} else {
+			EndCurrent(z, ABORT_NONE);
+			StartNext(z);
+		}
+	}
+}
+
+//
+// Parse melody source ("-<option> <argument>") into a timeline, reusing the parsed
+// one while its file is unchanged
+//
+static int LoadSource(const string &source, const char *voiceSpec, TTimelinePtr &tl, string &err) {
+	struct stat fs;
+	char opt;
+	string arg;
+	string file;
+
+	if ((source.size() < 4) || (source[0] != '-') || (source[2] != ' ') || (source.find_first_not_of(' ', 2) == string::npos)) {
+		err = "melody source expected";
+		return -1;
+	}
+	opt = source[1];
+	arg = source.substr(source.find_first_not_of(' ', 2));
+	if (strchr("mierP", opt) != NULL) {
+		file = (opt == 'P') ? arg.substr(0, arg.rfind(':')) : arg;
+		if (stat(file.c_str(), &fs) != 0) {
+			err = file + ": " + strerror(errno);
+			return -1;
+		}
+	} else if (strchr("IERN", opt) != NULL) {
+		fs.st_mtime = 0;
+		fs.st_size = 0;
+	} else {
+		err = string("unknown melody option -") + opt;
+		return -1;
+	}
+
+	map<string, TCached>::iterator c = Cache.find(source);
+	if ((c != Cache.end()) && (c->second.mtime == fs.st_mtime) && (c->second.size == fs.st_size)) {
+		tl = c->second.timeline;
+		return 1;
+	}
+
+	std::shared_ptr<TTimeline> p = std::make_shared<TTimeline>();
+	if (CompileMelodySource(opt, arg.c_str(), voiceSpec, *p) < 0) {
+		err = "unable to load " + arg;
+		return -1;
+	}
+
+	if (Cache.size() >= MAX_CACHED) {
+		Cache.clear();
+	}
+	TCached entry = { p, fs.st_mtime, fs.st_size };
+	Cache[source] = entry;
+	tl = p;
+	return 1;
+}
+
+//
+// Parse rate limit "<requests per second>[:<burst>]" ("0" disables the limit)
+//
+int ParseRateLimit(const char *spec, TRateLimit *limit) {
+	char *p;
+
+	limit->rate = strtod(spec, &p);
+	limit->burst = (limit->rate > 1) ? limit->rate : 1;
+	if (*p == ':') {
+		limit->burst = strtod(p + 1, &p);
+	}
+	if (*p || (limit->rate < 0) || (limit->burst < 1)) {
+		fprintf(stderr, "Invalid rate limit '%s' (<requests per second>[:<burst>] expected)\n", spec);
+		return -1;
+	}
+	return 1;
+}
+
+//
+// Token bucket: every request takes a token, tokens come back at the limit rate
+// up to the burst size
+//
+static bool TakeToken(map<string, TBucket> &buckets, const string &key, const TRateLimit &limit, TPoint now) {
+	if (limit.rate <= 0) {
+		return true;
+	}
+	if (buckets.size() > MAX_BUCKETS) {
+		for (map<string, TBucket>::iterator i = buckets.begin(); i != buckets.end(); ) {
+			double t = i->second.tokens + duration_cast<microseconds>(now - i->second.last).count() * limit.rate / 1e6;
+			if (t >= limit.burst) {
+				buckets.erase(i++);
+			} else {
+				++i;
+			}
+		}
+	}
+	map<string, TBucket>::iterator i = buckets.find(key);
+	if (i == buckets.end()) {
+		TBucket b = { limit.burst, now };
+		i = buckets.insert(make_pair(key, b)).first;
+	}
+	TBucket &b = i->second;
+	b.tokens = min(limit.burst, b.tokens + duration_cast<microseconds>(now - b.last).count() * limit.rate / 1e6);
+	b.last = now;
+	if (b.tokens < 1) {
+		return false;
+	}
+	b.tokens -= 1;
+	return true;
+}
+
+//
+// Request with the same melody and priority is already waiting or just playing
+//
+static bool IsPending(const TZone &z, const TRequest &r) {
+	if (z.playing && (z.current.source == r.source) && (z.current.priority == r.priority)) {
+		return true;
+	}
+	for (size_t i = 0; i < z.queue.size(); ++i) {
+		if ((z.queue[i].source == r.source) && (z.queue[i].priority == r.priority)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static string Statistics() {
+	char buf[256];
+	unsigned queued = 0;
+
+	for (size_t i = 0; i < Zones.size(); ++i) {
+		queued += Zones[i].queue.size() + (Zones[i].playing ? 1 : 0);
+	}
+	snprintf(buf, sizeof(buf), "ok requests=%lu played=%lu coalesced=%lu limited_melody=%lu limited_source=%lu "
+		"preempted=%lu dropped=%lu queued=%u zones=%u", Counters.requests, Counters.played, Counters.coalesced,
+		Counters.limitedMelody, Counters.limitedSource, Counters.preempted, Counters.dropped,
+		queued, (unsigned)Zones.size());
+	return buf;
+}
+
+//
+// Handle one request line of the given client, returning the reply
+//
+static string HandleRequest(const string &line, const string &client, const char *voiceSpec) {
+	size_t pos = line.find(' ');
+	string cmd = line.substr(0, pos);
+	string source;
+	string from = client;
+	TRequest r;
+	string err;
+	int zone = 0;
+
+	r.received = NOW;
+	r.priority = 0;
+	r.resume = false;
+	r.offset = 0;
+	// attributes go before the melody source
+	while ((pos = line.find_first_not_of(' ', pos)) != string::npos) {
+		size_t end = line.find(' ', pos);
+		string word = line.substr(pos, end - pos);
+		if (word[0] == '-') {
+			source = line.substr(pos);
+			break;
+		}
+		if (word.compare(0, 5, "prio=") == 0) {
+			r.priority = atoi(word.c_str() + 5);
+		} else if (word == "resume") {
+			r.resume = true;
+		} else if (word == "drop") {
+			r.resume = false;
+		} else if (word.compare(0, 5, "from=") == 0) {
+			from = word.substr(5);
+		} else if (word.compare(0, 5, "zone=") == 0) {
+			zone = atoi(word.c_str() + 5);
+			if ((zone < 0) || ((size_t)zone >= Zones.size())) {
+				return "error no zone " + word.substr(5);
+			}
+		} else {
+			return "error unknown attribute '" + word + "'";
+		}
+		pos = end;
+	}
+	r.source = source;
+	TZone &z = Zones[zone];
+
+	if (cmd == "stop") {
+		Counters.dropped += z.queue.size();
+		z.queue.clear();
+		if (z.playing) {
+			EndCurrent(z, ABORT_STOP);
+		}
+		return "ok";
+	}
+	if (cmd == "stats") {
+		return Statistics();
+	}
+	if ((cmd != "play") && (cmd != "queue")) {
+		return "error unknown request '" + cmd + "'";
+	}
+
+	// bursts of the same alert are folded and limited before anything is parsed
+	++Counters.requests;
+	if (IsPending(z, r)) {
+		++Counters.coalesced;
+		return "ok coalesced";
+	}
+	// melodies are limited across the zones, so a flood on one zone does not parse anew on the others
+	if (!TakeToken(MelodyBuckets, source, MelodyLimit, r.received)) {
+		++Counters.limitedMelody;
+		return "ok rate limited";
+	}
+	if (!TakeToken(SourceBuckets, from, SourceLimit, r.received)) {
+		++Counters.limitedSource;
+		return "ok rate limited";
+	}
+	if (LoadSource(source, voiceSpec, r.timeline, err) < 0) {
+		return "error " + err;
+	}
+
+	if (cmd == "play") {
+		// replace whatever is not more important
+		for (std::deque<TRequest>::iterator i = z.queue.begin(); i != z.queue.end(); ) {
+			if (i->priority <= r.priority) {
+				i = z.queue.erase(i);
+				++Counters.dropped;
+			} else {
+				++i;
+			}
+		}
+		if (z.playing && (z.current.priority <= r.priority)) {
+			EndCurrent(z, ABORT_STOP);
+		}
+	} else if (z.playing && (z.current.priority < r.priority)) {
+		EndCurrent(z, ABORT_PREEMPT);
+	}
+	Enqueue(z, r, false);
+	StepZone(z);
+	return "ok";
+}
+
+//
+// Take a new client: requests are rate limited per user unless the client names itself
+//
+static void AcceptClient(int ls, int ep) {
+	struct epoll_event ev;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	char id[32];
+	int s;
+
+	if ((s = accept4(ls, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+		if ((errno != EINTR) && (errno != EAGAIN)) {
+			fprintf(stderr, "Error accepting connection(%d): %s\n", errno, strerror(errno));
+		}
+		return;
+	}
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+		snprintf(id, sizeof(id), "uid:%u", (unsigned)cred.uid);
+	} else {
+		strcpy(id, "unknown");
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = s;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev) != 0) {
+		fprintf(stderr, "Error watching connection(%d): %s\n", errno, strerror(errno));
+		close(s);
+		return;
+	}
+	TClient &c = Clients[s];
+	c.id = id;
+	c.buf.clear();
+	c.expires = TClock::now() + seconds(CLIENT_TIMEOUT);
+}
+
+static void DropClient(int s) {
+	// closing the socket takes it out of the epoll set as well
+	close(s);
+	Clients.erase(s);
+}
+
+//
+// Serve the requests a client has sent, dropping it when it closes the connection
+//
+static void ServeClient(int s, const char *voiceSpec) {
+	TClient &c = Clients[s];
+	char data[512];
+	ssize_t n;
+
+	while ((n = recv(s, data, sizeof(data), 0)) > 0) {
+		size_t eol;
+		c.buf.append(data, n);
+		c.expires = TClock::now() + seconds(CLIENT_TIMEOUT);
+		while ((eol = c.buf.find('\n')) != string::npos) {
+			string line = c.buf.substr(0, eol);
+			c.buf.erase(0, eol + 1);
+			if (!line.empty() && (line[line.size() - 1] == '\r')) {
+				line.erase(line.size() - 1);
+			}
+			if (Debug) {
+				printf("Request: %s\n", line.c_str());
+			}
+			string reply = HandleRequest(line, c.id, voiceSpec) + "\n";
+			send(s, reply.c_str(), reply.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		}
+		if (c.buf.size() > MAX_REQUEST_SIZE) {
+			send(s, "error request too long\n", 23, MSG_NOSIGNAL | MSG_DONTWAIT);
+			DropClient(s);
+			return;
+		}
+	}
+	if ((n == 0) || ((errno != EAGAIN) && (errno != EINTR))) {
+		DropClient(s);
+	}
+}
+
+static int MakeAddress(const char *socketPath, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", socketPath);
+		return -1;
+	}
+	strcpy(addr->sun_path, socketPath);
+	return 1;
+}
+
+//
+// Make the output changes due on all the zones, drop the clients silent for
+// too long and arm the timer for whatever comes next (the process sleeps in
+// epoll_wait with no timer at all while everything is idle)
+//
+static void Schedule(int tf) {
+	struct itimerspec its;
+	TPoint now = TClock::now(), next = TPoint::max();
+
+	for (size_t i = 0; i < Zones.size(); ++i) {
+		StepZone(Zones[i]);
+		if (Zones[i].playing && (RealTime(Zones[i].deadline) < next)) {
+			next = RealTime(Zones[i].deadline);
+		}
+	}
+	for (map<int, TClient>::iterator c = Clients.begin(); c != Clients.end(); ) {
+		if (c->second.expires <= now) {
+			close(c->first);
+			Clients.erase(c++);
+			continue;
+		}
+		if (c->second.expires < next) {
+			next = c->second.expires;
+		}
+		++c;
+	}
+	memset(&its, 0, sizeof(its));
+	if (next != TPoint::max()) {
+		long long ns = duration_cast<std::chrono::nanoseconds>(next - TClock::now()).count();
+		if (ns <= 0) {
+			// zero would disarm the timer
+			ns = 1;
+		}
+		its.it_value.tv_sec = (time_t)(ns / 1000000000);
+		its.it_value.tv_nsec = (long)(ns % 1000000000);
+	}
+	if (timerfd_settime(tf, 0, &its, NULL) != 0) {
+		fprintf(stderr, "Error arming timer(%d): %s\n", errno, strerror(errno));
+	}
+}
+
+static int Watch(int ep, int fd) {
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		fprintf(stderr, "Error watching descriptor(%d): %s\n", errno, strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
+//
+// Serve play requests until killed (the PWM device of zone 0 has to be set up
+// already, the devices of the other zones are opened here). A single thread
+// plays all the zones: one epoll set watches the socket, the clients and the
+// signals, and one timerfd wakes it for the next note of whichever zone.
+//
+int RunDaemon(const char *socketPath, const std::vector<const char *> &zones, const char *voiceSpec,
+		const TRateLimit &melodyLimit, const TRateLimit &sourceLimit) {
+	struct sockaddr_un addr;
+	struct epoll_event events[16];
+	int ls, ep, tf, n;
+
+	MelodyLimit = melodyLimit;
+	SourceLimit = sourceLimit;
+	Zones.resize(zones.size() + 1);
+	for (size_t i = 0; i < Zones.size(); ++i) {
+		TZone &z = Zones[i];
+		z.playing = false;
+		if (i == 0) {
+			z.dev = PWM;
+			continue;
+		}
+		z.dev = new TPWMDevice;
+		InitPWMDevice(z.dev);
+		z.dev->volume = PWM->volume;
+		if (OpenPWMDevice(z.dev, zones[i - 1]) < 0) {
+			CloseZones();
+			return -1;
+		}
+	}
+	atexit(CloseZones);
+	if (MakeAddress(socketPath, &addr) < 0) {
+		return -1;
+	}
+	if ((ls = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		fprintf(stderr, "Error creating socket(%d): %s\n", errno, strerror(errno));
+		return -1;
+	}
+	unlink(socketPath);
+	if ((bind(ls, (struct sockaddr*)&addr, sizeof(addr)) != 0) || (listen(ls, 16) != 0)) {
+		fprintf(stderr, "Error binding socket %s(%d): %s\n", socketPath, errno, strerror(errno));
+		close(ls);
+		return -1;
+	}
+	SocketPath = socketPath;
+	atexit(RemoveSocket);
+	if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		fprintf(stderr, "Error creating epoll(%d): %s\n", errno, strerror(errno));
+		return -1;
+	}
+	if ((tf = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+		fprintf(stderr, "Error creating timer(%d): %s\n", errno, strerror(errno));
+		return -1;
+	}
+	if ((Watch(ep, ls) < 0) || (Watch(ep, tf) < 0) || ((SignalF >= 0) && (Watch(ep, SignalF) < 0))) {
+		return -1;
+	}
+	printf("Listening on %s, %d zone(s)\n", socketPath, (int)Zones.size());
+	fflush(stdout);
+
+	for (;;) {
+		if ((n = epoll_wait(ep, events, sizeof(events) / sizeof(events[0]), -1)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error waiting for events(%d): %s\n", errno, strerror(errno));
+			return -1;
+		}
+		for (int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd, sig;
+			uint64_t expirations;
+
+			if (fd == SignalF) {
+				// stop signals end the daemon, pause/resume ones are for a single melody player
+				while ((sig = NextSignal()) != 0) {
+					if ((sig != SIGUSR1) && (sig != SIGUSR2)) {
+						exit(2);
+					}
+				}
+			} else if (fd == tf) {
+				// (nothing to read when the timer has been rearmed in between)
+				read(tf, &expirations, sizeof(expirations));
+			} else if (fd == ls) {
+				AcceptClient(ls, ep);
+			} else if (Clients.count(fd)) {
+				ServeClient(fd, voiceSpec);
+			}
+		}
+		Schedule(tf);
+	}
+}
+
+//
+// Send one request to the daemon and wait for its reply
+//
+int SendRequest(const char *socketPath, const char *request) {
+	struct sockaddr_un addr;
+	string msg = string(request) + "\n";
+	char reply[256];
+	ssize_t n;
+	int s;
+
+	if (MakeAddress(socketPath, &addr) < 0) {
+		return -1;
+	}
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "Error creating socket(%d): %s\n", errno, strerror(errno));
+		return -1;
+	}
+	if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Error connecting to %s(%d): %s\n", socketPath, errno, strerror(errno));
+		close(s);
+		return -1;
+	}
+	if (send(s, msg.c_str(), msg.size(), MSG_NOSIGNAL) != (ssize_t)msg.size()) {
+		fprintf(stderr, "Error sending request(%d): %s\n", errno, strerror(errno));
+		close(s);
+		return -1;
+	}
+	shutdown(s, SHUT_WR);
+	n = recv(s, reply, sizeof(reply) - 1, MSG_WAITALL);
+	close(s);
+	if (n <= 0) {
+		fprintf(stderr, "No reply from %s\n", socketPath);
+		return -1;
+	}
+	reply[n] = 0;
+	reply[strcspn(reply, "\r\n")] = 0;
+	if (strncmp(reply, "ok", 2) != 0) {
+		fprintf(stderr, "%s\n", reply);
+		return -1;
+	}
+	if (reply[2] == ' ') {
+		printf("%s\n", reply + 3);
+	}
+	return 1;
+}
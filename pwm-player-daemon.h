@@ -0,0 +1,56 @@
+/*
+ * Playback daemon and its client
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_DAEMON_H_
+#define _PWM_PLAYER_DAEMON_H_
+
+#define DAEMON_SOCKET       "/run/pwm-player.sock"
+#define DAEMON_MELODY_RATE  "1:3"           // same melody: 1 request per second, bursts of 3
+#define DAEMON_SOURCE_RATE  "10:20"         // same client
+#define DAEMON_MAX_ZONES    32              // PWM devices played independently
+
+/*
+ * The daemon keeps the PWM devices open and the parsed melodies in memory and
+ * takes requests over a Unix stream socket, one line per request:
+ *   play [<attr>...] <source>    replace requests of the same or lower priority
+ *   queue [<attr>...] <source>   play after the requests of the same or higher
+ *                                priority, preempting a lower priority one
+ *   stop                         stop the current melody and drop the queue
+ *                                (of the zone)
+ *   stats                        report the request counters
+ * where <source> is a player option with its argument:
+ *   -m|-i|-e|-r <file>, -I|-E|-R <melody>, -N <built-in>, -P <pack>:<name>
+ * and the attributes are:
+ *   prio=<n>           priority (0 by default, higher is more important)
+ *   resume|drop        what happens to the request when it is preempted:
+ *                      it continues from the same place afterwards or is
+ *                      dropped (the default)
+ *   from=<id>          client the request is rate limited for (the peer
+ *                      user id by default)
+ *   zone=<n>           PWM device (zone) the request is for, numbered from 0
+ *                      in the order the devices are given (0 by default)
+ * A request for the melody already waiting or playing with the same priority
+ * is coalesced with it, and requests over the token bucket limits (per melody
+ * and per client) are dropped. Every request is answered with a line
+ * "ok [<what happened>]" or "error <reason>".
+ * Every zone has a queue of its own and plays independently of the others;
+ * the parsed melodies, rate limits and counters are shared.
+ */
+
+typedef struct {
+	double rate;                // tokens per second (0 for no limit)
+	double burst;               // bucket size
+} TRateLimit;
+
+/*
+ * daemon handling functions
+ */
+int ParseRateLimit(const char *spec, TRateLimit *limit);
+int RunDaemon(const char *socketPath, const std::vector<const char *> &zones, const char *voiceSpec,
+	const TRateLimit &melodyLimit, const TRateLimit &sourceLimit);
+int SendRequest(const char *socketPath, const char *request);
+
+#endif
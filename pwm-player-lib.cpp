@@ -0,0 +1,182 @@
+/*
+ * libpwmplayer: melodies on a PWM buzzer for other programs
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include "pwm-player.h"
+#include "pwm-player-pwm.h"
+#include "pwm-player-lock.h"
+#include "pwm-player-timeline.h"
+#include "pwm-player-playlist.h"
+#include "pwmplayer.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+struct pwmplayer_melody {
+	std::shared_ptr<const TTimeline> timeline;
+};
+
+struct pwmplayer {
+	TPWMDevice dev;
+	TDeviceLock owned;
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable over;
+	bool playing;
+	int status;
+};
+
+//
+// Cut the playback short and wait for the player thread to finish
+//
+static void StopThread(pwmplayer_t *p) {
+	uint64_t one = 1;
+
+	if (!p->thread.joinable()) {
+		return;
+	}
+	p->dev.stopped = 1;
+	if (write(p->dev.wakeF, &one, sizeof(one)) != sizeof(one)) {
+		fprintf(stderr, "Error waking player(%d): %s\n", errno, strerror(errno));
+	}
+	p->thread.join();
+}
+
+pwmplayer_t *pwmplayer_open(int n) {
+	pwmplayer_t *p = new pwmplayer_t;
+	TLockHolder self, holder;
+	char pwmDevStr[16];
+	const char *env;
+
+	InitPWMDevice(&p->dev);
+	p->playing = false;
+	p->status = PWMPLAYER_DONE;
+	if (n >= 0) {
+		snprintf(pwmDevStr, sizeof(pwmDevStr), "%d", n);
+	} else if ((env = getenv("WB_PWM_BUZZER")) != NULL) {
+		snprintf(pwmDevStr, sizeof(pwmDevStr), "%s", env);
+	} else {
+		fprintf(stderr, "No WB_PWM_BUZZER environment variable set or PWM device number given\n");
+		delete p;
+		return NULL;
+	}
+	// owned like by the player program, so the two do not play over each other
+	self.pid = getpid();
+	self.priority = 0;
+	self.melody = "libpwmplayer";
+	if (LockDevice(p->owned, pwmDevStr, self, BUSY_FAIL, holder) <= 0) {
+		delete p;
+		return NULL;
+	}
+	if ((p->dev.wakeF = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		fprintf(stderr, "Error creating eventfd(%d): %s\n", errno, strerror(errno));
+		UnlockDevice(p->owned);
+		delete p;
+		return NULL;
+	}
+	if (OpenPWMDevice(&p->dev, pwmDevStr) < 0) {
+		ClosePWMDevice(&p->dev);
+		close(p->dev.wakeF);
+		UnlockDevice(p->owned);
+		delete p;
+		return NULL;
+	}
+	return p;
+}
+
+void pwmplayer_close(pwmplayer_t *p) {
+	if (p == NULL) {
+		return;
+	}
+	StopThread(p);
+	ClosePWMDevice(&p->dev);
+	close(p->dev.wakeF);
+	UnlockDevice(p->owned);
+	delete p;
+}
+
+void pwmplayer_set_volume(pwmplayer_t *p, int percent) {
+	p->dev.volume = percent;
+}
+
+pwmplayer_melody_t *pwmplayer_compile(char type, const char *source, const char *voice) {
+	std::shared_ptr<TTimeline> tl(new TTimeline());
+
+	if (CompileMelodySource(type, source, voice, *tl) < 0) {
+		return NULL;
+	}
+	pwmplayer_melody_t *m = new pwmplayer_melody_t;
+	m->timeline = tl;
+	return m;
+}
+
+unsigned long pwmplayer_length(const pwmplayer_melody_t *m) {
+	if (m == NULL) {
+		return 0;
+	}
+	return m->timeline->length / 1000;
+}
+
+void pwmplayer_free(pwmplayer_melody_t *m) {
+	delete m;
+}
+
+int pwmplayer_play(pwmplayer_t *p, const pwmplayer_melody_t *m, pwmplayer_callback_t done, void *arg) {
+	std::shared_ptr<const TTimeline> tl;
+	uint64_t v;
+
+	if (m == NULL) {
+		return -1;
+	}
+	tl = m->timeline;
+	StopThread(p);
+	// the wakeup of the previous stop is consumed
+	while (read(p->dev.wakeF, &v, sizeof(v)) == sizeof(v)) {
+	}
+	p->dev.stopped = 0;
+	{
+		std::lock_guard<std::mutex> lk(p->lock);
+		p->playing = true;
+	}
+	p->thread = thread([p, tl, done, arg]() {
+		int status;
+
+		PWM = &p->dev;
+		PlayTimelineAt(*tl, NOW, false);
+		Mute();
+		status = p->dev.stopped ? PWMPLAYER_STOPPED : PWMPLAYER_DONE;
+		if (done) {
+			done(p, status, arg);
+		}
+		std::lock_guard<std::mutex> lk(p->lock);
+		p->status = status;
+		p->playing = false;
+		p->over.notify_all();
+	});
+	return 1;
+}
+
+int pwmplayer_stop(pwmplayer_t *p) {
+	StopThread(p);
+	return 1;
+}
+
+int pwmplayer_wait(pwmplayer_t *p) {
+	std::unique_lock<std::mutex> lk(p->lock);
+
+	p->over.wait(lk, [p] { return !p->playing; });
+	return p->status;
+}
+
+void pwmplayer_set_debug(int on) {
+	Debug = (on != 0);
+}
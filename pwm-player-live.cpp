@@ -0,0 +1,211 @@
+/*
+ * Live MIDI input
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "pwm-player.h"
+#include "pwm-player-live.h"
+#include "pwm-player-status.h"
+#include "MIDIEvent.h"
+
+using namespace MIDIConstants;
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+#define LIVE_BUFFER         256
+#define MIDI_ALL_SOUND_OFF  120         // controllers silencing everything
+#define MIDI_ALL_NOTES_OFF  123
+
+//
+// Incremental form of the MIDIFileReader::parseTrack event decoding: the
+// same running status rules, fed a byte at a time as it comes
+//
+typedef struct {
+	int status;                 // running status (-1 if there is none)
+	int count;                  // data bytes got so far
+	MIDIByte data[2];
+	bool sysex;                 // inside a system exclusive message
+} TLiveDecoder;
+
+typedef struct {
+	int channel;
+	int pitch;
+	int velocity;
+} THeldNote;
+
+static int DataBytes(int status) {
+	switch (status & MIDI_MESSAGE_TYPE_MASK) {
+	case MIDI_PROG_CHANGE:
+	case MIDI_CHNL_AFTERTOUCH:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+//
+// Feed a byte to the decoder, true when it completes a channel event
+//
+static bool DecodeByte(TLiveDecoder &d, MIDIByte b, MIDIEvent &e) {
+	if (b >= MIDI_TIMING_CLOCK) {
+		// real-time messages may come anywhere and leave the running status alone
+		return false;
+	}
+	if (b & MIDI_STATUS_BYTE_MASK) {
+		d.sysex = (b == MIDI_SYSTEM_EXCLUSIVE);
+		// system common messages cancel the running status
+		d.status = (b < MIDI_SYSTEM_EXCLUSIVE) ? b : -1;
+		d.count = 0;
+		return false;
+	}
+	if (d.sysex || (d.status < 0)) {
+		return false;
+	}
+	d.data[d.count++] = b;
+	if (d.count < DataBytes(d.status)) {
+		return false;
+	}
+	d.count = 0;
+	e = MIDIEvent(0, (MIDIByte)d.status, d.data[0], (DataBytes(d.status) == 2) ? d.data[1] : 0);
+	return true;
+}
+
+//
+// Keep the notes held down and sound the last one of them; true when the
+// output has changed
+//
+static bool NoteEvent(vector<THeldNote> &held, const MIDIEvent &e) {
+	int type = e.getMessageType();
+
+	if (e.getChannelNumber() == MIDI_PERCUSSION_CHANNEL) {
+		return false;
+	}
+	if ((type == MIDI_CTRL_CHANGE) && ((e.getData1() == MIDI_ALL_SOUND_OFF) || (e.getData1() == MIDI_ALL_NOTES_OFF))) {
+		held.clear();
+		Mute();
+		return true;
+	}
+	if ((type != MIDI_NOTE_ON) && (type != MIDI_NOTE_OFF)) {
+		return false;
+	}
+	for (size_t i = 0; i < held.size(); ++i) {
+		if ((held[i].channel == e.getChannelNumber()) && (held[i].pitch == e.getPitch())) {
+			bool last = (i + 1 == held.size());
+			held.erase(held.begin() + i);
+			// a note released under the sounding one changes nothing
+			if (!last && ((type == MIDI_NOTE_OFF) || (e.getVelocity() == 0))) {
+				return false;
+			}
+			break;
+		}
+	}
+	if ((type == MIDI_NOTE_ON) && (e.getVelocity() > 0)) {
+		THeldNote n = { e.getChannelNumber(), e.getPitch(), e.getVelocity() };
+		held.push_back(n);
+	}
+	if (held.empty()) {
+		Mute();
+	} else {
+		Sound(held.back().pitch, held.back().velocity);
+	}
+	return true;
+}
+
+//
+// Open the input: a FIFO is opened for writing as well, so it stays open
+// while the writers come and go
+//
+static int OpenInput(const char *input) {
+	struct stat fs;
+
+	if (strcmp(input, "-") == 0) {
+		return 0;
+	}
+	if ((stat(input, &fs) == 0) && S_ISFIFO(fs.st_mode)) {
+		return open(input, O_RDWR | O_CLOEXEC);
+	}
+	return open(input, O_RDONLY | O_CLOEXEC);
+}
+
+//
+// Play the notes of the live input until it ends or the player is stopped
+//
+int PlayLiveMIDI(const char *input) {
+	TLiveDecoder d = { -1, 0, { 0, 0 }, false };
+	MIDIEvent e(0, 0);
+	vector<THeldNote> held;
+	MIDIByte buf[LIVE_BUFFER];
+	unsigned long events = 0, maxUs = 0;
+	unsigned long long totalUs = 0;
+	int fd, rc = 1;
+
+	if ((fd = OpenInput(input)) < 0) {
+		fprintf(stderr, "Error opening MIDI input %s(%d): %s\n", input, errno, strerror(errno));
+		return -1;
+	}
+	printf("Playing MIDI input %s\n", input);
+	fflush(stdout);
+	StatusMelody(input, 0, NOW);
+	for (;;) {
+		struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { SignalF, POLLIN, 0 } };
+		ssize_t n;
+		int sig;
+
+		if (poll(pfd, (SignalF < 0) ? 1 : 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error waiting for MIDI input(%d): %s\n", errno, strerror(errno));
+			rc = -1;
+			break;
+		}
+		// pause and resume make no sense for live input
+		if (((sig = NextSignal()) != 0) && (sig != SIGUSR1) && (sig != SIGUSR2)) {
+			break;
+		}
+		if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+			continue;
+		}
+		if ((n = read(fd, buf, sizeof(buf))) <= 0) {
+			if ((n < 0) && ((errno == EINTR) || (errno == EAGAIN))) {
+				continue;
+			}
+			if (n < 0) {
+				fprintf(stderr, "Error reading MIDI input %s(%d): %s\n", input, errno, strerror(errno));
+				rc = -1;
+			}
+			break;
+		}
+		TPoint in = TClock::now();
+		for (ssize_t i = 0; i < n; ++i) {
+			if (DecodeByte(d, buf[i], e) && NoteEvent(held, e)) {
+				unsigned long us = duration_cast<microseconds>(TClock::now() - in).count();
+				++events;
+				totalUs += us;
+				if (us > maxUs) {
+					maxUs = us;
+				}
+				if (Debug) {
+					printf("Event %02X %d %d: %lu us\n", e.getEventCode(), e.getData1(), e.getData2(), us);
+				}
+			}
+		}
+	}
+	Mute();
+	if (fd != 0) {
+		close(fd);
+	}
+	StatusState(STATE_IDLE);
+	printf("%lu note events, input to PWM latency %llu us average, %lu us max\n",
+		events, events ? totalUs / events : 0, maxUs);
+	return rc;
+}
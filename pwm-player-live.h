@@ -0,0 +1,23 @@
+/*
+ * Live MIDI input
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_LIVE_H_
+#define _PWM_PLAYER_LIVE_H_
+
+/*
+ * Raw MIDI bytes (as sent over the wire: running status, real-time bytes
+ * anywhere, no delta times) are read from stdin ("-"), a FIFO or a raw MIDI
+ * device (/dev/snd/midiC<card>D<device>) and every note on/off is sounded at
+ * once. The buzzer plays the last note still held down; percussion (channel 9)
+ * is skipped. The time from the input to the PWM write is reported at the end.
+ */
+
+/*
+ * live input handling functions
+ */
+int PlayLiveMIDI(const char *input);
+
+#endif
@@ -0,0 +1,245 @@
+/*
+ * PWM device ownership between player processes
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <algorithm>
+
+#include "pwm-player.h"
+#include "pwm-player-lock.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+static TDeviceLock Owned;       // kept until the player exits
+
+int ParseBusyMode(const char *s, TBusyMode *mode) {
+	if (strcmp(s, "fail") == 0) {
+		*mode = BUSY_FAIL;
+	} else if (strcmp(s, "wait") == 0) {
+		*mode = BUSY_WAIT;
+	} else if (strcmp(s, "preempt") == 0) {
+		*mode = BUSY_PREEMPT;
+	} else if (strcmp(s, "enqueue") == 0) {
+		*mode = BUSY_ENQUEUE;
+	} else {
+		fprintf(stderr, "Unknown busy device mode '%s' (fail, wait, preempt or enqueue expected)\n", s);
+		return -1;
+	}
+	return 1;
+}
+
+//
+// Describe the owner in the lock file
+//
+void UpdateLockHolder(const TDeviceLock &lock, const TLockHolder &self) {
+	char buf[64];
+
+	for (size_t i = 0; i < lock.files.size(); ++i) {
+		string s;
+
+		snprintf(buf, sizeof(buf), "pid=%d\npriority=%d\n", (int)getpid(), self.priority);
+		s = buf;
+		if (!self.socket.empty()) {
+			snprintf(buf, sizeof(buf), "zone=%d\n", lock.zones[i]);
+			s += "daemon=" + self.socket + "\n" + buf;
+		}
+		s += "melody=" + self.melody + "\n";
+		if ((ftruncate(lock.files[i], 0) != 0) || (pwrite(lock.files[i], s.c_str(), s.size(), 0) != (ssize_t)s.size())) {
+			if (Debug) {
+				printf("Unable to write %s(%d): %s\n", lock.paths[i].c_str(), errno, strerror(errno));
+			}
+		}
+	}
+}
+
+void UpdateLockHolder(const TLockHolder &self) {
+	UpdateLockHolder(Owned, self);
+}
+
+static void ReadLockHolder(const string &path, TLockHolder &holder) {
+	ifstream f(path.c_str());
+	string line;
+
+	holder.pid = 0;
+	holder.priority = 0;
+	holder.socket.clear();
+	holder.zone = 0;
+	holder.melody.clear();
+	while (getline(f, line)) {
+		size_t eq = line.find('=');
+		string key = line.substr(0, eq), value = (eq == string::npos) ? "" : line.substr(eq + 1);
+		if (key == "pid") {
+			holder.pid = atoi(value.c_str());
+		} else if (key == "priority") {
+			holder.priority = atoi(value.c_str());
+		} else if (key == "daemon") {
+			holder.socket = value;
+		} else if (key == "zone") {
+			holder.zone = atoi(value.c_str());
+		} else if (key == "melody") {
+			holder.melody = value;
+		}
+	}
+}
+
+//
+// Take the lock when the owner exits, giving up after timeoutMs (-1 to wait forever)
+//
+static int WaitLock(int lockF, int timeoutMs) {
+	if (timeoutMs < 0) {
+		while (flock(lockF, LOCK_EX) != 0) {
+			if (errno != EINTR) {
+				return -1;
+			}
+		}
+		return 1;
+	}
+	for (TPoint end = TClock::now() + milliseconds(timeoutMs); TClock::now() < end; ) {
+		if (flock(lockF, LOCK_EX | LOCK_NB) == 0) {
+			return 1;
+		}
+		this_thread::sleep_for(milliseconds(1));
+	}
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+//
+// Become the owner of a single output. Returns 1 when it is ours, 0 when it is
+// owned by a daemon that should get the melody as a request instead (only asked
+// for with 'handover'), -1 on failure.
+//
+static int LockOutput(TDeviceLock &lock, const string &device, int zone, const TLockHolder &self, TBusyMode busy, bool handover, TLockHolder &holder) {
+	string path = string(LOCK_PREFIX) + device + ".lock";
+	int lockF;
+
+	if ((lockF = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+		fprintf(stderr, "Error opening lock file %s(%d): %s\n", path.c_str(), errno, strerror(errno));
+		return -1;
+	}
+	if (flock(lockF, LOCK_EX | LOCK_NB) == 0) {
+		goto locked;
+	}
+	if (errno != EWOULDBLOCK) {
+		fprintf(stderr, "Error locking %s(%d): %s\n", path.c_str(), errno, strerror(errno));
+		goto fail;
+	}
+
+	ReadLockHolder(path, holder);
+	if (Debug) {
+		printf("pwm%s is owned by pid %d (priority %d%s%s): %s\n", device.c_str(), holder.pid, holder.priority,
+			holder.socket.empty() ? "" : ", daemon on ", holder.socket.c_str(), holder.melody.c_str());
+	}
+	if (handover && ((busy == BUSY_PREEMPT) || (busy == BUSY_ENQUEUE)) && !holder.socket.empty()) {
+		close(lockF);
+		return 0;
+	}
+	switch (busy) {
+	case BUSY_FAIL:
+		fprintf(stderr, "pwm%s is busy: pid %d plays %s\n", device.c_str(), holder.pid, holder.melody.c_str());
+		goto fail;
+	case BUSY_PREEMPT:
+		if (self.priority <= holder.priority) {
+			fprintf(stderr, "pwm%s is busy: pid %d plays %s with priority %d, not lower than %d\n", device.c_str(),
+				holder.pid, holder.melody.c_str(), holder.priority, self.priority);
+			goto fail;
+		}
+		if ((holder.pid <= 0) || (kill(holder.pid, SIGTERM) != 0) || (WaitLock(lockF, LOCK_PREEMPT_MS) < 0)) {
+			fprintf(stderr, "Unable to preempt pid %d on pwm%s\n", holder.pid, device.c_str());
+			goto fail;
+		}
+		break;
+	case BUSY_WAIT:
+	case BUSY_ENQUEUE:
+		if (WaitLock(lockF, -1) < 0) {
+			fprintf(stderr, "Error locking %s(%d): %s\n", path.c_str(), errno, strerror(errno));
+			goto fail;
+		}
+		break;
+	}
+locked:
+	lock.files.push_back(lockF);
+	lock.paths.push_back(path);
+	lock.zones.push_back(zone);
+	return 1;
+
+fail:
+	close(lockF);
+	return -1;
+}
+
+void UnlockDevice(TDeviceLock &lock) {
+	for (size_t i = 0; i < lock.files.size(); ++i) {
+		close(lock.files[i]);
+	}
+	lock.files.clear();
+	lock.paths.clear();
+	lock.zones.clear();
+}
+
+//
+// Names of the outputs of the device (a comma separated list, the zones of a
+// daemon separated by ';') in the file names: [<chip>.]<channel>, outputs of
+// pwmchip0 named by the channel alone. The zone of each output goes to zones
+// when it is given.
+//
+vector<string> DeviceOutputs(const char *device, vector<int> *zones) {
+	vector<string> outputs;
+	string list = device;
+	size_t pos = 0;
+	int zone = 0;
+
+	for (;;) {
+		size_t end = list.find_first_of(",;", pos);
+		string output = list.substr(pos, (end == string::npos) ? string::npos : end - pos);
+		if (output.compare(0, 2, "0:") == 0) {
+			output.erase(0, 2);
+		}
+		replace(output.begin(), output.end(), ':', '.');
+		outputs.push_back(output);
+		if (zones) {
+			zones->push_back(zone);
+		}
+		if (end == string::npos) {
+			break;
+		}
+		if (list[end] == ';') {
+			++zone;
+		}
+		pos = end + 1;
+	}
+	return outputs;
+}
+
+//
+// Become the owner of the device (all outputs of the list, in order) before
+// anything is written to it. Returns 1 when the device is ours, 0 when its
+// first output is owned by a daemon that should get the melody as a request
+// instead (holder tells which), -1 on failure.
+//
+int LockDevice(TDeviceLock &lock, const char *device, const TLockHolder &self, TBusyMode busy, TLockHolder &holder) {
+	vector<int> zones;
+	vector<string> outputs = DeviceOutputs(device, &zones);
+	int rc;
+
+	UnlockDevice(lock);
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		if ((rc = LockOutput(lock, outputs[i], zones[i], self, busy, i == 0, holder)) <= 0) {
+			UnlockDevice(lock);
+			return rc;
+		}
+	}
+	UpdateLockHolder(lock, self);
+	return 1;
+}
+
+int LockDevice(const char *device, const TLockHolder &self, TBusyMode busy, TLockHolder &holder) {
+	return LockDevice(Owned, device, self, busy, holder);
+}
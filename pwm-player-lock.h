@@ -0,0 +1,62 @@
+/*
+ * PWM device ownership between player processes
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_LOCK_H_
+#define _PWM_PLAYER_LOCK_H_
+
+#include <string>
+#include <vector>
+
+#define LOCK_PREFIX         "/run/pwm-player.pwm"   // followed by [<chip>.]<channel> and ".lock"
+#define LOCK_PREEMPT_MS     1000                    // how long a preempted owner may take to exit
+
+/*
+ * what to do when the device is owned by another player
+ */
+typedef enum {
+	BUSY_FAIL,                  // give up at once
+	BUSY_WAIT,                  // wait until the owner exits
+	BUSY_PREEMPT,               // stop an owner of lower priority
+	BUSY_ENQUEUE                // play after the owner
+} TBusyMode;
+
+/*
+ * The owner holds an exclusive flock on the lock file of the device for its
+ * whole life and keeps its description in the file, a "<key>=<value>" line each:
+ * pid, priority, daemon (its socket if it is one), zone (of the daemon the
+ * output belongs to) and melody.
+ * A daemon owner takes over preempting and enqueued melodies as requests.
+ */
+typedef struct {
+	int pid;
+	int priority;
+	std::string socket;         // empty unless the owner is a daemon
+	int zone;                   // daemon zone of the output (0 unless the owner is a daemon)
+	std::string melody;
+} TLockHolder;
+
+/*
+ * lock files of the device outputs, kept open (and locked) while it is owned;
+ * the functions without one use the lock of the player process
+ */
+typedef struct {
+	std::vector<int> files;
+	std::vector<std::string> paths;
+	std::vector<int> zones;     // daemon zone of each output
+} TDeviceLock;
+
+/*
+ * device lock handling functions
+ */
+int ParseBusyMode(const char *s, TBusyMode *mode);
+std::vector<std::string> DeviceOutputs(const char *device, std::vector<int> *zones);
+int LockDevice(const char *device, const TLockHolder &self, TBusyMode busy, TLockHolder &holder);
+int LockDevice(TDeviceLock &lock, const char *device, const TLockHolder &self, TBusyMode busy, TLockHolder &holder);
+void UpdateLockHolder(const TLockHolder &self);
+void UpdateLockHolder(const TDeviceLock &lock, const TLockHolder &self);
+void UnlockDevice(TDeviceLock &lock);
+
+#endif
@@ -38,8 +38,15 @@
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "pwm-player.h"
+#include "pwm-player-melody.h"
 
 __attribute__ ((used)) static char s_RCSVersion[] = "$Id: pwm-player-melody.cpp 285 2022-12-31 14:56:40Z maxwolf $";
 __attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
@@ -119,60 +126,151 @@ typedef void* EAS_VOID_PTR;
 
 typedef struct {
     char fname[PATH_MAX];
-	char *buf;
-	char *pos;
+	const char *buf;
+	const char *pos;
 	int len;
+	bool mapped;		/* buf is the mmapped file, not the caller's string */
+	bool streamed;		/* buf holds the text of fd read so far (pipes are parsed as they come) */
+	int fd;
+	int cap;			/* size of the stream buffer */
+	bool partial;		/* the current line has not been read to its end yet */
+	bool eof;
+	bool stalled;		/* the stream kept the player waiting */
+	int lines;			/* lines of the stream read, for error positions */
+	const TPoint *muteAt;	/* the sounding note is muted then while the stream is waited for */
 } MEM_FILE_HANDLE;
 
+/* the stream buffer grows by */
+#define STREAM_CHUNK	1024
+/* played nodes of a stream are dropped in batches of at least */
+#define STREAM_TRIM		256
 
+//
+// Pipes (and the standard input) are read as the text comes, so the melody
+// starts playing before its end is written
+//
+static int GetStream(int f, MEM_FILE_HANDLE *fh) {
+	char *p;
+
+	if ((p = (char*)malloc(STREAM_CHUNK)) == NULL) {
+		close(f);
+		return EAS_ERROR_MALLOC_FAILED;
+	}
+	fh->buf = p;
+	fh->pos = fh->buf;
+	fh->len = 0;
+	fh->cap = STREAM_CHUNK;
+	fh->fd = f;
+	fh->mapped = false;
+	fh->streamed = true;
+	fh->partial = false;
+	fh->eof = false;
+	fh->stalled = false;
+	fh->lines = 0;
+	fh->muteAt = NULL;
+	return EAS_SUCCESS;
+}
+
+//
+// Append more of the stream to the buffer, 0 at its end. While nothing comes
+// the note sounding is muted at its end, and the stall is noted
+//
+static int StreamRead(MEM_FILE_HANDLE *fh) {
+	struct pollfd pfd = { fh->fd, POLLIN, 0 };
+	ssize_t n;
+
+	if (fh->eof) {
+		return 0;
+	}
+	if (fh->len == fh->cap) {
+		char *p = (char*)realloc((void*)fh->buf, fh->cap * 2);
+		if (p == NULL) {
+			fh->eof = true;
+			return EAS_ERROR_MALLOC_FAILED;
+		}
+		fh->pos = p + (fh->pos - fh->buf);
+		fh->buf = p;
+		fh->cap *= 2;
+	}
+	if (poll(&pfd, 1, 0) <= 0) {
+		fh->stalled = true;
+		int rc = WaitReadable(fh->fd, fh->muteAt);
+		if (rc == 0) {
+			Mute();
+			fh->muteAt = NULL;
+			rc = WaitReadable(fh->fd, NULL);
+		}
+		if (rc < 0) {
+			fh->eof = true;
+			return 0;
+		}
+	}
+	while ((n = read(fh->fd, (char*)fh->buf + fh->len, fh->cap - fh->len)) < 0) {
+		if ((errno != EINTR) && (errno != EAGAIN)) {
+			fprintf(stderr, "Error reading %s(%d): %s\n", fh->fname, errno, strerror(errno));
+			fh->eof = true;
+			return EAS_ERROR_FILE_READ_FAILED;
+		}
+	}
+	if (n == 0) {
+		fh->eof = true;
+	}
+	fh->len += n;
+	return n;
+}
+
+
+//
+// Map the whole file, the parser scans it in place
+//
 int GetFile(const char *fileName, MEM_FILE_HANDLE *fh) {
-  FILE *f = NULL;
-  size_t fsize;
+  struct stat fs;
+  void *p;
+  int f;
 
     strncpy(fh->fname, fileName, sizeof(fh->fname) - 1);
-	if ((f = fopen(fileName, "rb")) == NULL) {
+	fh->streamed = false;
+	if ((f = (strcmp(fileName, "-") == 0) ? dup(0) : open(fileName, O_RDONLY)) < 0) {
 		return EAS_ERROR_FILE_OPEN_FAILED;
 	}
-	if (fseek(f, 0, SEEK_END) != 0) {
-		fclose(f);
+	if (fstat(f, &fs) != 0) {
+		close(f);
 		return EAS_ERROR_FILE_SEEK;
 	}
-	fsize = ftell(f);
-	if (fsize > INT_MAX) {
-		fclose(f);
+	if (!S_ISREG(fs.st_mode)) {
+		return GetStream(f, fh);
+	}
+	if ((fs.st_size == 0) || (fs.st_size > INT_MAX)) {
+		close(f);
 		return EAS_ERROR_FILE_LENGTH;
 	}
-	fh->buf = (char*)malloc(fsize);
-	if (fh->buf == NULL) {
-		fclose(f);
+	p = mmap(NULL, fs.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+	close(f);
+	if (p == MAP_FAILED) {
 		return EAS_ERROR_MALLOC_FAILED;
 	}
-	if (fseek(f, 0, SEEK_SET) != 0) {
-		fclose(f);
-		return EAS_ERROR_FILE_SEEK;
-	}
-	if (fread(fh->buf, 1, fsize, f) != fsize) {
-		fclose(f);
-		free(fh->buf);
-		return EAS_ERROR_FILE_LENGTH;
-	}
-	fclose(f);
-	fh->len = (int)fsize;
+	fh->buf = (const char*)p;
+	fh->len = (int)fs.st_size;
 	fh->pos = fh->buf;
+	fh->mapped = true;
 	return EAS_SUCCESS; 
 
 }
 
 
+//
+// Use the string in place (it must outlive the parsing)
+//
 int GetString(const char *str, MEM_FILE_HANDLE *fh) {
-  int sl = strlen(str);
-	fh->buf = (char*)malloc(sl + 1);
-	if (fh->buf == NULL) {
-		return EAS_ERROR_MALLOC_FAILED;
+  size_t sl = strlen(str);
+	if (sl > INT_MAX) {
+		return EAS_ERROR_FILE_LENGTH;
 	}
-	strcpy(fh->buf, str);
-	fh->len = sl;
+	fh->buf = str;
+	fh->len = (int)sl;
 	fh->pos = fh->buf;
+	fh->mapped = false;
+	fh->streamed = false;
 	strcpy(fh->fname, "string");
 	return EAS_SUCCESS; 
 }
@@ -207,7 +305,15 @@ int EAS_HWFileSeek(MEM_FILE_HANDLE *fh, int offset) {
 }
 
 int EAS_HWCloseFile(MEM_FILE_HANDLE *fh) {
-	free(fh->buf); fh->buf = NULL;
+	if (fh->mapped && fh->buf) {
+		munmap((void*)fh->buf, fh->len);
+	}
+	if (fh->streamed) {
+		free((void*)fh->buf);
+		close(fh->fd);
+		fh->streamed = false;
+	}
+	fh->buf = NULL;
 	fh->pos = 0;
 	fh->len = 0;
 	return EAS_SUCCESS;
@@ -218,7 +324,8 @@ typedef enum
     eParserModePlay,
     eParserModeLocate,
     eParserModeMute,
-    eParserModeMetaData
+    eParserModeMetaData,
+    eParserModeCompile                          /* render notes into a timeline instead of playing */
 } E_PARSE_MODE;
 
 typedef enum
@@ -258,8 +365,35 @@ typedef enum
     PARSER_DATA_PLAY_MODE
 } E_PARSER_DATA;
 
-/* maximum line size as specified in iMelody V1.2 spec */
-#define MAX_LINE_SIZE           75
+/* maximum nesting of repeat sections */
+#define MAX_LOOP_DEPTH          16
+
+/*----------------------------------------------------------------------------
+ *
+ * S_IMELODY_NODE
+ *
+ * Compiled melody is a flat array of these nodes, executed by IMY_Run
+ *----------------------------------------------------------------------------
+*/
+
+typedef enum
+{
+    IMY_NODE_NOTE,                              /* sound note for duration, then keep silence for rest */
+    IMY_NODE_REST,                              /* keep silence for duration */
+    IMY_NODE_LOOP_BEGIN,                        /* start of repeat section, link is its LOOP_END */
+    IMY_NODE_LOOP_END                           /* end of repeat section, link is its LOOP_BEGIN */
+} E_IMELODY_NODE;
+
+typedef struct
+{
+    EAS_U8          type;                       /* E_IMELODY_NODE */
+    EAS_U8          note;                       /* MIDI note number */
+    EAS_U8          velocity;                   /* MIDI velocity */
+    EAS_I32         duration;                   /* sounding (or silent) time in 256ths of a msec */
+    EAS_I32         rest;                       /* silence after the note in 256ths of a msec */
+    EAS_I32         link;                       /* index of the paired loop node (-1 if unpaired) */
+    EAS_I32         count;                      /* LOOP_END: extra passes, 0 for endless loop, -1 for no repeat */
+} S_IMELODY_NODE;
 
 /*----------------------------------------------------------------------------
  *
@@ -280,17 +414,21 @@ typedef struct
     EAS_I32         tickBase;                   /* basline length of 32nd note in 256th of a msec */
     EAS_I32         tick;                       /* actual length of 32nd note in 256th of a msec */
     EAS_I32         restTicks;                  /* ticks to rest after current note */
-    int             startLine;                  /* file offset at start of line (for repeats) */
-    int             repeatOffset;               /* file offset to start of repeat section */
-    EAS_I16         repeatCount;                /* repeat counter */
+    int             startLine;                  /* file offset at start of line (for error positions) */
     EAS_U8          state;                      /* current state EAS_STATE_XXXX */
     EAS_U8          style;                      /* from STYLE */
-    EAS_U8          index;                      /* index into buffer */
+    EAS_I32         index;                      /* index into the current line */
     EAS_U8          octave;                     /* octave prefix */
     EAS_U8          volume;                     /* current volume */
     EAS_U8          note;                       /* MIDI note number */
     EAS_I8          noteModifier;               /* sharp or flat */
-    EAS_I8          buffer[MAX_LINE_SIZE+1];    /* buffer for ASCII data */
+    const EAS_I8*   line;                       /* current line, in place in the source text */
+    EAS_I32         lineLen;                    /* its length without CR/LF */
+    EAS_I32         loopDepth;                  /* number of open repeat sections */
+    EAS_I32         loopStack[MAX_LOOP_DEPTH];  /* program index of open LOOP_BEGIN nodes */
+    EAS_I32         loopCount[MAX_LOOP_DEPTH];  /* their repeat counts (-1 if not given yet) */
+    std::vector<S_IMELODY_NODE>* program;       /* compiled melody */
+    size_t          programBase;                /* program index of its first node (a played stream drops nodes) */
 } S_IMELODY_DATA;
 
 
@@ -368,12 +506,58 @@ static void PutBackChar (S_IMELODY_DATA *pData)
 {
     if (pData->index)
         pData->index--;
-    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "PutBackChar '%c'\n", pData->buffer[pData->index]); */ }
+    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "PutBackChar '%c'\n", pData->line[pData->index]); */ }
 }
 #else
 void PutBackChar (S_IMELODY_DATA *pData) { if (pData->index) pData->index--; }
 #endif
 
+/* wait for more of the stream line being read (it always starts the buffer) */
+static void IMY_MoreLine (S_IMELODY_DATA *pData)
+{
+    MEM_FILE_HANDLE *fh = pData->fileHandle;
+    const char *eol;
+    EAS_I32 length;
+
+    if (StreamRead(fh) <= 0)
+    {
+        fh->partial = EAS_FALSE;
+        return;
+    }
+    eol = (const char*) memchr(fh->buf + pData->lineLen, '\n', fh->len - pData->lineLen);
+    length = eol ? (EAS_I32) (eol - fh->buf) : fh->len;
+    if (eol && (length > 0) && (fh->buf[length - 1] == '\r'))
+        length--;
+    pData->line = (const EAS_I8*) fh->buf;
+    pData->lineLen = length;
+    fh->pos = eol ? eol + 1 : fh->buf + fh->len;
+    fh->partial = (eol == NULL);
+}
+
+/* next character of the current line, 0 past its end */
+static inline EAS_I8 LineChar (S_IMELODY_DATA *pData)
+{
+    EAS_I32 i = pData->index++;
+    while ((i >= pData->lineLen) && pData->fileHandle->partial)
+        IMY_MoreLine(pData);
+    return (i < pData->lineLen) ? pData->line[i] : 0;
+}
+
+
+/* append a node to the compiled melody */
+static void IMY_Emit (S_IMELODY_DATA *pData, EAS_U8 type, EAS_U8 note, EAS_U8 velocity, EAS_I32 duration, EAS_I32 rest)
+{
+    S_IMELODY_NODE node;
+
+    node.type = type;
+    node.note = note;
+    node.velocity = velocity;
+    node.duration = duration;
+    node.rest = rest;
+    node.link = -1;
+    node.count = -1;
+    pData->program->push_back(node);
+}
 
 /* local prototypes */
 static EAS_RESULT IMY_CheckFileType (MEM_FILE_HANDLE* fileHandle, S_IMELODY_DATA* pData);
@@ -381,7 +565,7 @@ static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode);
 static EAS_RESULT IMY_State (EAS_VOID_PTR pInstData, EAS_STATE *pState);
 static EAS_RESULT IMY_Close (EAS_VOID_PTR pInstData);
 static EAS_BOOL IMY_PlayNote (S_IMELODY_DATA *pData, EAS_I8 note, EAS_INT parserMode);
-static EAS_BOOL IMY_PlayRest (S_IMELODY_DATA *pData);
+static EAS_BOOL IMY_PlayRest (S_IMELODY_DATA *pData, EAS_INT parserMode);
 static EAS_BOOL IMY_GetDuration (S_IMELODY_DATA *pData, EAS_I32 *pDuration);
 static EAS_BOOL IMY_GetLEDState (S_IMELODY_DATA *pData);
 static EAS_BOOL IMY_GetVibeState (S_IMELODY_DATA *pData);
@@ -390,8 +574,9 @@ static EAS_BOOL IMY_GetVolume (S_IMELODY_DATA *pData, EAS_BOOL inHeader);
 static EAS_BOOL IMY_GetNumber (S_IMELODY_DATA *pData, EAS_INT *temp, EAS_BOOL inHeader);
 static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData);
 static EAS_I8 IMY_GetNextChar (S_IMELODY_DATA *pData, EAS_BOOL inHeader);
-static EAS_RESULT IMY_ReadLine (MEM_FILE_HANDLE* fileHandle, EAS_I8 *buffer, int *pStartLine);
-static EAS_INT IMY_ParseLine (EAS_I8 *buffer, EAS_U8 *pIndex);
+static EAS_RESULT IMY_ReadLine (MEM_FILE_HANDLE* fileHandle, const EAS_I8 **pLine, EAS_I32 *pLength, int *pStartLine);
+static EAS_INT IMY_ParseLine (const EAS_I8 *line, EAS_I32 length, EAS_I32 *pIndex);
+static void IMY_Position (S_IMELODY_DATA *pData, int *pLine, int *pColumn);
 
 /*----------------------------------------------------------------------------
  * IMY_CheckFileType()
@@ -412,8 +597,9 @@ static EAS_INT IMY_ParseLine (EAS_I8 *buffer, EAS_U8 *pIndex);
 */
 static EAS_RESULT IMY_CheckFileType (MEM_FILE_HANDLE *fileHandle, S_IMELODY_DATA* pData)
 {
-    EAS_I8 buffer[MAX_LINE_SIZE+1];
-    EAS_U8 index;
+    const EAS_I8 *line;
+    EAS_I32 length;
+    EAS_I32 index;
 	EAS_INT t;
 
 #ifdef _DEBUG_IMELODY
@@ -421,11 +607,11 @@ static EAS_RESULT IMY_CheckFileType (MEM_FILE_HANDLE *fileHandle, S_IMELODY_DATA
 #endif
 
     /* read the first line of the file */
-    if (IMY_ReadLine(fileHandle, buffer, NULL) != EAS_SUCCESS)
+    if (IMY_ReadLine(fileHandle, &line, &length, NULL) != EAS_SUCCESS)
         return EAS_SUCCESS;
 
     /* check for header string */
-	t = IMY_ParseLine(buffer, &index);
+	t = IMY_ParseLine(line, length, &index);
     if ((t == TOKEN_BEGIN) || (t == TOKEN_BEGIN_E)) {
         memset(pData, 0, sizeof(S_IMELODY_DATA));
         /* initialize */
@@ -462,7 +648,6 @@ static EAS_RESULT IMY_CheckFileType (MEM_FILE_HANDLE *fileHandle, S_IMELODY_DATA
 static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode)
 {
     S_IMELODY_DATA* pData;
-    EAS_RESULT result;
     EAS_I8 c;
     EAS_BOOL eof;
     EAS_INT temp;
@@ -492,8 +677,7 @@ static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode)
 #ifdef _DEBUG_IMELODY
     { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "Stopping note %d\n", pData->note); */ }
 #endif
-        /* stop the note */
-        Mute();
+        /* the note node already has its rest */
         pData->note = 0;
 
         /* check for rest between notes */
@@ -536,16 +720,13 @@ static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode)
 					IMY_GetNextChar(pData, EAS_FALSE); /* assume ')' */
 					pData->noteModifier = 1;
 				} else {
-					if (pData->repeatOffset < 0)
-					{
-						pData->repeatOffset = pData->startLine + (EAS_I32) pData->index;
-
-#ifdef _DEBUG_IMELODY
-						{ /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "Repeat offset = %d\n", pData->repeatOffset); */ }
-#endif
-					}
-					else
-						{ /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Ignoring nested repeat section\n"); */ }
+					/* open a (possibly nested) loop, its end node will be linked later */
+					if (pData->loopDepth >= MAX_LOOP_DEPTH)
+						return EAS_ERROR_PARAMETER_RANGE;
+					pData->loopStack[pData->loopDepth] = (EAS_I32) (pData->programBase + pData->program->size());
+					pData->loopCount[pData->loopDepth] = -1;
+					pData->loopDepth++;
+					IMY_Emit(pData, IMY_NODE_LOOP_BEGIN, 0, 0, 0, 0);
 				}
                 break;
 
@@ -553,57 +734,34 @@ static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode)
             case ')':
 
 #ifdef _DEBUG_IMELODY
-                { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "End repeat section, repeat offset = %d\n", pData->repeatOffset); */ }
+                { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "End repeat section\n"); */ }
 #endif
-                /* ignore invalid repeats */
-                if (pData->repeatCount >= 0)
+                /* ignore unbalanced repeats */
+                if (pData->loopDepth > 0)
                 {
-
-                    /* decrement repeat count (repeatCount == 0 means infinite loop) */
-                    if (pData->repeatCount > 0)
-                    {
-                        if (--pData->repeatCount == 0)
-                        {
-                            pData->repeatCount = -1;
-#ifdef _DEBUG_IMELODY
-                            { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "Repeat loop complete\n"); */ }
-#endif
-                        }
-                    }
-
-//2 TEMPORARY FIX: If locating, don't do infinite loops.
-//3 We need a different mode for metadata parsing where we don't loop at all
-                    if ((parserMode == eParserModePlay) || (pData->repeatCount != 0))
-                    {
-
-#ifdef _DEBUG_IMELODY
-                        { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "Rewinding file for repeat\n"); */ }
-#endif
-                        /* rewind to start of loop */
-                        if ((result = EAS_HWFileSeek(pData->fileHandle, pData->repeatOffset)) != EAS_SUCCESS)
-                            return result;
-                        IMY_ReadLine(pData->fileHandle, pData->buffer, &pData->startLine);
-                        pData->index = 0;
-
-                        /* if last loop, prevent future loops */
-                        if (pData->repeatCount == -1)
-                            pData->repeatOffset = -1;
-                    }
+                    EAS_I32 begin;
+
+                    pData->loopDepth--;
+                    begin = pData->loopStack[pData->loopDepth];
+                    (*pData->program)[begin - pData->programBase].link = (EAS_I32) (pData->programBase + pData->program->size());
+                    IMY_Emit(pData, IMY_NODE_LOOP_END, 0, 0, 0, 0);
+                    pData->program->back().link = begin;
+                    pData->program->back().count = pData->loopCount[pData->loopDepth];
                 }
                 break;
 
-            /* repeat count */
+            /* repeat count (0 means endless loop) */
             case '@':
                 if (!IMY_GetNumber(pData, &temp, EAS_FALSE))
                     eof = EAS_TRUE;
-                else if (pData->repeatOffset > 0)
+                else if (pData->loopDepth > 0)
                 {
 
 #ifdef _DEBUG_IMELODY
-                    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "Repeat count = %dt", pData->repeatCount); */ }
+                    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "Repeat count = %d", temp); */ }
 #endif
-                    if (pData->repeatCount < 0)
-                        pData->repeatCount = (EAS_I16) temp;
+                    if (pData->loopCount[pData->loopDepth - 1] < 0)
+                        pData->loopCount[pData->loopDepth - 1] = temp;
                 }
                 break;
 
@@ -644,9 +802,9 @@ static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode)
                     eof = EAS_TRUE;
                 break;
 
-            /* either a B note or backon or backoff */
+            /* either a B note or backon or backoff (eMelody has no backlight, there "ba" are two notes) */
             case 'b':
-                if (IMY_GetNextChar(pData, EAS_FALSE) == 'a')
+                if ((IMY_GetNextChar(pData, EAS_FALSE) == 'a') && (pData->subType != 'E'))
                 {
                     if (!IMY_GetBackState(pData))
                         eof = EAS_TRUE;
@@ -654,6 +812,9 @@ static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode)
                 else
                 {
                     PutBackChar(pData);
+                    /* lowercase is a short note in eMelody */
+                    if (pData->subType == 'E')
+                        pData->durationEMY = '3';
                     if (IMY_PlayNote(pData, c, parserMode))
                         return EAS_SUCCESS;
                     eof = EAS_TRUE;
@@ -663,7 +824,7 @@ static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode)
             /* rest */
             case 'r':
             case 'R':
-                if (IMY_PlayRest(pData))
+                if (IMY_PlayRest(pData, parserMode))
                     return EAS_SUCCESS;
                 eof = EAS_TRUE;
                 break;
@@ -671,13 +832,13 @@ static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode)
             /* EMelody pause (rest) */
             case 'p':
 				pData->durationEMY = '3';
-                if (IMY_PlayRest(pData))
+                if (IMY_PlayRest(pData, parserMode))
                     return EAS_SUCCESS;
                 eof = EAS_TRUE;
 				break;
             case 'P':
 				pData->durationEMY = '1';
-                if (IMY_PlayRest(pData))
+                if (IMY_PlayRest(pData, parserMode))
                     return EAS_SUCCESS;
                 eof = EAS_TRUE;
 				break;
@@ -706,8 +867,12 @@ static EAS_RESULT IMY_Event (EAS_VOID_PTR pInstData, EAS_INT parserMode)
                         return EAS_SUCCESS;
                     eof = EAS_TRUE;
                 }
-                else
-                    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Ignoring unexpected character '%c' [0x%02x]\n", c, c); */ }
+                else if (Debug)
+                {
+                    int line, column;
+                    IMY_Position(pData, &line, &column);
+                    printf("Ignoring unexpected character '%c' at line %d, column %d\n", c, line, column);
+                }
                 break;
         }
     }
@@ -849,7 +1014,7 @@ static EAS_BOOL IMY_PlayNote (S_IMELODY_DATA *pData, EAS_I8 note, EAS_INT parser
 	}
     velocity = (EAS_U8) (pData->volume ? pData->volume * IMELODY_VEL_MUL + IMELODY_VEL_OFS : 0);
     if (Debug) {
-    	printf("Playing note %d(%c), velocity %d, duration %d ticks\n", pData->note, note, velocity, duration);
+    	printf("Note %d(%c), velocity %d, duration %d ticks\n", pData->note, note, velocity, duration);
     }
 
 #ifdef _DEBUG_IMELODY
@@ -882,13 +1047,11 @@ static EAS_BOOL IMY_PlayNote (S_IMELODY_DATA *pData, EAS_I8 note, EAS_INT parser
 	/* reset EMelody default octave shift */
 	pData->octaveShift = 0;
 
-    /* start note only if in play mode */
-    if (parserMode == eParserModePlay)
-        Play(pData->note, velocity, ((duration - pData->restTicks) * 1000) / 256);
-    Mute();
-	if (pData->restTicks != 0) {
-		this_thread::sleep_for(microseconds((pData->restTicks * 1000)/ 256));
-	}
+    /* silent note is just a rest */
+    if (velocity == 0)
+        IMY_Emit(pData, IMY_NODE_REST, 0, 0, duration, 0);
+    else
+        IMY_Emit(pData, IMY_NODE_NOTE, pData->note, velocity, duration - pData->restTicks, pData->restTicks);
     return EAS_TRUE;
 }
 
@@ -908,7 +1071,7 @@ static EAS_BOOL IMY_PlayNote (S_IMELODY_DATA *pData, EAS_I8 note, EAS_INT parser
  *
  *----------------------------------------------------------------------------
 */
-static EAS_BOOL IMY_PlayRest (S_IMELODY_DATA *pData)
+static EAS_BOOL IMY_PlayRest (S_IMELODY_DATA *pData, EAS_INT parserMode)
 {
     EAS_I32 duration;
 
@@ -929,7 +1092,7 @@ static EAS_BOOL IMY_PlayRest (S_IMELODY_DATA *pData)
     if (Debug) {
     	printf("Pause for %d ticks\n", duration);
     }
-    this_thread::sleep_for(microseconds((duration * 1000)/ 256));
+    IMY_Emit(pData, IMY_NODE_REST, 0, 0, duration, 0);
     return EAS_TRUE;
 }
 
@@ -958,10 +1121,10 @@ static EAS_BOOL IMY_GetDuration (S_IMELODY_DATA *pData, EAS_I32 *pDuration)
     /* get the duration */
     *pDuration = 0;
 
-	/* EMelody case */
+	/* EMelody case (a stream line end completes the note, it is not waited past) */
 	if (pData->subType == 'E') {
 		duration = pData->tick * (1 << ('5' - pData->durationEMY));
-		c = IMY_GetNextChar(pData, EAS_FALSE);
+		c = IMY_GetNextChar(pData, pData->fileHandle->streamed);
 		if (!c) {
 			*pDuration = duration;
 			return EAS_TRUE;
@@ -991,7 +1154,7 @@ static EAS_BOOL IMY_GetDuration (S_IMELODY_DATA *pData, EAS_I32 *pDuration)
     duration = pData->tick * (1 << ('5' - c));
 
     /* check for duration modifier */
-    c = IMY_GetNextChar(pData, EAS_FALSE);
+    c = IMY_GetNextChar(pData, pData->fileHandle->streamed);
     if (c)
     {
         if (c == '.')
@@ -1335,7 +1498,7 @@ static EAS_BOOL IMY_GetVersion (S_IMELODY_DATA *pData, EAS_INT *pVersion)
     version = temp = 0;
     for (;;)
     {
-        c = pData->buffer[pData->index++];
+        c = LineChar(pData);
         if ((c == 0) || (c == '.'))
         {
             version = (version << 8) + temp;
@@ -1374,7 +1537,7 @@ static EAS_BOOL IMY_GetVersion (S_IMELODY_DATA *pData, EAS_INT *pVersion)
  *
  *----------------------------------------------------------------------------
 */
-static void IMY_MetaData (S_IMELODY_DATA *pData, E_EAS_METADATA_TYPE metaType, EAS_I8 *buffer)
+static void IMY_MetaData (S_IMELODY_DATA *pData, E_EAS_METADATA_TYPE metaType, const EAS_I8 *buffer)
 {
 return;
 }
@@ -1393,8 +1556,6 @@ static void InitData(S_IMELODY_DATA* pData) {
     pData->restTicks = 0;
     pData->volume = 7;
     pData->octave = 60;
-    pData->repeatOffset = -1;
-    pData->repeatCount = -1;
     pData->style = 1;
 
 }
@@ -1438,7 +1599,7 @@ static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData)
         /* read a line from the file and parse the token */
         if (pData->index != 0)
         {
-            if ((result = IMY_ReadLine(pData->fileHandle, pData->buffer, &pData->startLine)) != EAS_SUCCESS)
+            if ((result = IMY_ReadLine(pData->fileHandle, &pData->line, &pData->lineLen, &pData->startLine)) != EAS_SUCCESS)
             {
 #ifdef _DEBUG_IMELODY
                 { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "IMY_ParseHeader: IMY_ReadLine returned %d\n", result); */ }
@@ -1446,7 +1607,7 @@ static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData)
                 return result;
             }
         }
-        token = IMY_ParseLine(pData->buffer, &pData->index);
+        token = IMY_ParseLine(pData->line, pData->lineLen, &pData->index);
 
         switch (token)
         {
@@ -1458,7 +1619,7 @@ static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData)
             case TOKEN_FORMAT:
                 if (!IMY_GetVersion(pData, &temp))
                 {
-                    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Invalid FORMAT field '%s'\n", pData->buffer); */ }
+                    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Invalid FORMAT field '%s'\n", pData->line); */ }
                     return EAS_ERROR_FILE_FORMAT;
                 }
                 if (Debug) {
@@ -1474,7 +1635,7 @@ static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData)
             case TOKEN_VERSION:
                 if (!IMY_GetVersion(pData, &temp))
                 {
-                    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Invalid VERSION field '%s'\n", pData->buffer); */ }
+                    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Invalid VERSION field '%s'\n", pData->line); */ }
                     return EAS_ERROR_FILE_FORMAT;
                 }
                 if (Debug) {
@@ -1491,14 +1652,14 @@ static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData)
                 if (Debug) {
                 	printf("Token NAME:\n");
                 }
-                IMY_MetaData(pData, EAS_METADATA_TITLE, pData->buffer + pData->index);
+                IMY_MetaData(pData, EAS_METADATA_TITLE, pData->line + pData->index);
                 break;
 
             case TOKEN_COMPOSER:
                 if (Debug) {
                 	printf("Token COMPOSER:\n");
                 }
-                IMY_MetaData(pData, EAS_METADATA_AUTHOR, pData->buffer + pData->index);
+                IMY_MetaData(pData, EAS_METADATA_AUTHOR, pData->line + pData->index);
                 break;
 
             /* handle beat */
@@ -1524,7 +1685,7 @@ static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData)
                 else
                 {
                     PutBackChar(pData);
-                    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Error in style command: %s\n", pData->buffer); */ }
+                    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Error in style command: %s\n", pData->line); */ }
                 }
                 break;
 
@@ -1536,7 +1697,7 @@ static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData)
                     PutBackChar(pData);
                     if (!isdigit(c))
                     {
-                        { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Error in volume command: %s\n", pData->buffer); */ }
+                        { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Error in volume command: %s\n", pData->line); */ }
                         break;
                     }
                 }
@@ -1569,7 +1730,7 @@ static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData)
                 }
                 /* force a read of the next line */
                 pData->index = 1;
-                { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Ignoring unrecognized token in iMelody file: %s\n", pData->buffer); */ }
+                { /* dpp: EAS_ReportEx(_EAS_SEVERITY_WARNING, "Ignoring unrecognized token in iMelody file: %s\n", pData->line); */ }
                 break;
         }
     }
@@ -1594,15 +1755,15 @@ static EAS_RESULT IMY_ParseHeader (S_IMELODY_DATA* pData)
 static EAS_I8 IMY_GetNextChar (S_IMELODY_DATA *pData, EAS_BOOL inHeader)
 {
     EAS_I8 c;
-    EAS_U8 index;
+    EAS_I32 index;
 	EAS_INT t;
 
     for (;;)
     {
         /* get next character */
-        c = pData->buffer[pData->index++];
+        c = LineChar(pData);
 
-        /* buffer empty, read more */
+        /* end of line, read more */
         if (!c)
         {
             /* don't read the next line in the header */
@@ -1610,8 +1771,8 @@ static EAS_I8 IMY_GetNextChar (S_IMELODY_DATA *pData, EAS_BOOL inHeader)
                 return 0;
 
             pData->index = 0;
-            pData->buffer[0] = 0;
-            if (IMY_ReadLine(pData->fileHandle, pData->buffer, &pData->startLine) != EAS_SUCCESS)
+            pData->lineLen = 0;
+            if (IMY_ReadLine(pData->fileHandle, &pData->line, &pData->lineLen, &pData->startLine) != EAS_SUCCESS)
             {
 #ifdef _DEBUG_IMELODY
                 { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "IMY_GetNextChar: EOF\n"); */ }
@@ -1620,13 +1781,13 @@ static EAS_I8 IMY_GetNextChar (S_IMELODY_DATA *pData, EAS_BOOL inHeader)
             }
 
             /* check for END:IMELODY token */
-			t = IMY_ParseLine(pData->buffer, &index);
+			t = IMY_ParseLine(pData->line, pData->lineLen, &index);
             if ((t == TOKEN_END) || (t == TOKEN_END_E))
             {
 #ifdef _DEBUG_IMELODY
                 { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "IMY_GetNextChar: found END:IMELODY\n"); */ }
 #endif
-                pData->buffer[0] = 0;
+                pData->lineLen = 0;
                 return 0;
             }
             continue;
@@ -1644,11 +1805,96 @@ static EAS_I8 IMY_GetNextChar (S_IMELODY_DATA *pData, EAS_BOOL inHeader)
     }
 }
 
+/*----------------------------------------------------------------------------
+ * IMY_LineDecided()
+ *----------------------------------------------------------------------------
+ * Purpose:
+ * The start of a stream line read so far tells the token of the line
+ * (the line may not be complete: the melody has to be played as it comes)
+ *----------------------------------------------------------------------------
+*/
+static EAS_BOOL IMY_LineDecided (const char *line, EAS_I32 length)
+{
+    EAS_INT i;
+    EAS_INT j;
+
+    for (i = 0; i < TOKEN_INVALID; i++)
+    {
+        for (j = 0; (j < length) && tokens[i][j] && (tokens[i][j] == toupper(line[j])); j++)
+            ;
+        /* a token may still come */
+        if ((j == length) && tokens[i][j])
+            return EAS_FALSE;
+    }
+    return EAS_TRUE;
+}
+
+/*----------------------------------------------------------------------------
+ * IMY_ReadStreamLine()
+ *----------------------------------------------------------------------------
+ * Purpose:
+ * IMY_ReadLine for streams: drops what is left of the current line and moves
+ * the next one to the start of the buffer, returning it as soon as its token
+ * is known. The rest of the line is read by LineChar when it gets there.
+ *----------------------------------------------------------------------------
+*/
+static EAS_RESULT IMY_ReadStreamLine (MEM_FILE_HANDLE* fileHandle, const EAS_I8 **pLine, EAS_I32 *pLength, int *pStartLine)
+{
+    const char *eol;
+    EAS_I32 length;
+    EAS_I32 rest;
+    int result;
+
+    for (;;)
+    {
+        if (fileHandle->partial)
+        {
+            eol = (const char*) memchr(fileHandle->pos, '\n', fileHandle->buf + fileHandle->len - fileHandle->pos);
+            fileHandle->pos = eol ? eol + 1 : fileHandle->buf + fileHandle->len;
+            fileHandle->partial = (eol == NULL);
+        }
+        rest = (EAS_I32) (fileHandle->buf + fileHandle->len - fileHandle->pos);
+        memmove((char*) fileHandle->buf, fileHandle->pos, rest);
+        fileHandle->len = rest;
+        fileHandle->pos = fileHandle->buf;
+        if (!fileHandle->partial)
+            break;
+        if ((result = StreamRead(fileHandle)) <= 0)
+            return (result < 0) ? result : EAS_EOF;
+    }
+
+    for (;;)
+    {
+        eol = (const char*) memchr(fileHandle->buf, '\n', fileHandle->len);
+        if (eol || ((fileHandle->len > 0) && IMY_LineDecided(fileHandle->buf, fileHandle->len)))
+            break;
+        if ((result = StreamRead(fileHandle)) < 0)
+            return result;
+        if ((result == 0) && (fileHandle->len == 0))
+            return EAS_EOF;
+        if (result == 0)
+            break;
+    }
+
+    length = eol ? (EAS_I32) (eol - fileHandle->buf) : fileHandle->len;
+    if (eol && (length > 0) && (fileHandle->buf[length - 1] == '\r'))
+        length--;
+    *pLine = (const EAS_I8*) fileHandle->buf;
+    *pLength = length;
+    fileHandle->pos = eol ? eol + 1 : fileHandle->buf + fileHandle->len;
+    fileHandle->partial = (eol == NULL) && !fileHandle->eof;
+    fileHandle->lines++;
+    if (pStartLine != NULL)
+        *pStartLine = 0;
+    return EAS_SUCCESS;
+}
+
 /*----------------------------------------------------------------------------
  * IMY_ReadLine()
  *----------------------------------------------------------------------------
  * Purpose:
- * Reads a line of input from the file, discarding the CR/LF
+ * Finds the next line of input in place, without the CR/LF
+ * (there is no line length limit and nothing is copied)
  *
  * Inputs:
  *
@@ -1660,11 +1906,15 @@ static EAS_I8 IMY_GetNextChar (S_IMELODY_DATA *pData, EAS_BOOL inHeader)
  *
  *----------------------------------------------------------------------------
 */
-static EAS_RESULT IMY_ReadLine (MEM_FILE_HANDLE* fileHandle, EAS_I8 *buffer, int *pStartLine)
+static EAS_RESULT IMY_ReadLine (MEM_FILE_HANDLE* fileHandle, const EAS_I8 **pLine, EAS_I32 *pLength, int *pStartLine)
 {
     EAS_RESULT result;
-    EAS_INT i;
-    EAS_I8 c;
+    const char *end;
+    const char *eol;
+    EAS_I32 length;
+
+    if (fileHandle->streamed)
+        return IMY_ReadStreamLine(fileHandle, pLine, pLength, pStartLine);
 
     /* fetch current file position and save it */
     if (pStartLine != NULL)
@@ -1678,28 +1928,22 @@ static EAS_RESULT IMY_ReadLine (MEM_FILE_HANDLE* fileHandle, EAS_I8 *buffer, int
         }
     }
 
-    buffer[0] = 0;
-    for (i = 0; i < MAX_LINE_SIZE; )
-    {
-        if ((result = EAS_HWGetByte(fileHandle, &c)) != EAS_SUCCESS)
-        {
-            if ((result == EAS_EOF) && (i > 0))
-                break;
-            return result;
-        }
-
-        /* return on LF or end of data */
-        if (c == '\n')
-            break;
+    end = fileHandle->buf + fileHandle->len;
+    if (fileHandle->pos >= end)
+        return EAS_EOF;
 
-        /* store characters in buffer */
-        if (c != '\r')
-            buffer[i++] = c;
-    }
-    buffer[i] = 0;
+    /* line ends at LF or end of data */
+    if ((eol = (const char*) memchr(fileHandle->pos, '\n', end - fileHandle->pos)) == NULL)
+        eol = end;
+    length = (EAS_I32) (eol - fileHandle->pos);
+    if ((length > 0) && (fileHandle->pos[length - 1] == '\r'))
+        length--;
+    *pLine = (const EAS_I8*) fileHandle->pos;
+    *pLength = length;
+    fileHandle->pos = (eol < end) ? eol + 1 : end;
 
 #ifdef _DEBUG_IMELODY
-    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "IMY_ReadLine read %s\n", buffer); */ }
+    { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "IMY_ReadLine read %.*s\n", length, *pLine); */ }
 #endif
 
     return EAS_SUCCESS;
@@ -1721,7 +1965,7 @@ static EAS_RESULT IMY_ReadLine (MEM_FILE_HANDLE* fileHandle, EAS_I8 *buffer, int
  *
  *----------------------------------------------------------------------------
 */
-static EAS_INT IMY_ParseLine (EAS_I8 *buffer, EAS_U8 *pIndex)
+static EAS_INT IMY_ParseLine (const EAS_I8 *line, EAS_I32 length, EAS_I32 *pIndex)
 {
     EAS_INT i;
     EAS_INT j;
@@ -1737,10 +1981,10 @@ static EAS_INT IMY_ParseLine (EAS_I8 *buffer, EAS_U8 *pIndex)
 #ifdef _DEBUG_IMELODY
                 { /* dpp: EAS_ReportEx(_EAS_SEVERITY_DETAIL, "IMY_ParseLine found token %d\n", i); */ }
 #endif
-                *pIndex = (EAS_U8) j;
+                *pIndex = j;
                 return i;
             }
-            if (tokens[i][j] != toupper(buffer[j]))
+            if ((j >= length) || (tokens[i][j] != toupper(line[j])))
                 break;
         }
     }
@@ -1750,43 +1994,275 @@ static EAS_INT IMY_ParseLine (EAS_I8 *buffer, EAS_U8 *pIndex)
     return TOKEN_INVALID;
 }
 
+//
+// Line and column of the last character read, for error messages
+//
+static void IMY_Position (S_IMELODY_DATA *pData, int *pLine, int *pColumn)
+{
+    const char *p;
+
+    if (pData->fileHandle->streamed)
+    {
+        *pLine = pData->fileHandle->lines;
+        *pColumn = (pData->index > 0) ? pData->index : 1;
+        return;
+    }
+    *pLine = 1;
+    for (p = pData->fileHandle->buf; p < pData->fileHandle->buf + pData->startLine; ++p)
+    {
+        if (*p == '\n')
+            (*pLine)++;
+    }
+    *pColumn = (pData->index > 0) ? pData->index : 1;
+}
+
+
+//
+// Melody engine instance: source text, parser state and compiled program
+//
+struct TMelody {
+	MEM_FILE_HANDLE src;
+	S_IMELODY_DATA data;
+	std::vector<S_IMELODY_NODE> program;
+};
+
+//
+// Translate the whole prepared melody into the node program, so that nothing
+// is parsed while the melody is playing
+//
+static int IMY_Compile(S_IMELODY_DATA *pData) {
+  int result;
+  EAS_I32 playerState;
+
+	pData->program->clear();
+	pData->programBase = 0;
+	pData->loopDepth = 0;
+    pData->state = EAS_STATE_READY;
+	// streams are parsed while they are played
+	if (pData->fileHandle->streamed) {
+		return 1;
+	}
+	do {
+		if ((result = IMY_Event(pData, eParserModeCompile)) != EAS_SUCCESS) {
+			int line, column;
+			IMY_Position(pData, &line, &column);
+			printf("Error parsing %s at line %d, column %d: %d\n", pData->fileHandle->fname, line, column, result);
+			return -1;
+		}
+		IMY_State(pData, &playerState);
+		if (playerState == EAS_STATE_ERROR) {
+			printf("Error parsing %s\n", pData->fileHandle->fname);
+			return -1;
+		}
+	} while (playerState != EAS_STATE_STOPPED);
+	if (Debug) {
+		printf("Compiled %cMelody into %d nodes\n", pData->subType, (int)pData->program->size());
+	}
+	return 1;
+}
+
+//
+// Have node pc of the program ready, parsing a stream as far as it takes
+// (EAS_EOF past the end of the melody)
+//
+static int IMY_Fetch(S_IMELODY_DATA *pData, size_t pc) {
+  int result;
+  EAS_I32 playerState;
+
+	while (pc >= pData->programBase + pData->program->size()) {
+		IMY_State(pData, &playerState);
+		if (playerState == EAS_STATE_STOPPED) {
+			return EAS_EOF;
+		}
+		if ((result = IMY_Event(pData, eParserModeCompile)) != EAS_SUCCESS) {
+			int line, column;
+			IMY_Position(pData, &line, &column);
+			printf("Error parsing %s at line %d, column %d: %d\n", pData->fileHandle->fname, line, column, result);
+			return result;
+		}
+	}
+	return EAS_SUCCESS;
+}
+
+//
+// Drop the played nodes of a stream that no repeat goes back to, so that an
+// endless stream is played in constant memory
+//
+static void IMY_Trim(S_IMELODY_DATA *pData, size_t keep, std::vector<EAS_I32> &remaining) {
+  size_t n = keep - pData->programBase;
+
+	if (n < STREAM_TRIM) {
+		return;
+	}
+	pData->program->erase(pData->program->begin(), pData->program->begin() + n);
+	remaining.erase(remaining.begin(), remaining.begin() + n);
+	pData->programBase = keep;
+}
+
+//
+// Execute the node program: play it against absolute deadlines or,
+// if tl is given, lower it into the timeline (endless loops are refused then)
+//
+static int IMY_Run(S_IMELODY_DATA *pData, TTimeline *tl) {
+  const std::vector<S_IMELODY_NODE> &prog = *pData->program;
+  MEM_FILE_HANDLE *fh = pData->fileHandle;
+  std::vector<EAS_I32> remaining;	// by program index less programBase
+  std::vector<size_t> sections;		// LOOP_BEGIN nodes of the repeat sections being played
+  long long t = 0;		// 1/256 msec from the melody start
+  bool sounding = false;
+  TPoint t0 = NOW, end;
+  int result;
+
+	for (size_t pc = 0; ; ++pc) {
+		// a stream late with the next node mutes the note sounding in time,
+		// and the melody goes on from the moment the node comes
+		end = t0 + microseconds((t * 1000) / 256);
+		fh->muteAt = sounding ? &end : NULL;
+		if ((result = IMY_Fetch(pData, pc)) != EAS_SUCCESS) {
+			break;
+		}
+		sounding = (fh->muteAt != NULL);
+		if (fh->stalled) {
+			fh->stalled = false;
+			if (!tl && (NOW > end)) {
+				t0 = NOW - microseconds((t * 1000) / 256);
+			}
+		}
+		if (remaining.size() < prog.size()) {
+			remaining.resize(prog.size(), 0);
+		}
+		if (fh->streamed && !tl) {
+			IMY_Trim(pData, sections.empty() ? pc : sections.front(), remaining);
+		}
+		const S_IMELODY_NODE &node = prog[pc - pData->programBase];
+		switch (node.type) {
+		case IMY_NODE_NOTE:
+			if (tl) {
+				TNote n;
+				n.start = (unsigned long)((t * 1000) / 256);
+				n.duration = (unsigned long)(((long long)node.duration * 1000) / 256);
+				n.pitch = node.note;
+				n.velocity = node.velocity;
+				n.channel = IMELODY_CHANNEL;
+				n.track = 0;
+				n.voice = 0;
+				n.arpeggio = 0;
+				tl->notes.push_back(n);
+			} else {
+				WaitUntil(t0 + microseconds((t * 1000) / 256));
+				Sound(node.note, node.velocity);
+				sounding = true;
+			}
+			t += node.duration;
+			if (node.rest && sounding) {
+				WaitUntil(t0 + microseconds((t * 1000) / 256));
+				Mute();
+				sounding = false;
+			}
+			t += node.rest;
+			break;
+		case IMY_NODE_REST:
+			if (sounding) {
+				WaitUntil(t0 + microseconds((t * 1000) / 256));
+				Mute();
+				sounding = false;
+			}
+			t += node.duration;
+			break;
+		case IMY_NODE_LOOP_BEGIN:
+			// the repeat count is taken at the end of the first pass (a stream
+			// may not have the end of the section yet)
+			remaining[pc - pData->programBase] = -1;
+			sections.push_back(pc);
+			break;
+		case IMY_NODE_LOOP_END:
+			if (node.count == 0) {
+				if (tl) {
+					return EAS_ERROR_FEATURE_NOT_AVAILABLE;
+				}
+				pc = node.link;
+				break;
+			}
+			if (remaining[node.link - pData->programBase] < 0) {
+				remaining[node.link - pData->programBase] = node.count;
+			}
+			if (remaining[node.link - pData->programBase] > 0) {
+				remaining[node.link - pData->programBase]--;
+				pc = node.link;
+			} else {
+				sections.pop_back();
+			}
+			break;
+		}
+	}
+	fh->muteAt = NULL;
+	if (result != EAS_EOF) {
+		return result;
+	}
+	if (tl) {
+		tl->length = (unsigned long)((t * 1000) / 256);
+	} else {
+		WaitUntil(t0 + microseconds((t * 1000) / 256));
+		Mute();
+	}
+	return EAS_SUCCESS;
+}
 
-static MEM_FILE_HANDLE src;
-static S_IMELODY_DATA data;
 
+TMelody *NewMelody() {
+  TMelody *m = new TMelody;
+	memset(&m->src, 0, sizeof(m->src));
+	memset(&m->data, 0, sizeof(m->data));
+	m->data.fileHandle = &m->src;
+	m->data.program = &m->program;
+	return m;
+}
+
+void DeleteMelody(TMelody *m) {
+	if (m) {
+		CleanupMelody(m);
+		delete m;
+	}
+}
 
-int PrepareMelodyFile(const char *filename) {
+int PrepareMelodyFile(TMelody *m, const char *filename) {
   int result;
-	memset(&src, 0, sizeof(src));
+  S_IMELODY_DATA *pData = &m->data;
+	CleanupMelody(m);
     if (Debug) {
     	printf("Preparing to play <I/E>Melody file [%s]...\n", filename);
     }
-	if ((result = GetFile(filename, &src)) != EAS_SUCCESS) {
+	if ((result = GetFile(filename, &m->src)) != EAS_SUCCESS) {
 		printf("Error reading file %s: %d\n", filename, result);
 		return -1;
 	}
-	if (((result = IMY_CheckFileType(&src, &data)) != EAS_SUCCESS) || 
-		(data.state != EAS_STATE_OPEN)) {
+	if (((result = IMY_CheckFileType(&m->src, pData)) != EAS_SUCCESS) || 
+		(pData->state != EAS_STATE_OPEN)) {
 		printf("Error checking file %s type: %d\n", filename, result);
 		return -1;
 	}
+	pData->program = &m->program;
     /* parse the header */
-    if ((result = IMY_ParseHeader(&data)) != EAS_SUCCESS) {
-		printf("Error parsing file %s header: %d\n", filename, result);
+    if ((result = IMY_ParseHeader(pData)) != EAS_SUCCESS) {
+		int line, column;
+		IMY_Position(pData, &line, &column);
+		printf("Error parsing file %s header at line %d, column %d: %d\n", filename, line, column, result);
 		return -1;
 	}
-	return 1;
+	return IMY_Compile(pData);
 }
 
-int PrepareMelodyString(const char *str, char type) {
+int PrepareMelodyString(TMelody *m, const char *str, char type) {
   int result;
-	memset(&src, 0, sizeof(src));
-	if ((result = GetString(str, &src)) != EAS_SUCCESS) {
+  S_IMELODY_DATA *pData = &m->data;
+	CleanupMelody(m);
+	if ((result = GetString(str, &m->src)) != EAS_SUCCESS) {
 		printf("Error getting string %s: %d\n", str, result);
 		return -1;
 	}
-	S_IMELODY_DATA *pData = &data;
-    pData->fileHandle = &src;
+	memset(pData, 0, sizeof(*pData));
+    pData->fileHandle = &m->src;
+    pData->program = &m->program;
     pData->fileOffset = 0;
     pData->state = EAS_STATE_OPEN;
 	InitData(pData);
@@ -1796,40 +2272,80 @@ int PrepareMelodyString(const char *str, char type) {
     if (Debug) {
     	printf("Preparing to play %cMelody string [%s]...\n", pData->subType, str);
     }
-    if ((result = IMY_ReadLine(pData->fileHandle, pData->buffer, &pData->startLine)) != EAS_SUCCESS) {
+    if ((result = IMY_ReadLine(pData->fileHandle, &pData->line, &pData->lineLen, &pData->startLine)) != EAS_SUCCESS) {
         return -1;
     }
-	return 1;
+	return IMY_Compile(pData);
 }
 
-int PlayMelody() {
-  int result;
-  int playerState;
-  S_IMELODY_DATA *pData = &data;
+int PlayMelody(TMelody *m) {
+  S_IMELODY_DATA *pData = &m->data;
 
     if (Debug) {
     	printf("Playing %cMelody\n", pData->subType);
     }
-    pData->state = EAS_STATE_READY;
-	do {
-		if ((result = IMY_Event(pData, eParserModePlay)) != EAS_SUCCESS) {
-			printf("Error parsing %s: %d\n", pData->fileHandle->fname, result);
-			return -1;
+	if (IMY_Run(pData, NULL) != EAS_SUCCESS) {
+		printf("Error playing %s\n", pData->fileHandle->fname);
+		return -1;
+	}
+	return 1;
+}
+
+
+//
+// Lower the whole prepared melody into a timeline without playing it.
+// Fails for melodies with endless repeat sections.
+//
+int CompileMelody(TMelody *m, TTimeline &tl) {
+  int result;
+  S_IMELODY_DATA *pData = &m->data;
+
+	tl.notes.clear();
+	tl.length = 0;
+	// a stream would have to be read to its end first
+	if (pData->fileHandle->streamed) {
+		if (Debug) {
+			printf("Not compiling stream %s\n", pData->fileHandle->fname);
 		}
-		IMY_State(pData, &playerState);
-		if (playerState == EAS_STATE_ERROR) {
-			printf("Error playing %s\n", pData->fileHandle->fname);
-			return -1;
+		return -1;
+	}
+	if ((result = IMY_Run(pData, &tl)) != EAS_SUCCESS) {
+		if (Debug) {
+			printf("Unable to compile %s: %d\n", pData->fileHandle->fname, result);
 		}
-	} while (playerState != EAS_STATE_STOPPED);
+		return -1;
+	}
+	if (Debug) {
+		printf("Compiled %cMelody: %d notes, length %lu ms\n", pData->subType, (int)tl.notes.size(), tl.length / 1000);
+	}
 	return 1;
 }
 
+//
+// Compile melody file into a timeline with a private engine (safe to call from several threads)
+//
+int CompileMelodyFile(const char *filename, TTimeline &tl) {
+  TMelody *m = NewMelody();
+  int rc;
 
-int CleanupMelody() {
+	if ((rc = PrepareMelodyFile(m, filename)) > 0) {
+		rc = CompileMelody(m, tl);
+	}
+	DeleteMelody(m);
+	return rc;
+}
+
+
+//
+// Release the source text (the compiled program is kept until the next Prepare)
+//
+int CleanupMelody(TMelody *m) {
+	if (m->src.buf == NULL) {
+		return 1;
+	}
     if (Debug) {
     	printf("Melody cleanup\n");
     }
-	IMY_Close(&data);
+	IMY_Close(&m->data);
 	return 1;
 }
@@ -5,10 +5,22 @@
  * # SPDX-License-Identifier: Apache-2.0
 */
 
+#include "pwm-player-timeline.h"
+
+/*
+ * iMelody/eMelody engine; every instance is independent, so melodies may be
+ * prepared on other threads while one is playing
+ */
+typedef struct TMelody TMelody;
+
 /*
  * iMelody/eMelody handling functions
  */
-int PrepareMelodyFile(const char *filename);
-int PrepareMelodyString(const char *str, char type);
-int PlayMelody();
-int CleanupMelody();
+TMelody *NewMelody();
+void DeleteMelody(TMelody *m);
+int PrepareMelodyFile(TMelody *m, const char *filename);
+int PrepareMelodyString(TMelody *m, const char *str, char type);
+int PlayMelody(TMelody *m);
+int CompileMelody(TMelody *m, TTimeline &tl);
+int CompileMelodyFile(const char *filename, TTimeline &tl);
+int CleanupMelody(TMelody *m);
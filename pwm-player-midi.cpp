@@ -6,11 +6,16 @@
  * based on sources from https://code.soundsoftware.ac.uk/projects/midifile/repository
  */
 #include "pwm-player.h"
+#include "pwm-player-pwm.h"
 #include "pwm-player-midi.h"
 
 #include "MIDIEvent.h"
 #include "MIDIComposition.h"
 #include "MIDIFileReader.h"
+
+#include <queue>
+#include <set>
+#include <algorithm>
 using namespace MIDIConstants;
 
 __attribute__ ((used)) static char s_RCSVersion[] = "$Id: pwm-player-midi.cpp 285 2022-12-31 14:56:40Z maxwolf $";
@@ -18,6 +23,69 @@ __attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pw
 
 MIDIFileReader *Fr = NULL;
 
+//
+// per-track index of NOTE_ON events, one entry per note ordinal, with a snapshot
+// of the playback state in effect at that event
+//
+typedef struct {
+	unsigned long long us;     // absolute time of the note (same tempo rules as PlayMIDIFile)
+	size_t pos;                // event position in the track
+	long tempo;                // microseconds per beat in effect (0 if no tempo event was seen yet)
+} TNoteIndexEntry;
+
+static map<unsigned int, vector<TNoteIndexEntry> > NoteIndex;
+
+//
+// Build note index for all tracks with a single pass over the composition
+//
+static void IndexMIDIFile() {
+    MIDIComposition &cmp = Fr->getComposition();
+    int td = Fr->getTimingDivision(); // ticks per beat (or parts per quarter note)
+
+	NoteIndex.clear();
+	for (MIDIComposition::const_iterator i = cmp.begin(); i != cmp.end(); ++i) {
+		vector<TNoteIndexEntry> &idx = NoteIndex[i->first];
+		unsigned long long us = 0;
+		unsigned long lastT = 0;
+		unsigned long upt = 1000; // us per tick
+		long tempo = 0;
+
+		for (size_t pos = 0; pos < i->second.size(); ++pos) {
+			const MIDIEvent &e = i->second[pos];
+			us += (unsigned long long)(e.getTime() - lastT) * upt;
+			lastT = e.getTime();
+			if (e.isMeta()) {
+				if ((e.getMetaEventCode() == MIDI_SET_TEMPO) && (e.getMetaMessage().length() >= 3) && (td > 0)) {
+					string m = e.getMetaMessage();
+					tempo = ((((unsigned char)m[0] << 8) + (unsigned char)m[1]) << 8) + (unsigned char)m[2];
+					upt = tempo / td;
+				}
+			} else if (e.getMessageType() == MIDI_NOTE_ON) {
+				TNoteIndexEntry ie = { us, pos, tempo };
+				idx.push_back(ie);
+			}
+		}
+	}
+}
+
+static bool NoteIndexBefore(const TNoteIndexEntry &ie, unsigned long long us) {
+	return ie.us < us;
+}
+
+//
+// Find the ordinal (1-based) of the first note of the track at or after the given time
+//
+int SeekMIDIFile(unsigned int trackN, unsigned long long us) {
+	if (NoteIndex.empty()) {
+		return 1;
+	}
+	if (trackN >= NoteIndex.size()) {
+		trackN = NoteIndex.size() - 1;
+	}
+	const vector<TNoteIndexEntry> &idx = NoteIndex[trackN];
+	return (int)(lower_bound(idx.begin(), idx.end(), us, NoteIndexBefore) - idx.begin()) + 1;
+}
+
 int PrepareMIDIFile(const char *filename) {
 
     Fr = new MIDIFileReader(filename);
@@ -44,6 +112,414 @@ int PrepareMIDIFile(const char *filename) {
     		printf("SMPTE timing: %d fps, %d subframes\n", frames, subframes);
         }
 	}
+	IndexMIDIFile();
+	return 1;
+}
+
+
+//
+// Parse voice reduction policy: high, last or chan:<ch>[,<ch>...]
+//
+int ParseVoicePolicy(const char *spec, TVoicePolicy *policy, std::vector<int> &chanOrder) {
+	chanOrder.clear();
+	if (strcmp(spec, "high") == 0) {
+		*policy = VOICE_HIGHEST;
+	} else if (strcmp(spec, "last") == 0) {
+		*policy = VOICE_LATEST;
+	} else if (strncmp(spec, "chan:", 5) == 0) {
+		*policy = VOICE_CHANNEL;
+		for (const char *p = spec + 5; *p; ) {
+			int ch;
+			if (sscanf(p, "%d", &ch) != 1) {
+				fprintf(stderr, "Invalid channel list '%s' given\n", spec + 5);
+				return -1;
+			}
+			chanOrder.push_back(ch);
+			if ((p = strchr(p, ',')) == NULL) {
+				break;
+			}
+			++p;
+		}
+	} else {
+		fprintf(stderr, "Invalid voice policy '%s' given (high, last or chan:<ch>[,<ch>...] expected)\n", spec);
+		return -1;
+	}
+	return 1;
+}
+
+//
+// helpers for merged playback
+//
+namespace {
+
+// position in a track while merging
+struct TCursor {
+	unsigned long time;
+	unsigned int track;
+	size_t pos;
+};
+
+// min-heap order: earliest event first, lower track number on a tie
+struct TCursorCmp {
+	bool operator()(const TCursor &a, const TCursor &b) const {
+		return (a.time != b.time) ? (a.time > b.time) : (a.track > b.track);
+	}
+};
+
+// tempo change at an absolute tick
+struct TTempoPoint {
+	unsigned long tick;
+	unsigned long long us;     // absolute time of the change
+	unsigned long tempo;       // microseconds per beat from here on
+};
+
+// note of any track, before voice reduction
+struct TRawNote {
+	unsigned long long start;
+	unsigned long long end;
+	unsigned char pitch;
+	unsigned char velocity;
+	unsigned char channel;
+	unsigned char track;
+};
+
+// ordering of sounding notes for the voice reduction: the best candidate comes first
+struct TVoiceCmp {
+	TVoicePolicy policy;
+	const std::vector<TRawNote> *notes;
+	const int *chanRank;
+
+	bool operator()(size_t a, size_t b) const {
+		const TRawNote &na = (*notes)[a];
+		const TRawNote &nb = (*notes)[b];
+		switch (policy) {
+		case VOICE_CHANNEL:
+			if (chanRank[na.channel] != chanRank[nb.channel]) return chanRank[na.channel] < chanRank[nb.channel];
+			// fall through to the skyline within the same priority
+		case VOICE_HIGHEST:
+			if (na.pitch != nb.pitch) return na.pitch > nb.pitch;
+			break;
+		case VOICE_LATEST:
+			break;
+		}
+		if (na.start != nb.start) return na.start > nb.start;
+		return a > b;
+	}
+};
+
+static bool NoteStartsBefore(const TNote &a, const TNote &b) {
+	return a.start < b.start;
+}
+
+//
+// Add the chord sounding over [start, end): a single note as it is, several
+// ones cycled every 'step' microseconds, highest first, so the duty cycle of
+// the first step fits the periods of all the other ones (nothing for a rest)
+//
+static void AddArpeggio(const std::vector<TRawNote> &raw, const std::vector<size_t> &chord, unsigned long long start,
+		unsigned long long end, unsigned long step, std::vector<TNote> &notes) {
+	std::vector<size_t> cycle;
+	size_t k;
+
+	if (chord.empty()) {
+		return;
+	}
+	for (k = 0; k < chord.size(); ++k) {
+		size_t j = 0;
+		while ((j < cycle.size()) && (raw[cycle[j]].pitch > raw[chord[k]].pitch)) {
+			++j;
+		}
+		if ((j == cycle.size()) || (raw[cycle[j]].pitch != raw[chord[k]].pitch)) {
+			cycle.insert(cycle.begin() + j, chord[k]);
+		}
+	}
+	if (cycle.size() == 1) {
+		step = end - start;
+	}
+	for (k = 0; start < end; ++k, start += step) {
+		const TRawNote &r = raw[cycle[k % cycle.size()]];
+		TNote n;
+		n.start = start;
+		n.duration = min((unsigned long long)step, end - start);
+		n.pitch = r.pitch;
+		n.velocity = raw[cycle[0]].velocity;
+		n.channel = r.channel;
+		n.track = r.track;
+		n.voice = 0;
+		n.arpeggio = (k > 0);
+		notes.push_back(n);
+	}
+}
+
+bool TempoPointBefore(unsigned long tick, const TTempoPoint &tp) {
+	return tick < tp.tick;
+}
+
+// absolute time of a tick (the tempo map always starts at tick 0)
+unsigned long long TickToUs(const std::vector<TTempoPoint> &tempoMap, unsigned long tick, int td) {
+	const TTempoPoint &tp = *(std::upper_bound(tempoMap.begin(), tempoMap.end(), tick, TempoPointBefore) - 1);
+	return tp.us + ((unsigned long long)(tick - tp.tick) * tp.tempo) / td;
+}
+
+} // namespace
+
+//
+// Merge all tracks by absolute time (k-way merge over per-track cursors) into notes with
+// their start and end times resolved through the tempo map. Returns number of tracks.
+//
+static int CollectMIDINotes(MIDIFileReader &fr, std::vector<TRawNote> &raw, unsigned long long &length, bool percussion) {
+    MIDIComposition &cmp = fr.getComposition();
+    int td = fr.getTimingDivision(); // ticks per beat (or parts per quarter note)
+    std::vector<const MIDITrack*> tracks;
+    std::priority_queue<TCursor, std::vector<TCursor>, TCursorCmp> heap;
+    std::vector<TTempoPoint> tempoMap;
+    std::vector<unsigned long> endTicks;
+    unsigned long lastTick = 0;
+
+	raw.clear();
+	length = 0;
+	if (td <= 0) {
+		fprintf(stderr, "MIDI file error: unsupported timing division %d\n", td);
+		return -1;
+	}
+
+	for (MIDIComposition::const_iterator i = cmp.begin(); i != cmp.end(); ++i) {
+		TCursor c = { 0, (unsigned int)tracks.size(), 0 };
+		tracks.push_back(&i->second);
+		if (!i->second.empty()) {
+			c.time = i->second[0].getTime();
+			heap.push(c);
+		}
+	}
+
+	TTempoPoint tp0 = { 0, 0, 500000 }; // default microseconds per beat
+	tempoMap.push_back(tp0);
+
+	while (!heap.empty()) {
+		TCursor c = heap.top();
+		heap.pop();
+		const MIDIEvent &e = (*tracks[c.track])[c.pos];
+		unsigned long t = e.getTime();
+
+		if (t > lastTick) {
+			lastTick = t;
+		}
+		if (e.isMeta()) {
+			if ((e.getMetaEventCode() == MIDI_SET_TEMPO) && (e.getMetaMessage().length() >= 3)) {
+				std::string m = e.getMetaMessage();
+				TTempoPoint tp;
+				tp.tick = t;
+				tp.us = TickToUs(tempoMap, t, td);
+				tp.tempo = ((((unsigned char)m[0] << 8) + (unsigned char)m[1]) << 8) + (unsigned char)m[2];
+				if (tempoMap.back().tick == t) {
+					tempoMap.back() = tp;
+				} else {
+					tempoMap.push_back(tp);
+				}
+			}
+		} else if ((e.getMessageType() == MIDI_NOTE_ON) && (e.getVelocity() > 0) &&
+				(percussion || (e.getChannelNumber() != MIDI_PERCUSSION_CHANNEL)) && (e.getDuration() > 0)) {
+			TRawNote n;
+			n.start = TickToUs(tempoMap, t, td);
+			n.end = 0;
+			n.pitch = e.getPitch();
+			n.velocity = e.getVelocity();
+			n.channel = e.getChannelNumber();
+			n.track = c.track;
+			raw.push_back(n);
+			endTicks.push_back(t + e.getDuration());
+		}
+
+		if (++c.pos < tracks[c.track]->size()) {
+			c.time = (*tracks[c.track])[c.pos].getTime();
+			heap.push(c);
+		}
+	}
+
+	// note ends may lie beyond later tempo changes, so they are resolved once the tempo map is complete
+	for (size_t i = 0; i < raw.size(); ++i) {
+		raw[i].end = TickToUs(tempoMap, endTicks[i], td);
+	}
+	length = TickToUs(tempoMap, lastTick, td);
+	return (int)tracks.size();
+}
+
+//
+// Merge all tracks and reduce the overlapping notes to 'voices' voices with a sweep
+// over note on/off points: the best notes by the policy sound, a note pushed out of
+// them by a better one is cut (its voice is stolen). All of the work is done here,
+// at load time, so playback is a plain walk over the timeline.
+//
+static int MergeMIDITracks(MIDIFileReader &fr, TTimeline &tl, TVoicePolicy policy, const std::vector<int> &chanOrder, int voices,
+		unsigned long arpStep) {
+    std::vector<TRawNote> raw;
+    unsigned long long length;
+    int tracks;
+
+	tl.notes.clear();
+	tl.length = 0;
+	if ((tracks = CollectMIDINotes(fr, raw, length, false)) < 0) {
+		return -1;
+	}
+	tl.length = length;
+
+	// sweep line: note off points go before note on points at the same time
+	std::vector<std::pair<unsigned long long, long> > points;
+	points.reserve(raw.size() * 2);
+	for (size_t i = 0; i < raw.size(); ++i) {
+		points.push_back(std::make_pair(raw[i].start, (long)i + 1));
+		points.push_back(std::make_pair(raw[i].end, -((long)i + 1)));
+	}
+	std::sort(points.begin(), points.end());
+
+	int chanRank[16];
+	for (int ch = 0; ch < 16; ++ch) {
+		chanRank[ch] = 16;
+	}
+	for (size_t k = 0; k < chanOrder.size(); ++k) {
+		if ((chanOrder[k] >= 0) && (chanOrder[k] < 16) && (chanRank[chanOrder[k]] == 16)) {
+			chanRank[chanOrder[k]] = (int)k;
+		}
+	}
+	TVoiceCmp vc = { policy, &raw, chanRank };
+	std::set<size_t, TVoiceCmp> active(vc);
+	long cur[PWM_MAX_VOICES];
+	unsigned long long curStart[PWM_MAX_VOICES];
+	long best[PWM_MAX_VOICES];
+	int v, bestN;
+	std::vector<size_t> chord, sounding;
+	unsigned long long chordStart = 0;
+
+	if (voices > PWM_MAX_VOICES) {
+		voices = PWM_MAX_VOICES;
+	}
+	for (v = 0; v < voices; ++v) {
+		cur[v] = -1;
+		curStart[v] = 0;
+	}
+	for (size_t k = 0; k < points.size(); ) {
+		unsigned long long t = points[k].first;
+		for (; (k < points.size()) && (points[k].first == t); ++k) {
+			if (points[k].second > 0) {
+				active.insert(points[k].second - 1);
+			} else {
+				active.erase(-points[k].second - 1);
+			}
+		}
+		if (arpStep > 0) {
+			// the best notes are played together as an arpeggio on a single voice
+			chord.clear();
+			for (std::set<size_t, TVoiceCmp>::const_iterator a = active.begin(); (a != active.end()) && (chord.size() < ARP_MAX_NOTES); ++a) {
+				chord.push_back(*a);
+			}
+			if (chord != sounding) {
+				AddArpeggio(raw, sounding, chordStart, t, arpStep, tl.notes);
+				sounding.swap(chord);
+				chordStart = t;
+			}
+			continue;
+		}
+		bestN = 0;
+		for (std::set<size_t, TVoiceCmp>::const_iterator a = active.begin(); (a != active.end()) && (bestN < voices); ++a) {
+			best[bestN++] = (long)*a;
+		}
+		// voices whose note is over or pushed out are freed...
+		for (v = 0; v < voices; ++v) {
+			if ((cur[v] < 0) || (std::find(best, best + bestN, cur[v]) != best + bestN)) {
+				continue;
+			}
+			if (t > curStart[v]) {
+				TNote n;
+				n.start = curStart[v];
+				n.duration = t - curStart[v];
+				n.pitch = raw[cur[v]].pitch;
+				n.velocity = raw[cur[v]].velocity;
+				n.channel = raw[cur[v]].channel;
+				n.track = raw[cur[v]].track;
+				n.voice = v;
+				n.arpeggio = 0;
+				tl.notes.push_back(n);
+			}
+			cur[v] = -1;
+		}
+		// ...and the newly sounding notes take the lowest free ones
+		for (int b = 0; b < bestN; ++b) {
+			if (std::find(cur, cur + voices, best[b]) != cur + voices) {
+				continue;
+			}
+			for (v = 0; cur[v] >= 0; ++v) {
+			}
+			cur[v] = best[b];
+			curStart[v] = t;
+		}
+	}
+	if (voices > 1) {
+		std::stable_sort(tl.notes.begin(), tl.notes.end(), NoteStartsBefore);
+	}
+
+	if (Debug) {
+		printf("Merged %d tracks: %d notes reduced to %d on %d voice(s), length %lu ms\n", tracks, (int)raw.size(),
+			(int)tl.notes.size(), voices, tl.length / 1000);
+	}
+	return 1;
+}
+
+int PrepareMIDITimeline(TTimeline &tl, TVoicePolicy policy, const std::vector<int> &chanOrder) {
+	return MergeMIDITracks(*Fr, tl, policy, chanOrder, 1, 0);
+}
+
+int PrepareMIDIVoices(TTimeline &tl, TVoicePolicy policy, const std::vector<int> &chanOrder, int voices) {
+	return MergeMIDITracks(*Fr, tl, policy, chanOrder, voices, 0);
+}
+
+int PrepareMIDIArpeggio(TTimeline &tl, TVoicePolicy policy, const std::vector<int> &chanOrder, int arpHz) {
+	return MergeMIDITracks(*Fr, tl, policy, chanOrder, 1, 1000000 / arpHz);
+}
+
+//
+// Read MIDI file and reduce it to a timeline without touching the shared reader
+//
+int CompileMIDIFile(const char *filename, TTimeline &tl, TVoicePolicy policy, const std::vector<int> &chanOrder) {
+    MIDIFileReader fr(filename);
+
+    if (!fr.isOK()) {
+    	fprintf(stderr, "MIDI file %s error: %s\n", filename, fr.getError().c_str());
+		return -1;
+    }
+	return MergeMIDITracks(fr, tl, policy, chanOrder, 1, 0);
+}
+
+//
+// Read all notes of a MIDI file (percussion included, no voice reduction)
+//
+int ReadMIDINotes(const char *filename, TMIDINotes &mn) {
+    MIDIFileReader fr(filename);
+    std::vector<TRawNote> raw;
+    unsigned long long length;
+
+	mn.notes.clear();
+    if (!fr.isOK()) {
+    	fprintf(stderr, "MIDI file %s error: %s\n", filename, fr.getError().c_str());
+		return -1;
+    }
+	mn.format = fr.getFormat();
+	if ((mn.tracks = CollectMIDINotes(fr, raw, length, true)) < 0) {
+		return -1;
+	}
+	mn.length = length;
+	mn.notes.reserve(raw.size());
+	for (size_t i = 0; i < raw.size(); ++i) {
+		TNote n;
+		n.start = raw[i].start;
+		n.duration = raw[i].end - raw[i].start;
+		n.pitch = raw[i].pitch;
+		n.velocity = raw[i].velocity;
+		n.channel = raw[i].channel;
+		n.track = raw[i].track;
+		n.voice = 0;
+		n.arpeggio = 0;
+		mn.notes.push_back(n);
+	}
 	return 1;
 }
 
@@ -66,6 +542,7 @@ int PlayMIDIFile(unsigned int trackN, int startNote, int endNote) {
     long tempo = 500000; // default microseconds per beat (beat is a quarter note)
     int td = Fr->getTimingDivision(); // ticks per beat (or parts per quarter note)
     int noteN;
+    MIDITrack::const_iterator j;
 
 	if ((startNote != -1) && (endNote == -1)) {
 		endNote = INT_MAX;
@@ -79,7 +556,25 @@ int PlayMIDIFile(unsigned int trackN, int startNote, int endNote) {
 			printf("Playing track %d\n", trackN);
 		}
 	}
-	for (MIDITrack::const_iterator j = cmp[trackN].begin(); j != cmp[trackN].end(); ++j) {
+	j = cmp[trackN].begin();
+	// jump straight to the first requested note, restoring the tempo from the index snapshot
+	if (startNote > 1) {
+		const vector<TNoteIndexEntry> &idx = NoteIndex[trackN];
+		if ((size_t)startNote > idx.size()) {
+			return 1;
+		}
+		const TNoteIndexEntry &ie = idx[startNote - 1];
+		j += ie.pos;
+		noteN = startNote;
+		if (ie.tempo != 0) {
+			tempo = ie.tempo;
+			upt = microseconds(tempo/td);
+		}
+		if (Debug) {
+			printf("Starting at note %d (event %lu, %llu ms), tempo %ld\n", noteN, (unsigned long)ie.pos, ie.us / 1000, tempo);
+		}
+	}
+	for (; (j != cmp[trackN].end()) && (noteN <= endNote); ++j) {
 
 		unsigned int t = j->getTime();
 		int ch = j->getChannelNumber();
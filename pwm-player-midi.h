@@ -5,9 +5,45 @@
  * see https://www.gnu.org/licenses/ for license terms
  * based on sources from https://code.soundsoftware.ac.uk/projects/midifile/repository
  */
+#include "pwm-player-timeline.h"
+
+/*
+ * voice reduction policies for merged (all tracks) playback
+ */
+typedef enum {
+	VOICE_HIGHEST,      // highest sounding note wins (skyline)
+	VOICE_LATEST,       // most recently started note wins
+	VOICE_CHANNEL       // channel priority list, then highest note
+} TVoicePolicy;
+
+/*
+ * the arpeggiator plays the best notes sounding together (by the voice policy)
+ * in turn on a single voice, switching at the given rate
+ */
+#define ARP_MAX_NOTES       4
+#define ARP_MIN_RATE        10          // Hz
+#define ARP_MAX_RATE        200
+
+/*
+ * all notes of a MIDI file, without voice reduction (for the catalog)
+ */
+typedef struct {
+	int format;                 // SMF format 0, 1 or 2
+	int tracks;
+	unsigned long length;       // microseconds, through the tempo map
+	std::vector<TNote> notes;   // by start time, may overlap
+} TMIDINotes;
+
 /*
  * MIDI handling functions
  */
+int ParseVoicePolicy(const char *spec, TVoicePolicy *policy, std::vector<int> &chanOrder);
 int PrepareMIDIFile(const char *filename);
+int PrepareMIDITimeline(TTimeline &tl, TVoicePolicy policy, const std::vector<int> &chanOrder);
+int PrepareMIDIVoices(TTimeline &tl, TVoicePolicy policy, const std::vector<int> &chanOrder, int voices);
+int PrepareMIDIArpeggio(TTimeline &tl, TVoicePolicy policy, const std::vector<int> &chanOrder, int arpHz);
+int CompileMIDIFile(const char *filename, TTimeline &tl, TVoicePolicy policy, const std::vector<int> &chanOrder);
+int ReadMIDINotes(const char *filename, TMIDINotes &mn);
+int SeekMIDIFile(unsigned int trackN, unsigned long long us);
 int PlayMIDIFile(unsigned int trackN, int startNode, int endNote);
 int CleanupMIDIFile();
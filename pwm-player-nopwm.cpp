@@ -0,0 +1,32 @@
+/*
+ * PWM output stubs of the benchmark and the checks (make bench, make check)
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include "pwm-player.h"
+#include "pwm-player-pwm.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+//
+// no hardware here: the front-ends are only asked to compile
+//
+bool Debug = false;
+TPoint PlaybackNow() { return TClock::now(); }
+TPoint RealTime(TPoint tp) { return tp; }
+int SignalF = -1;
+int NextSignal() { return 0; }
+void Play(int pitch, int velocity, int duration_us) { }
+void Sound(int pitch, int velocity) { }
+void SoundPeriod(int pitch) { }
+void WaitUntil(TPoint tp) { }
+int WaitReadable(int fd, const TPoint *tp) { return 1; }
+void Mute() { }
+void SoundVoice(int voice, int pitch, int velocity) { }
+void MuteVoice(int voice) { }
+__thread TPWMDevice *PWM = NULL;
+void InitPWMDevice(TPWMDevice *dev) { }
+int OpenPWMDevice(TPWMDevice *dev, const char *pwmDevStr) { return -1; }
+void ClosePWMDevice(TPWMDevice *dev) { }
@@ -0,0 +1,202 @@
+/*
+ * Melody packs: many compiled timelines in a single file
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <errno.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <algorithm>
+
+#include "pwm-player.h"
+#include "pwm-player-pack.h"
+#include "pwm-player-compiled.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+#define PACK_ALIGN(n)       (((n) + 3) & ~(size_t)3)
+
+//
+// Melody name is the file name without directory and extension
+//
+static string MelodyName(const string &path) {
+	size_t s = path.rfind('/');
+	string name = (s == string::npos) ? path : path.substr(s + 1);
+	size_t e = name.rfind('.');
+	return ((e == string::npos) || (e == 0)) ? name : name.substr(0, e);
+}
+
+//
+// Compile all melody files into a pack (using all CPU cores), replacing it atomically
+//
+int BuildPack(const char *pack, const vector<string> &sources, const char *voiceSpec) {
+	vector<string> files;
+	vector<TTimeline> timelines;
+	vector<size_t> order;
+	std::atomic<int> failed(0);
+
+	for (size_t i = 0; i < sources.size(); ++i) {
+		if (ListMelodyFiles(sources[i].c_str(), files) < 0) {
+			return -1;
+		}
+	}
+	timelines.resize(files.size());
+	vector<char> ok(files.size(), 0);
+	RunParallel(files.size(), [&](size_t i) {
+		if (CompileSource(files[i].c_str(), voiceSpec, timelines[i]) < 0) {
+			fprintf(stderr, "Unable to compile %s\n", files[i].c_str());
+			++failed;
+		} else {
+			ok[i] = 1;
+		}
+	});
+
+	vector<string> names(files.size());
+	for (size_t i = 0; i < files.size(); ++i) {
+		names[i] = MelodyName(files[i]);
+		if (ok[i]) {
+			order.push_back(i);
+		}
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return names[a] < names[b]; });
+	for (size_t k = 1; k < order.size(); ) {
+		if (names[order[k]] == names[order[k - 1]]) {
+			fprintf(stderr, "Duplicate melody name '%s' (%s), skipped\n", names[order[k]].c_str(), files[order[k]].c_str());
+			++failed;
+			order.erase(order.begin() + k);
+		} else {
+			++k;
+		}
+	}
+
+	// layout: header, index, names, then the timelines
+	size_t namesSize = 0;
+	for (size_t k = 0; k < order.size(); ++k) {
+		namesSize += names[order[k]].size() + 1;
+	}
+	size_t pos = PACK_ALIGN(sizeof(TPackHeader) + order.size() * sizeof(TPackEntry) + namesSize);
+	size_t total = pos;
+	for (size_t k = 0; k < order.size(); ++k) {
+		total += PACK_ALIGN(CompiledSize(timelines[order[k]]));
+	}
+	if (total > 0xFFFFFFFFUL) {
+		fprintf(stderr, "Pack %s would be too large (%llu bytes)\n", pack, (unsigned long long)total);
+		return -1;
+	}
+
+	vector<char> data(total, 0);
+	TPackHeader *hdr = (TPackHeader*)&data[0];
+	TPackEntry *index = (TPackEntry*)(hdr + 1);
+	char *nameArea = (char*)(index + order.size());
+	size_t nameOffset = 0;
+
+	memcpy(hdr->magic, PACK_MAGIC, sizeof(hdr->magic));
+	hdr->version = PACK_VERSION;
+	hdr->count = order.size();
+	hdr->namesSize = namesSize;
+	for (size_t k = 0; k < order.size(); ++k) {
+		const TTimeline &tl = timelines[order[k]];
+		const string &name = names[order[k]];
+		index[k].name = nameOffset;
+		index[k].offset = pos;
+		index[k].size = CompiledSize(tl);
+		memcpy(nameArea + nameOffset, name.c_str(), name.size() + 1);
+		nameOffset += name.size() + 1;
+		EncodeCompiled(tl, &data[pos]);
+		pos += PACK_ALIGN(index[k].size);
+	}
+
+	if (WriteFileAtomic(pack, &data[0], data.size()) < 0) {
+		fprintf(stderr, "Error writing %s(%d): %s\n", pack, errno, strerror(errno));
+		return -1;
+	}
+	printf("Packed %d of %d melodies into %s, %d bytes\n", (int)order.size(), (int)files.size(), pack, (int)data.size());
+	return failed ? -1 : 1;
+}
+
+//
+// Map the pack and check its header and index fit into the file
+//
+static const TPackHeader *OpenPack(const char *pack, size_t *size) {
+	const TPackHeader *hdr;
+
+	if ((hdr = (const TPackHeader*)MapFile(pack, size)) == NULL) {
+		fprintf(stderr, "Error opening pack %s(%d): %s\n", pack, errno, strerror(errno));
+		return NULL;
+	}
+	if ((*size < sizeof(TPackHeader)) || (memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic)) != 0) ||
+			(hdr->version != PACK_VERSION) ||
+			((*size - sizeof(TPackHeader)) / sizeof(TPackEntry) < hdr->count) ||
+			(*size - sizeof(TPackHeader) - hdr->count * sizeof(TPackEntry) < hdr->namesSize)) {
+		fprintf(stderr, "%s is not a melody pack\n", pack);
+		munmap((void*)hdr, *size);
+		return NULL;
+	}
+	return hdr;
+}
+
+static const char *EntryName(const TPackHeader *hdr, const TPackEntry &e) {
+	const char *names = (const char*)((const TPackEntry*)(hdr + 1) + hdr->count);
+	return (e.name < hdr->namesSize) && memchr(names + e.name, 0, hdr->namesSize - e.name) ? names + e.name : "";
+}
+
+//
+// Load melody given as <pack>:<name> with a binary search over the pack index
+//
+int LoadPackMelody(const char *spec, TTimeline &tl) {
+	const char *colon = strrchr(spec, ':');
+	const TPackHeader *hdr;
+	size_t size;
+	int rc = -1;
+
+	if ((colon == NULL) || (colon[1] == 0)) {
+		fprintf(stderr, "Melody '%s' should be given as <pack>:<name>\n", spec);
+		return -1;
+	}
+	string pack(spec, colon - spec);
+	const char *name = colon + 1;
+	if ((hdr = OpenPack(pack.c_str(), &size)) == NULL) {
+		return -1;
+	}
+	const TPackEntry *first = (const TPackEntry*)(hdr + 1), *last = first + hdr->count;
+	const TPackEntry *e = std::lower_bound(first, last, name, [&](const TPackEntry &pe, const char *n) {
+		return strcmp(EntryName(hdr, pe), n) < 0;
+	});
+	if ((e == last) || (strcmp(EntryName(hdr, *e), name) != 0)) {
+		fprintf(stderr, "No melody '%s' in pack %s\n", name, pack.c_str());
+	} else if ((e->offset > size) || (size - e->offset < e->size) ||
+			(DecodeCompiled((const char*)hdr + e->offset, e->size, tl) < 0)) {
+		fprintf(stderr, "Melody '%s' of pack %s is damaged\n", name, pack.c_str());
+	} else {
+		if (Debug) {
+			printf("Loaded %s:%s, %d notes, length %lu ms\n", pack.c_str(), name, (int)tl.notes.size(), tl.length / 1000);
+		}
+		rc = 1;
+	}
+	munmap((void*)hdr, size);
+	return rc;
+}
+
+//
+// Show all melodies of the pack
+//
+int ListPackMelodies(const char *pack) {
+	const TPackHeader *hdr;
+	size_t size;
+
+	if ((hdr = OpenPack(pack, &size)) == NULL) {
+		return -1;
+	}
+	const TPackEntry *index = (const TPackEntry*)(hdr + 1);
+	for (uint32_t i = 0; i < hdr->count; ++i) {
+		const TCompiledHeader *ch = (const TCompiledHeader*)((const char*)hdr + index[i].offset);
+		if ((index[i].offset > size) || (size - index[i].offset < sizeof(TCompiledHeader))) {
+			continue;
+		}
+		printf("%-12s %3d notes, %lu ms\n", EntryName(hdr, index[i]), (int)ch->count, (unsigned long)ch->length / 1000);
+	}
+	munmap((void*)hdr, size);
+	return 1;
+}
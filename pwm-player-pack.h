@@ -0,0 +1,47 @@
+/*
+ * Melody packs: many compiled timelines in a single file
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_PACK_H_
+#define _PWM_PLAYER_PACK_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "pwm-player-timeline.h"
+
+#define PACK_MAGIC          "PWMP"
+#define PACK_VERSION        1
+
+/*
+ * melody pack layout (host byte order):
+ *   TPackHeader
+ *   TPackEntry index[count]    - sorted by name (strcmp order)
+ *   char names[namesSize]      - zero terminated melody names
+ *   compiled timelines         - see TCompiledHeader, 4-byte aligned, back to back
+ * so a melody is found with a binary search over the index and decoded in place
+ */
+typedef struct {
+	char     magic[4];          // PACK_MAGIC
+	uint32_t version;           // PACK_VERSION
+	uint32_t count;             // number of melodies
+	uint32_t namesSize;         // size of the names area, bytes
+} TPackHeader;
+
+typedef struct {
+	uint32_t name;              // offset of the name in the names area
+	uint32_t offset;            // offset of the compiled timeline from the start of the pack
+	uint32_t size;              // size of the compiled timeline
+} TPackEntry;
+
+/*
+ * melody pack handling functions
+ */
+int BuildPack(const char *pack, const std::vector<std::string> &sources, const char *voiceSpec);
+int LoadPackMelody(const char *spec, TTimeline &tl);
+int ListPackMelodies(const char *pack);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * Playlists: several melodies played back to back
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <errno.h>
+#include <atomic>
+
+#include "pwm-player.h"
+#include "pwm-player-playlist.h"
+#include "pwm-player-compiled.h"
+#include "pwm-player-melody.h"
+#include "pwm-player-rtttl.h"
+#include "pwm-player-builtin.h"
+#include "pwm-player-pack.h"
+#include "pwm-player-status.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+#define LATE_START_US       1000        // next melody that is not ready by then starts when it is
+
+//
+// Compile melody given by its source type and argument into a timeline
+//
+int CompileMelodySource(char type, const char *arg, const char *voiceSpec, TTimeline &tl) {
+	int rc = -1;
+
+	switch (type) {
+	case 'm':
+	case 'i':
+	case 'e':
+	case 'f':
+		rc = CompileSource(arg, voiceSpec, tl);
+		break;
+	case 'r':
+		rc = CompileRTTTLFile(arg, tl);
+		break;
+	case 'R':
+		rc = CompileRTTTLString(arg, tl);
+		break;
+	case 'I':
+	case 'E': {
+		TMelody *m = NewMelody();
+		if ((rc = PrepareMelodyString(m, arg, type)) > 0) {
+			rc = CompileMelody(m, tl);
+		}
+		DeleteMelody(m);
+		break;
+	}
+	case 'N':
+		rc = GetBuiltinMelody(arg, tl);
+		break;
+	case 'P':
+		rc = LoadPackMelody(arg, tl);
+		break;
+	default:
+		fprintf(stderr, "Unknown melody source -%c\n", type);
+		break;
+	}
+	return rc;
+}
+
+//
+// Compile playlist item, going through the compiled timelines cache for files
+//
+static int LoadItem(const TPlaylistItem &item, const char *voiceSpec, bool useCache, TTimeline &tl) {
+	string cacheName;
+
+	if (useCache && (strchr("mief", item.type) != NULL)) {
+		cacheName = CacheFileName(item.arg.c_str(), voiceSpec);
+		if (!cacheName.empty() && (LoadCompiled(cacheName.c_str(), tl) > 0)) {
+			return 1;
+		}
+	}
+	if (CompileMelodySource(item.type, item.arg.c_str(), voiceSpec, tl) < 0) {
+		return -1;
+	}
+	if (!cacheName.empty()) {
+		SaveCompiled(cacheName.c_str(), tl);
+	}
+	return 1;
+}
+
+static string Trim(const string &s) {
+	size_t b = s.find_first_not_of(" \t\r\n");
+	size_t e = s.find_last_not_of(" \t\r\n");
+	return (b == string::npos) ? "" : s.substr(b, e - b + 1);
+}
+
+//
+// Append melodies of the playlist file to the items
+//
+int ReadPlaylist(const char *filename, vector<TPlaylistItem> &items) {
+	ifstream f(filename);
+	string line, dir;
+	const char *p = strrchr(filename, '/');
+
+	if (!f) {
+		fprintf(stderr, "Error opening playlist %s(%d): %s\n", filename, errno, strerror(errno));
+		return -1;
+	}
+	if (p != NULL) {
+		dir = string(filename, p - filename + 1);
+	}
+	for (int n = 1; getline(f, line); ++n) {
+		TPlaylistItem item;
+		line = Trim(line);
+		if (line.empty() || (line[0] == '#')) {
+			continue;
+		}
+		if ((line[0] == '-') && (line.size() > 3) && (line[2] == ' ')) {
+			item.type = line[1];
+			item.arg = Trim(line.substr(3));
+			if (strchr("mierIERNP", item.type) == NULL) {
+				fprintf(stderr, "Playlist %s line %d: unknown melody option %s\n", filename, n, line.substr(0, 2).c_str());
+				return -1;
+			}
+		} else {
+			item.type = 'f';
+			item.arg = line;
+		}
+		// file names are relative to the playlist
+		if ((strchr("mierPf", item.type) != NULL) && (item.arg[0] != '/')) {
+			item.arg = dir + item.arg;
+		}
+		items.push_back(item);
+	}
+	return 1;
+}
+
+//
+// Play the melodies back to back: the next one is compiled on a background thread
+// while the current one plays and starts exactly at the end of it
+//
+int PlayPlaylist(const vector<TPlaylistItem> &items, const char *voiceSpec, bool useCache,
+	const std::function<void()> &ready) {
+	TTimeline cur, next;
+	int rcCur, rcNext = -1;
+	int failed = 0;
+	std::atomic<bool> loaded(false);
+	TPoint t0;
+
+	if (items.empty()) {
+		return 1;
+	}
+	rcCur = LoadItem(items[0], voiceSpec, useCache, cur);
+	if (ready) {
+		ready();
+	}
+	t0 = NOW;
+	for (size_t i = 0; i < items.size(); ++i) {
+		thread loader;
+
+		loaded = (i + 1 >= items.size());
+		if (!loaded) {
+			loader = thread([&, i]() {
+				rcNext = LoadItem(items[i + 1], voiceSpec, useCache, next);
+				loaded = true;
+			});
+		}
+		if (rcCur < 0) {
+			fprintf(stderr, "Unable to compile %s, skipped\n", items[i].arg.c_str());
+			++failed;
+		} else {
+			// a melody that was not ready in time starts as soon as it is
+			if (NOW > t0 + microseconds(LATE_START_US)) {
+				if (Debug) {
+					printf("%s is late by %ld us\n", items[i].arg.c_str(), (long)duration_cast<microseconds>(NOW - t0).count());
+				}
+				t0 = NOW;
+			}
+			printf("Playing %s\n", items[i].arg.c_str());
+			StatusMelody(items[i].arg.c_str(), cur.length, t0);
+			PlayTimelineAt(cur, t0, true);
+			t0 += microseconds(cur.length);
+			// the last note is not held past the end for a melody still compiling
+			if (!loaded) {
+				WaitUntil(t0);
+				if (!loaded) {
+					Mute();
+				}
+			}
+		}
+		if (loader.joinable()) {
+			loader.join();
+		}
+		// the last note is carried over only into a melody starting with a note
+		if ((i + 1 == items.size()) || (rcNext < 0) || next.notes.empty() || (next.notes[0].start != 0)) {
+			WaitUntil(t0);
+			Mute();
+		}
+		swap(cur, next);
+		rcCur = rcNext;
+	}
+	StatusState(STATE_IDLE);
+	return failed ? -1 : 1;
+}
@@ -0,0 +1,45 @@
+/*
+ * Playlists: several melodies played back to back
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_PLAYLIST_H_
+#define _PWM_PLAYER_PLAYLIST_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "pwm-player-timeline.h"
+
+/*
+ * melody source, named by the player option that gives it:
+ *   m, i, e, r     MIDI, iMelody, eMelody, RTTTL file
+ *   f              any melody file (the format is detected)
+ *   I, E, R        iMelody, eMelody, RTTTL text
+ *   N              built-in melody
+ *   P              <pack>:<name>
+ */
+typedef struct {
+	char type;
+	std::string arg;
+} TPlaylistItem;
+
+/*
+ * Playlist file has one melody per line: a file name (relative to the playlist
+ * directory) or a player option with its argument ("-N beep", "-I c3d3e3").
+ * Empty lines and lines starting with '#' are skipped.
+ * PlayPlaylist calls ready (if given) once the first melody is compiled, right
+ * before it starts, so a start time can be waited for there.
+ */
+
+/*
+ * playlist handling functions
+ */
+int CompileMelodySource(char type, const char *arg, const char *voiceSpec, TTimeline &tl);
+int ReadPlaylist(const char *filename, std::vector<TPlaylistItem> &items);
+int PlayPlaylist(const std::vector<TPlaylistItem> &items, const char *voiceSpec, bool useCache,
+	const std::function<void()> &ready);
+
+#endif
@@ -0,0 +1,508 @@
+/*
+ * PWM output and the playback clock
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+
+#include "pwm-player.h"
+#include "pwm-player-pwm.h"
+#include "pwm-player-status.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+#define PWM_CHIP_PATH "/sys/class/pwm/pwmchip"
+#define PWM_EXPORT "/export"
+
+#define PWM_ENABLE "/enable"
+#define PWM_PERIOD "/period"
+#define PWM_DUTYCYCLE "/duty_cycle"
+
+//
+// global shared data
+//
+bool Debug = false;
+int SignalF = -1;               // signalfd of the stop/pause/resume signals
+
+static TPWMDevice DefaultDevice = { -1, -1, -1, 100, -1, 0, -1, 0, false, 0, NULL };
+__thread TPWMDevice *PWM = &DefaultDevice;
+
+// playback clock: both clocks at the last tempo change (the start of the
+// program at first, so that only the time since then is scaled) and the
+// tempo, percent
+static TPoint ClockReal = TClock::now(), ClockPlay = ClockReal;
+static int ClockTempo = 100;
+
+void InitPWMDevice(TPWMDevice *dev) {
+	dev->enableF = dev->periodF = dev->dutyCycleF = -1;
+	dev->volume = 100;
+	dev->wakeF = -1;
+	dev->stopped = 0;
+	dev->lastPitch = -1;
+	dev->lastVelocity = 0;
+	dev->sounding = false;
+	dev->dutyCycle = 0;
+	dev->next = NULL;
+}
+
+//
+// (Discover and) Setup output <channel> of pwmchip<chip>
+//
+static int OpenPWMOutput(TPWMDevice *dev, int chip, int channel) {
+	int f = -1;
+	struct stat fs;
+	char trigger[FILENAME_MAX], fileName[FILENAME_MAX], channelStr[16];
+
+	snprintf(trigger, sizeof(trigger), "%s%d%s", PWM_CHIP_PATH, chip, PWM_EXPORT);
+	snprintf(fileName, sizeof(fileName), "%s%d/pwm%d%s", PWM_CHIP_PATH, chip, channel, PWM_ENABLE);
+	if (stat(fileName, &fs) != 0) {
+		if (stat(trigger, &fs) != 0) {
+			fprintf(stderr, "No PWM trigger file %s\n", trigger);
+			return -1;
+		}
+		if ((f = open(trigger, O_WRONLY)) < 0) {
+			fprintf(stderr, "Error opening PWM trigger file %s(%d): %s\n", trigger, errno, strerror(errno));
+			return -1;
+		}
+		snprintf(channelStr, sizeof(channelStr), "%d", channel);
+		if (write(f, channelStr, strlen(channelStr)) == EOF) {
+			close(f);
+			fprintf(stderr, "Error writing PWM trigger file %s(%d): %s\n", trigger, errno, strerror(errno));
+			return -1;
+		}
+		close(f);
+		if (stat(fileName, &fs) != 0) {
+			fprintf(stderr, "Error accessing PWM file %s(%d): %s\n", fileName, errno, strerror(errno));
+			return -1;
+		}
+	}
+	if ((dev->enableF = open(fileName, O_WRONLY)) < 0) {
+openerr:
+		fprintf(stderr, "Error opening PWM file %s(%d): %s\n", fileName, errno, strerror(errno));
+		return -1;
+	}
+	snprintf(fileName, sizeof(fileName), "%s%d/pwm%d%s", PWM_CHIP_PATH, chip, channel, PWM_PERIOD);
+	if ((dev->periodF = open(fileName, O_WRONLY)) < 0) {
+		goto openerr;
+	}
+	snprintf(fileName, sizeof(fileName), "%s%d/pwm%d%s", PWM_CHIP_PATH, chip, channel, PWM_DUTYCYCLE);
+	if ((dev->dutyCycleF = open(fileName, O_WRONLY)) < 0) {
+		goto openerr;
+	}
+	return 1;
+}
+
+//
+// (Discover and) Setup the PWM outputs of pwmDevStr: a comma separated list of
+// [<chip>:]<channel> (pwmchip0 if no chip is given). The first output is dev
+// itself, the others are chained to it as the voices of polyphonic playback.
+//
+int OpenPWMDevice(TPWMDevice *dev, const char *pwmDevStr) {
+	TPWMDevice *last = dev;
+	const char *p = pwmDevStr;
+
+	for (int voice = 0; ; ++voice) {
+		int chip = 0, channel, n;
+		if (sscanf(p, "%d%n", &channel, &n) != 1) {
+			goto error;
+		}
+		p += n;
+		if (*p == ':') {
+			chip = channel;
+			if (sscanf(++p, "%d%n", &channel, &n) != 1) {
+				goto error;
+			}
+			p += n;
+		}
+		if ((chip < 0) || (channel < 0) || ((*p != ',') && (*p != 0))) {
+			goto error;
+		}
+		if (voice >= PWM_MAX_VOICES) {
+			fprintf(stderr, "Too many PWM outputs in '%s' (%d at most)\n", pwmDevStr, PWM_MAX_VOICES);
+			return -1;
+		}
+		if (voice > 0) {
+			last->next = new TPWMDevice;
+			InitPWMDevice(last->next);
+			last->next->volume = dev->volume;
+			last = last->next;
+		}
+		if (OpenPWMOutput(last, chip, channel) < 0) {
+			return -1;
+		}
+		if (Debug) {
+			printf("Voice %d plays on pwmchip%d/pwm%d\n", voice, chip, channel);
+		}
+		if (*p++ == 0) {
+			return 1;
+		}
+	}
+error:
+	fprintf(stderr, "Invalid PWM output list '%s' ([<chip>:]<channel>[,...] expected)\n", pwmDevStr);
+	return -1;
+}
+
+//
+// Mute and release the device and the outputs chained to it
+//
+void ClosePWMDevice(TPWMDevice *dev) {
+	if (dev->enableF > 0) {
+		TPWMDevice *cur = PWM;
+		PWM = dev;
+		Mute();
+		PWM = cur;
+		close(dev->enableF);
+		dev->enableF = -1;
+	}
+	if (dev->periodF > 0) {
+		close(dev->periodF);
+		dev->periodF = -1;
+	}
+	if (dev->dutyCycleF > 0) {
+		close(dev->dutyCycleF);
+		dev->dutyCycleF = -1;
+	}
+	if (dev->next) {
+		ClosePWMDevice(dev->next);
+		delete dev->next;
+		dev->next = NULL;
+	}
+}
+
+//
+// Number of outputs the device plays on
+//
+int PWMVoices() {
+	int n = 0;
+
+	for (TPWMDevice *dev = PWM; dev; dev = dev->next) {
+		++n;
+	}
+	return n;
+}
+
+//
+// Sound (or mute with velocity < 0) a voice of polyphonic playback: the
+// output it is on is bound for the time of the call
+//
+static void OutputVoice(int voice, int pitch, int velocity) {
+	TPWMDevice *cur = PWM, *dev = PWM;
+
+	for (; dev && (voice > 0); --voice) {
+		dev = dev->next;
+	}
+	if ((dev == NULL) || cur->stopped) {
+		return;
+	}
+	PWM = dev;
+	if (velocity < 0) {
+		Mute();
+	} else {
+		Sound(pitch, velocity);
+	}
+	PWM = cur;
+}
+
+void SoundVoice(int voice, int pitch, int velocity) {
+	OutputVoice(voice, pitch, velocity);
+}
+
+void MuteVoice(int voice) {
+	OutputVoice(voice, 0, -1);
+}
+
+// approximate frequencies of MIDI notes (0 to 127)
+static int freqs[128] = {
+8,9,9,10,10,11,12,12,13,14,15,15,16,17,18,19,21,22,23,24,26,28,29,31,33,35,37,39,41,44,46,49,52,55,58,62,65,69,73,78,82,87,92,98,104,110,
+117,123,131,139,147,156,165,175,185,196,208,220,233,247,262,277,294,311,330,349,370,392,415,440,466,494,523,554,587,622,659,698,740,784,
+831,880,932,988,1047,1109,1175,1245,1319,1397,1480,1568,1661,1760,1865,1976,2093,2217,2349,2489,2637,2794,2960,3136,3322,3520,3729,3951,
+4186,4435,4699,4978,5274,5588,5920,6272,6645,7040,7459,7902,8372,8870,9397,9956,10548,11175,11840,12544 };
+
+//
+// Current time of the playback clock
+//
+TPoint PlaybackNow() {
+	if (ClockTempo == 100) {
+		return ClockPlay + (TClock::now() - ClockReal);
+	}
+	return ClockPlay + (TClock::now() - ClockReal) * ClockTempo / 100;
+}
+
+//
+// Steady clock time the point of the playback clock falls on
+//
+TPoint RealTime(TPoint tp) {
+	if (ClockTempo == 100) {
+		return ClockReal + (tp - ClockPlay);
+	}
+	return (ClockTempo > 0) ? ClockReal + (tp - ClockPlay) * 100 / ClockTempo : TPoint::max();
+}
+
+//
+// Change the playback clock rate from now on (0 stops it)
+//
+static void SetClockTempo(int tempo) {
+	TPoint real = TClock::now();
+
+	if (ClockTempo == 100) {
+		ClockPlay += real - ClockReal;
+	} else {
+		ClockPlay += (real - ClockReal) * ClockTempo / 100;
+	}
+	ClockReal = real;
+	ClockTempo = tempo;
+}
+
+//
+// Write the note to the device: the period, duty cycle and enable files, or
+// (periodOnly) the period alone when the duty cycle already set fits it too
+//
+static void OutputNote(int pitch, int velocity, bool periodOnly) {
+	int freq, volume;
+
+	if (PWM->stopped) {
+		return;
+	}
+	PWM->lastPitch = pitch;
+	PWM->lastVelocity = velocity;
+	PWM->sounding = true;
+
+	// live controls of the status block
+	if (Status) {
+		int tempo = Status->tempo, transpose = Status->transpose, change = Status->volume;
+		if ((tempo != ClockTempo) && (tempo >= 25) && (tempo <= 400)) {
+			SetClockTempo(tempo);
+		}
+		pitch += transpose;
+		velocity = (velocity * change) / 100;
+	}
+
+	/* freq = (int)round(440 * powf(2, (pitch - 69)/12.0));*/
+	if ((pitch >= 0) && (pitch < 128)) {
+		freq = freqs[pitch];
+	} else {
+		freq = 440;
+	}
+
+	velocity = (velocity * PWM->volume) / 100;
+   	if (velocity < 0) velocity = 0;
+   	if (velocity > 127) velocity = 127;
+
+	volume = (velocity * 100) / 127; // midi velocity is in range (0; 127]
+
+	if (Debug) printf("Playing %dHz, vol %d\n", freq, volume);
+	StatusEvent(pitch, velocity);
+
+	long period, dutyCycle;
+	char periodStr[32], dutyStr[32];
+	int pl, dl;
+	period = 1000000000 / freq;
+	dutyCycle = (period * volume) / 200;
+	pl = sprintf(periodStr, "%ld\n", period);
+	if (periodOnly && (PWM->dutyCycle <= period)) {
+		write(PWM->periodF, periodStr, pl);
+		return;
+	}
+	// the device refuses a period shorter than the duty cycle it has
+	dl = sprintf(dutyStr, "%ld\n", dutyCycle);
+	if (PWM->dutyCycle > period) {
+		write(PWM->dutyCycleF, dutyStr, dl);
+		write(PWM->periodF, periodStr, pl);
+	} else {
+		write(PWM->periodF, periodStr, pl);
+		write(PWM->dutyCycleF, dutyStr, dl);
+	}
+	PWM->dutyCycle = dutyCycle;
+	write(PWM->enableF, "1\n", 2);
+}
+
+//
+// Start playing of MIDI note 'pitch' with 'velocity' (returns immediately)
+//
+void Sound(int pitch, int velocity) {
+	OutputNote(pitch, velocity, false);
+}
+
+//
+// Change the pitch of the note sounding with a single period write: the fast
+// path of the arpeggio steps, which keep the duty cycle set by the first
+// (highest, so shortest period) note of the chord
+//
+void SoundPeriod(int pitch) {
+	OutputNote(pitch, PWM->lastVelocity, PWM->sounding);
+}
+
+static void HandleSignals();
+
+//
+// Wait until the given point of the playback clock, handling the signals that
+// come meanwhile at once; returns at once when the playback is cut short
+//
+void WaitUntil(TPoint tp) {
+	struct pollfd pfd[2];
+	int n = 0;
+
+	if (SignalF >= 0) {
+		pfd[n].fd = SignalF;
+		pfd[n++].events = POLLIN;
+	}
+	if (PWM->wakeF >= 0) {
+		pfd[n].fd = PWM->wakeF;
+		pfd[n++].events = POLLIN;
+	}
+	if (n == 0) {
+		TPoint real = RealTime(tp);
+		this_thread::sleep_until(real);
+		StatusLate(duration_cast<microseconds>(TClock::now() - real).count());
+		return;
+	}
+	while (!PWM->stopped) {
+		TPoint real = RealTime(tp);
+		long long ns = duration_cast<std::chrono::nanoseconds>(real - TClock::now()).count();
+		if (ns <= 0) {
+			StatusLate(-ns / 1000);
+			return;
+		}
+		struct timespec ts = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+		if ((ppoll(pfd, n, &ts, NULL) > 0) && (SignalF >= 0) && (pfd[0].revents & POLLIN)) {
+			HandleSignals();
+		}
+	}
+}
+
+//
+// Wait until fd gets readable (1) or the given point of the playback clock
+// comes (0, never if tp is NULL), handling the signals as WaitUntil does;
+// -1 when the playback is cut short
+//
+int WaitReadable(int fd, const TPoint *tp) {
+	struct pollfd pfd[3];
+	int n = 0;
+
+	if (SignalF >= 0) {
+		pfd[n].fd = SignalF;
+		pfd[n++].events = POLLIN;
+	}
+	if (PWM->wakeF >= 0) {
+		pfd[n].fd = PWM->wakeF;
+		pfd[n++].events = POLLIN;
+	}
+	pfd[n].fd = fd;
+	pfd[n++].events = POLLIN;
+	while (!PWM->stopped) {
+		struct timespec ts, *pts = NULL;
+		if (tp) {
+			long long ns = duration_cast<std::chrono::nanoseconds>(RealTime(*tp) - TClock::now()).count();
+			if (ns <= 0) {
+				return 0;
+			}
+			ts.tv_sec = (time_t)(ns / 1000000000);
+			ts.tv_nsec = (long)(ns % 1000000000);
+			pts = &ts;
+		}
+		if (ppoll(pfd, n, pts, NULL) > 0) {
+			if ((SignalF >= 0) && (pfd[0].revents & POLLIN)) {
+				HandleSignals();
+			}
+			if (pfd[n - 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+				return 1;
+			}
+		}
+	}
+	return -1;
+}
+
+//
+// Start playing of MIDI note 'pitch' with 'velocity' and hold on for duration_us microseconds
+//
+void Play(int pitch, int velocity, int duration_us) {
+	TPoint end = NOW + microseconds(duration_us);
+
+	if (Debug) printf("Playing note %d for %d ms\n", pitch, duration_us/1000);
+	Sound(pitch, velocity);
+	WaitUntil(end);
+}
+
+//
+// Stop PWM sound
+//
+void Mute() {
+	write(PWM->enableF, "0\n", 2);
+	PWM->sounding = false;
+	StatusEvent(-1, 0);
+}
+
+//
+// Next pending signal (0 if there is none)
+//
+int NextSignal() {
+	struct signalfd_siginfo si;
+
+	if ((SignalF < 0) || (read(SignalF, &si, sizeof(si)) != sizeof(si))) {
+		return 0;
+	}
+	return si.ssi_signo;
+}
+
+//
+// Stop at once or pause until resumed; the playback clock is held while paused,
+// so playback goes on from the very same place
+//
+static void HandleSignals() {
+	int sig;
+
+	while ((sig = NextSignal()) != 0) {
+		if ((sig != SIGUSR1) && (sig != SIGUSR2)) {
+			Mute();
+			exit(2);
+		}
+		if (sig == SIGUSR2) {
+			continue;
+		}
+		TPoint start = TClock::now();
+		TPWMDevice *cur = PWM;
+		unsigned resound = 0;
+		int tempo = ClockTempo, voice;
+		struct pollfd pfd = { SignalF, POLLIN, 0 };
+
+		for (voice = 0, PWM = cur; PWM; PWM = PWM->next, ++voice) {
+			if (PWM->sounding) {
+				resound |= 1u << voice;
+			}
+			Mute();
+		}
+		PWM = cur;
+		SetClockTempo(0);
+		StatusState(STATE_PAUSED);
+		if (Debug) {
+			printf("Paused\n");
+		}
+		while ((sig = NextSignal()) != SIGUSR2) {
+			if ((sig != 0) && (sig != SIGUSR1)) {
+				exit(2);
+			}
+			if (sig == 0) {
+				poll(&pfd, 1, -1);
+			}
+		}
+		SetClockTempo(tempo);
+		StatusState(STATE_PLAYING);
+		if (Debug) {
+			printf("Resumed after %lld ms\n", (long long)duration_cast<milliseconds>(TClock::now() - start).count());
+		}
+		for (voice = 0, PWM = cur; PWM; PWM = PWM->next, ++voice) {
+			if (resound & (1u << voice)) {
+				Sound(PWM->lastPitch, PWM->lastVelocity);
+			}
+		}
+		PWM = cur;
+	}
+}
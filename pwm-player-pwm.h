@@ -0,0 +1,46 @@
+/*
+ * PWM output and the playback clock
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_PWM_H_
+#define _PWM_PLAYER_PWM_H_
+
+/*
+ * PWM device the melody is played on
+ */
+typedef struct TPWMDevice {
+	int enableF;
+	int periodF;
+	int dutyCycleF;
+	int volume;                 // percent of the note velocity
+	int wakeF;                  // readable when the playback should be cut short (-1 if never)
+	volatile int stopped;       // the playback is cut short: waits return at once, notes are not sounded
+	int lastPitch;              // note to sound again on resume
+	int lastVelocity;
+	bool sounding;
+	long dutyCycle;             // last written to the device, nanoseconds (0 if unknown)
+	struct TPWMDevice *next;    // next output of a polyphonic player (NULL for the last)
+} TPWMDevice;
+
+/*
+ * Play, Sound, WaitUntil and Mute work on the device of the calling thread:
+ * the default one (used by the player itself) unless the thread binds another
+ */
+extern __thread TPWMDevice *PWM;
+
+#define PWM_MAX_VOICES 8
+
+/*
+ * PWM device handling functions; a device opened with a list of outputs
+ * plays voice 0 on the first of them, voice 1 on the second and so on
+ */
+void InitPWMDevice(TPWMDevice *dev);
+int OpenPWMDevice(TPWMDevice *dev, const char *pwmDevStr);
+void ClosePWMDevice(TPWMDevice *dev);
+int PWMVoices();
+void SoundVoice(int voice, int pitch, int velocity);
+void MuteVoice(int voice);
+
+#endif
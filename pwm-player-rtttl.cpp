@@ -0,0 +1,217 @@
+/*
+ * RTTTL (Nokia ring tone) parser
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "pwm-player.h"
+#include "pwm-player-rtttl.h"
+#include "pwm-player-compiled.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+#define RTTTL_DEFAULT_DURATION  4
+#define RTTTL_DEFAULT_OCTAVE    6
+#define RTTTL_DEFAULT_BPM       63
+#define RTTTL_VELOCITY          56      // same as default iMelody volume (7)
+
+/* semitone offset of a..h from C */
+static const int NoteOffset[] = { 9, 11, 0, 2, 4, 5, 7, 11 };
+
+typedef struct {
+	const char *text;
+	const char *p;
+	const char *end;
+	const char *source;
+} TScanner;
+
+static void SkipSpace(TScanner &s) {
+	while ((s.p < s.end) && isspace((unsigned char)*s.p)) {
+		++s.p;
+	}
+}
+
+static int Peek(TScanner &s) {
+	return (s.p < s.end) ? tolower((unsigned char)*s.p) : 0;
+}
+
+static bool GetNumber(TScanner &s, int *v) {
+	if ((s.p >= s.end) || !isdigit((unsigned char)*s.p)) {
+		return false;
+	}
+	for (*v = 0; (s.p < s.end) && isdigit((unsigned char)*s.p); ++s.p) {
+		if (*v < 100000) {
+			*v = *v * 10 + (*s.p - '0');
+		}
+	}
+	return true;
+}
+
+static bool ValidDuration(int d) {
+	return (d == 1) || (d == 2) || (d == 4) || (d == 8) || (d == 16) || (d == 32);
+}
+
+static int Error(TScanner &s, const char *msg) {
+	int line = 1;
+	const char *ls = s.text;
+
+	for (const char *q = s.text; q < s.p; ++q) {
+		if (*q == '\n') {
+			++line;
+			ls = q + 1;
+		}
+	}
+	fprintf(stderr, "Error parsing %s at line %d, column %d: %s\n", s.source, line, (int)(s.p - ls) + 1, msg);
+	return -1;
+}
+
+//
+// Parse RTTTL text (not necessarily zero terminated) into a timeline
+//
+int CompileRTTTL(const char *text, size_t len, const char *source, TTimeline &tl) {
+	TScanner s = { text, text, text + len, source };
+	int defDuration = RTTTL_DEFAULT_DURATION;
+	int defOctave = RTTTL_DEFAULT_OCTAVE;
+	int bpm = RTTTL_DEFAULT_BPM;
+	unsigned long long wholeUs;
+	unsigned long long t = 0;
+	int key, v;
+
+	tl.notes.clear();
+	tl.length = 0;
+
+	// name
+	while ((s.p < s.end) && (*s.p != ':')) {
+		++s.p;
+	}
+	if (s.p >= s.end) {
+		return Error(s, "':' after the name expected");
+	}
+	++s.p;
+
+	// defaults
+	for (SkipSpace(s); Peek(s) != ':'; SkipSpace(s)) {
+		if ((key = Peek(s)) == 0) {
+			return Error(s, "':' after the defaults expected");
+		}
+		++s.p;
+		SkipSpace(s);
+		if (Peek(s) != '=') {
+			return Error(s, "'=' expected");
+		}
+		++s.p;
+		SkipSpace(s);
+		if (!GetNumber(s, &v)) {
+			return Error(s, "number expected");
+		}
+		if (key == 'd') {
+			if (!ValidDuration(v)) {
+				return Error(s, "invalid default duration");
+			}
+			defDuration = v;
+		} else if (key == 'o') {
+			if (v > 8) {
+				return Error(s, "invalid default octave");
+			}
+			defOctave = v;
+		} else if (key == 'b') {
+			if ((v < 1) || (v > 900)) {
+				return Error(s, "invalid beat");
+			}
+			bpm = v;
+		} else if (Debug) {
+			printf("Ignoring RTTTL setting '%c'\n", key);
+		}
+		SkipSpace(s);
+		if (Peek(s) == ',') {
+			++s.p;
+		}
+	}
+	++s.p;
+	wholeUs = 4ULL * 60 * 1000000 / bpm;
+
+	// notes
+	for (SkipSpace(s); s.p < s.end; SkipSpace(s)) {
+		int duration = defDuration;
+		int octave = defOctave;
+		int note;
+		bool dotted = false;
+		unsigned long long us;
+
+		if (GetNumber(s, &duration) && !ValidDuration(duration)) {
+			return Error(s, "invalid duration");
+		}
+		note = Peek(s);
+		if (((note < 'a') || (note > 'h')) && (note != 'p')) {
+			return Error(s, "note expected");
+		}
+		++s.p;
+		int pitch = (note != 'p') ? NoteOffset[note - 'a'] : 0;
+		if (Peek(s) == '#') {
+			++pitch;
+			++s.p;
+		}
+		if (Peek(s) == '.') {
+			dotted = true;
+			++s.p;
+		}
+		if (GetNumber(s, &octave) && (octave > 8)) {
+			return Error(s, "invalid octave");
+		}
+		if (Peek(s) == '.') {
+			dotted = true;
+			++s.p;
+		}
+		us = wholeUs / duration;
+		if (dotted) {
+			us += us / 2;
+		}
+		if (note != 'p') {
+			TNote n;
+			n.start = (unsigned long)t;
+			n.duration = (unsigned long)us;
+			n.pitch = (unsigned char)((octave + 1) * 12 + pitch);
+			n.velocity = RTTTL_VELOCITY;
+			n.channel = 0;
+			n.track = 0;
+			n.voice = 0;
+			n.arpeggio = 0;
+			tl.notes.push_back(n);
+		}
+		t += us;
+		SkipSpace(s);
+		if (Peek(s) == ',') {
+			++s.p;
+		} else if (s.p < s.end) {
+			return Error(s, "',' expected");
+		}
+	}
+	tl.length = (unsigned long)t;
+	if (Debug) {
+		printf("Compiled RTTTL %s: %d notes, length %lu ms\n", source, (int)tl.notes.size(), tl.length / 1000);
+	}
+	return 1;
+}
+
+int CompileRTTTLString(const char *str, TTimeline &tl) {
+	return CompileRTTTL(str, strlen(str), "string", tl);
+}
+
+int CompileRTTTLFile(const char *filename, TTimeline &tl) {
+	const void *data;
+	size_t size;
+	int rc;
+
+	if ((data = MapFile(filename, &size)) == NULL) {
+		fprintf(stderr, "Error reading file %s(%d): %s\n", filename, errno, strerror(errno));
+		return -1;
+	}
+	rc = CompileRTTTL((const char*)data, size, filename, tl);
+	munmap((void*)data, size);
+	return rc;
+}
@@ -0,0 +1,30 @@
+/*
+ * RTTTL (Nokia ring tone) parser
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_RTTTL_H_
+#define _PWM_PLAYER_RTTTL_H_
+
+#include <stddef.h>
+
+#include "pwm-player-timeline.h"
+
+/*
+ * RTTTL text is "name:d=4,o=5,b=120:8c6,8p,4.e,..." and is turned into the
+ * note timeline in a single pass, without any intermediate form:
+ *   d=<1|2|4|8|16|32>     default duration
+ *   o=<0..8>              default octave (a4 is 440 Hz)
+ *   b=<bpm>               beats (quarter notes) per minute
+ *   [duration]<a..g|h|p>[#][.][octave][.]   note (h is b, p is pause)
+ */
+
+/*
+ * RTTTL handling functions
+ */
+int CompileRTTTL(const char *text, size_t len, const char *source, TTimeline &tl);
+int CompileRTTTLString(const char *str, TTimeline &tl);
+int CompileRTTTLFile(const char *filename, TTimeline &tl);
+
+#endif
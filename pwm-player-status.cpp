@@ -0,0 +1,216 @@
+/*
+ * Shared memory status and control block of a running player
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pwm-player.h"
+#include "pwm-player-status.h"
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+TStatusBlock *Status = NULL;
+
+static char StatusPath[64];
+static TPoint MelodyStart;
+
+static void RemoveStatusBlock() {
+	unlink(StatusPath);
+}
+
+//
+// Map the block of the given player
+//
+static TStatusBlock *MapStatusBlock(int pid, bool create) {
+	TStatusBlock *sb;
+	int fd;
+
+	snprintf(StatusPath, sizeof(StatusPath), "%s%d", STATUS_PREFIX, pid);
+	if ((fd = open(StatusPath, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644)) < 0) {
+		return NULL;
+	}
+	if (create && (ftruncate(fd, sizeof(TStatusBlock)) != 0)) {
+		close(fd);
+		return NULL;
+	}
+	sb = (TStatusBlock*)mmap(NULL, sizeof(TStatusBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (sb == MAP_FAILED) {
+		return NULL;
+	}
+	if (!create && ((memcmp(sb->magic, STATUS_MAGIC, sizeof(sb->magic)) != 0) || (sb->version != STATUS_VERSION))) {
+		munmap(sb, sizeof(TStatusBlock));
+		errno = EINVAL;
+		return NULL;
+	}
+	return sb;
+}
+
+//
+// Create the block of this player (playback goes on without it if that fails)
+//
+int OpenStatusBlock() {
+	TStatusBlock *sb;
+
+	if ((sb = MapStatusBlock(getpid(), true)) == NULL) {
+		if (Debug) {
+			printf("Unable to create status block %s(%d): %s\n", StatusPath, errno, strerror(errno));
+		}
+		return -1;
+	}
+	sb->version = STATUS_VERSION;
+	sb->pid = getpid();
+	sb->pitch = -1;
+	sb->volume = 100;
+	sb->tempo = 100;
+	__sync_synchronize();
+	memcpy(sb->magic, STATUS_MAGIC, sizeof(sb->magic));
+	Status = sb;
+	atexit(RemoveStatusBlock);
+	return 1;
+}
+
+//
+// Status is changed between these two, so readers can see it is in flux
+//
+static void BeginUpdate() {
+	Status->seq++;
+	__sync_synchronize();
+}
+
+static void EndUpdate() {
+	Status->stamp = (uint32_t)TP2MSEC(TClock::now());
+	Status->position = (NOW > MelodyStart) ? (uint32_t)duration_cast<milliseconds>(NOW - MelodyStart).count() : 0;
+	__sync_synchronize();
+	Status->seq++;
+}
+
+//
+// A melody starts (or would have started) at the given point of the playback clock
+//
+void StatusMelody(const char *source, unsigned long lengthUs, TPoint start) {
+	if (Status == NULL) {
+		return;
+	}
+	BeginUpdate();
+	MelodyStart = start;
+	Status->state = STATE_PLAYING;
+	Status->length = lengthUs / 1000;
+	Status->melodies++;
+	snprintf(Status->melody, sizeof(Status->melody), "%s", source);
+	EndUpdate();
+}
+
+//
+// Note sounded (pitch -1 when muted)
+//
+void StatusEvent(int pitch, int velocity) {
+	if (Status == NULL) {
+		return;
+	}
+	BeginUpdate();
+	Status->pitch = pitch;
+	Status->velocity = velocity;
+	Status->notes += (pitch >= 0);
+	EndUpdate();
+}
+
+//
+// The player woke up that late for an event
+//
+void StatusLate(unsigned long lateUs) {
+	if ((Status == NULL) || (lateUs <= STATUS_LATE_US)) {
+		return;
+	}
+	BeginUpdate();
+	Status->late++;
+	if (lateUs > Status->maxLate) {
+		Status->maxLate = lateUs;
+	}
+	EndUpdate();
+}
+
+void StatusState(uint32_t state) {
+	if (Status == NULL) {
+		return;
+	}
+	BeginUpdate();
+	Status->pauses += (state == STATE_PAUSED);
+	Status->state = state;
+	EndUpdate();
+}
+
+//
+// Print a consistent snapshot of the player status
+//
+int ShowStatus(int pid) {
+	static const char *const states[] = { "idle", "playing", "paused" };
+	TStatusBlock *sb, s;
+	uint32_t seq;
+
+	if ((sb = MapStatusBlock(pid, false)) == NULL) {
+		fprintf(stderr, "No status of player %d (%s: %s)\n", pid, StatusPath, strerror(errno));
+		return -1;
+	}
+	do {
+		while ((seq = sb->seq) & 1) {
+			this_thread::yield();
+		}
+		__sync_synchronize();
+		memcpy(&s, sb, sizeof(s));
+		__sync_synchronize();
+	} while (sb->seq != seq);
+	munmap(sb, sizeof(TStatusBlock));
+
+	s.melody[sizeof(s.melody) - 1] = 0;
+	printf("pid=%u\nstate=%s\nmelody=%s\nposition=%u\nlength=%u\npitch=%d\nvelocity=%d\n"
+		"melodies=%u\nnotes=%u\nlate=%u\nmax_late_us=%u\npauses=%u\nvolume=%d\ntranspose=%d\ntempo=%d\n",
+		s.pid, (s.state <= STATE_PAUSED) ? states[s.state] : "unknown", s.melody, s.position, s.length, s.pitch, s.velocity,
+		s.melodies, s.notes, s.late, s.maxLate, s.pauses, s.volume, s.transpose, s.tempo);
+	return 1;
+}
+
+//
+// Write the controls given as <name>=<value>[,<name>=<value>...]
+//
+int SetControls(int pid, const char *spec) {
+	TStatusBlock *sb;
+	string s = spec;
+	int rc = 1;
+
+	if ((sb = MapStatusBlock(pid, false)) == NULL) {
+		fprintf(stderr, "No status of player %d (%s: %s)\n", pid, StatusPath, strerror(errno));
+		return -1;
+	}
+	for (size_t b = 0, e; b < s.size(); b = e + 1) {
+		if ((e = s.find(',', b)) == string::npos) {
+			e = s.size();
+		}
+		string item = s.substr(b, e - b);
+		size_t eq = item.find('=');
+		char *end;
+		long v = (eq == string::npos) ? 0 : strtol(item.c_str() + eq + 1, &end, 10);
+
+		if ((eq == string::npos) || (*end != 0) || (end == item.c_str() + eq + 1)) {
+			fprintf(stderr, "Control '%s' should be given as <name>=<value>\n", item.c_str());
+			rc = -1;
+		} else if ((item.compare(0, eq, "volume") == 0) && (v >= 0) && (v <= 1000)) {
+			sb->volume = v;
+		} else if ((item.compare(0, eq, "transpose") == 0) && (v >= -48) && (v <= 48)) {
+			sb->transpose = v;
+		} else if ((item.compare(0, eq, "tempo") == 0) && (v >= 25) && (v <= 400)) {
+			sb->tempo = v;
+		} else {
+			fprintf(stderr, "Unknown control or value out of range: %s\n", item.c_str());
+			rc = -1;
+		}
+	}
+	munmap(sb, sizeof(TStatusBlock));
+	return rc;
+}
@@ -0,0 +1,68 @@
+/*
+ * Shared memory status and control block of a running player
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_STATUS_H_
+#define _PWM_PLAYER_STATUS_H_
+
+#include <stdint.h>
+
+#define STATUS_MAGIC        "PWMS"
+#define STATUS_VERSION      1
+#define STATUS_PREFIX       "/dev/shm/pwm-player."  // followed by the player pid
+#define STATUS_LATE_US      1000                    // events later than that are counted as late
+
+#define STATE_IDLE          0
+#define STATE_PLAYING       1
+#define STATE_PAUSED        2
+
+/*
+ * Every player keeps the block mapped at STATUS_PREFIX<pid> while it runs.
+ * All the fields are 32 bit words (host byte order), so each one is read and
+ * written atomically.
+ * The status part is written by the player only: it makes 'seq' odd before an
+ * update and even again after it, so a reader takes a consistent snapshot by
+ * repeating the read until 'seq' is even and the same before and after it.
+ * The control part is written by the tools and read by the player at each
+ * note, so a change takes effect on the next note.
+ */
+typedef struct {
+	char     magic[4];          // STATUS_MAGIC
+	uint32_t version;           // STATUS_VERSION
+	uint32_t pid;
+	// status
+	volatile uint32_t seq;
+	uint32_t state;             // STATE_*
+	uint32_t stamp;             // CLOCK_MONOTONIC of the update, milliseconds (wraps)
+	uint32_t position;          // from the melody start, milliseconds
+	uint32_t length;            // melody length, milliseconds (0 if unknown)
+	int32_t  pitch;             // MIDI note sounding (-1 for silence)
+	int32_t  velocity;          // its velocity after the volume changes
+	uint32_t melodies;          // melodies started
+	uint32_t notes;             // notes sounded
+	uint32_t late;              // events late by more than STATUS_LATE_US
+	uint32_t maxLate;           // the worst lateness, microseconds
+	uint32_t pauses;
+	char     melody[64];        // source of the melody
+	// control
+	volatile int32_t volume;    // percent of the velocity (100 to keep it)
+	volatile int32_t transpose; // semitones
+	volatile int32_t tempo;     // percent of the melody tempo (25..400)
+} TStatusBlock;
+
+extern TStatusBlock *Status;    // NULL when there is no block
+
+/*
+ * status block handling functions
+ */
+int OpenStatusBlock();
+void StatusMelody(const char *source, unsigned long lengthUs, TPoint start);
+void StatusEvent(int pitch, int velocity);
+void StatusLate(unsigned long lateUs);
+void StatusState(uint32_t state);
+int ShowStatus(int pid);
+int SetControls(int pid, const char *spec);
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * Note timeline
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#include "pwm-player.h"
+#include "pwm-player-pwm.h"
+#include "pwm-player-timeline.h"
+
+#include <algorithm>
+#include <climits>
+
+__attribute__ ((used)) static char s_RCSVersion[] = "$Id$";
+__attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pwm-player";
+
+
+static bool NoteBefore(const TNote &n, unsigned long us) {
+	return n.start < us;
+}
+
+//
+// Find the ordinal (1-based) of the first note at or after the given time
+//
+int SeekTimeline(const TTimeline &tl, unsigned long us) {
+	return (int)(lower_bound(tl.notes.begin(), tl.notes.end(), us, NoteBefore) - tl.notes.begin()) + 1;
+}
+
+//
+// Play notes [first, last) with time 'base' of the timeline falling on t0.
+// Every onset is scheduled against the absolute start time, so the per-note
+// output overhead never accumulates into a tempo drift. A playback cut short
+// leaves the loop at once.
+//
+static void PlayNotes(const TTimeline &tl, size_t first, size_t last, unsigned long base, TPoint t0, bool legato) {
+	for (size_t i = first; (i < last) && !PWM->stopped; ++i) {
+		const TNote &n = tl.notes[i];
+		unsigned long end = n.start + n.duration;
+
+		WaitUntil(t0 + microseconds(n.start - base));
+		if (Debug) printf("%lu: Note(%u): track %d, channel %d, duration %lu, pitch %d, velocity %d\n",
+			n.start, (unsigned)i + 1, n.track, n.channel, n.duration, n.pitch, n.velocity);
+		// an arpeggio step changes the period of the chord sounding; one
+		// starting the playback (-n, --seek) is written in full
+		if (n.arpeggio && PWM->sounding) {
+			SoundPeriod(n.pitch);
+		} else {
+			Sound(n.pitch, n.velocity);
+		}
+		// keep sounding when the next note starts right away
+		if (((i + 1 < last) && (tl.notes[i + 1].start <= end)) || (legato && (i + 1 == last))) {
+			continue;
+		}
+		WaitUntil(t0 + microseconds(end - base));
+		Mute();
+	}
+}
+
+//
+// Play notes [first, last) of a polyphonic timeline: a single loop waits for
+// whatever comes first, the next onset or the end of a sounding voice, and
+// writes the output of that voice only; a playback cut short leaves the loop
+//
+static void PlayVoices(const TTimeline &tl, size_t first, size_t last, unsigned long base, TPoint t0) {
+	unsigned long ends[PWM_MAX_VOICES];
+	int voice, v;
+
+	for (v = 0; v < PWM_MAX_VOICES; ++v) {
+		ends[v] = ULONG_MAX;
+	}
+	for (size_t i = first; !PWM->stopped; ) {
+		unsigned long end = ULONG_MAX;
+
+		for (v = 0, voice = -1; v < PWM_MAX_VOICES; ++v) {
+			if (ends[v] < end) {
+				end = ends[v];
+				voice = v;
+			}
+		}
+		if ((voice >= 0) && ((i >= last) || (end <= tl.notes[i].start))) {
+			WaitUntil(t0 + microseconds(end - base));
+			ends[voice] = ULONG_MAX;
+			// keep sounding when the next note of the voice starts right away
+			for (size_t j = i; (j < last) && (tl.notes[j].start == end); ++j) {
+				if (tl.notes[j].voice == voice) {
+					goto next;
+				}
+			}
+			MuteVoice(voice);
+			continue;
+		}
+		if (i >= last) {
+			break;
+		}
+		{
+			const TNote &n = tl.notes[i];
+
+			WaitUntil(t0 + microseconds(n.start - base));
+			if (Debug) printf("%lu: Note(%u): voice %d, track %d, channel %d, duration %lu, pitch %d, velocity %d\n",
+				n.start, (unsigned)i + 1, n.voice, n.track, n.channel, n.duration, n.pitch, n.velocity);
+			SoundVoice(n.voice, n.pitch, n.velocity);
+			ends[n.voice] = n.start + n.duration;
+			++i;
+		}
+next:
+		;
+	}
+}
+
+//
+// Notes of the timeline are spread over several voices
+//
+static bool Polyphonic(const TTimeline &tl) {
+	for (size_t i = 0; i < tl.notes.size(); ++i) {
+		if (tl.notes[i].voice > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//
+// Play notes startNote..endNote (1-based, inclusive) of the prepared timeline
+//
+int PlayTimeline(const TTimeline &tl, int startNote, int endNote) {
+	size_t first, last;
+
+	first = (startNote > 1) ? (size_t)startNote - 1 : 0;
+	last = ((endNote > 0) && ((size_t)endNote < tl.notes.size())) ? (size_t)endNote : tl.notes.size();
+	if (first >= last) {
+		return 1;
+	}
+	if (Polyphonic(tl)) {
+		PlayVoices(tl, first, last, tl.notes[first].start, NOW);
+	} else {
+		PlayNotes(tl, first, last, tl.notes[first].start, NOW, false);
+	}
+	return 1;
+}
+
+//
+// Play the whole timeline starting at t0 and return when its length is over.
+// With 'legato' (the caller starts the next melody with a note right at the
+// end) a last note lasting to the end is left sounding into the next one.
+//
+int PlayTimelineAt(const TTimeline &tl, TPoint t0, bool legato) {
+	bool poly = Polyphonic(tl);
+	bool hold = legato && !poly && !tl.notes.empty() && (tl.notes.back().start + tl.notes.back().duration >= tl.length);
+
+	if (poly) {
+		PlayVoices(tl, 0, tl.notes.size(), 0, t0);
+	} else {
+		PlayNotes(tl, 0, tl.notes.size(), 0, t0, hold);
+	}
+	if (!hold) {
+		WaitUntil(t0 + microseconds(tl.length));
+	}
+	return 1;
+}
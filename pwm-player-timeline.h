@@ -0,0 +1,42 @@
+/*
+ * Note timeline
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWM_PLAYER_TIMELINE_H_
+#define _PWM_PLAYER_TIMELINE_H_
+
+#include <vector>
+
+/*
+ * single note with absolute timing
+ */
+typedef struct {
+	unsigned long start;       // onset, microseconds from the melody start
+	unsigned long duration;    // microseconds
+	unsigned char pitch;       // MIDI note number
+	unsigned char velocity;    // MIDI velocity (1..127)
+	unsigned char channel;     // source MIDI channel (0 for iMelody/eMelody)
+	unsigned char track;       // source MIDI track
+	unsigned char voice;       // output the note is played on (0 for monophonic timelines)
+	unsigned char arpeggio;    // arpeggio step after the first one: only the period is changed
+} TNote;
+
+/*
+ * melody prepared for playback: notes are sorted by onset and never
+ * overlap on the same voice
+ */
+typedef struct {
+	std::vector<TNote> notes;
+	unsigned long length;      // total melody length, microseconds
+} TTimeline;
+
+/*
+ * timeline handling functions
+ */
+int SeekTimeline(const TTimeline &tl, unsigned long us);
+int PlayTimeline(const TTimeline &tl, int startNote, int endNote);
+int PlayTimelineAt(const TTimeline &tl, TPoint t0, bool legato);
+
+#endif
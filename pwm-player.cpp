@@ -10,22 +10,37 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sched.h>
 
 #include "pwm-player.h"
 #include "pwm-player-midi.h"
 #include "pwm-player-melody.h"
-
-
-#define PWM_CHIP_TRIGGER "/sys/class/pwm/pwmchip0/export"
-#define PWM_CHIP_PATH "/sys/class/pwm/pwmchip0/pwm"
-
-#define PWM_ENABLE "/enable"
-#define PWM_PERIOD "/period"
-#define PWM_DUTYCYCLE "/duty_cycle"
+#include "pwm-player-compiled.h"
+#include "pwm-player-builtin.h"
+#include "pwm-player-rtttl.h"
+#include "pwm-player-convert.h"
+#include "pwm-player-catalog.h"
+#include "pwm-player-pack.h"
+#include "pwm-player-daemon.h"
+#include "pwm-player-playlist.h"
+#include "pwm-player-status.h"
+#include "pwm-player-lock.h"
+#include "pwm-player-pwm.h"
+#include "pwm-player-live.h"
+
+
+#define PID_SUFFIX ".pid"       // pid files go next to the lock files of the outputs
+#define RT_PRIORITY 50          // SCHED_FIFO priority of --rt
+#define AT_REALTIME_US 2000     // the end of the --at wait is slept on CLOCK_REALTIME
+#define PWM_DEV_LIST 64         // longest list of PWM outputs
 
 
 __attribute__ ((used)) static char s_RCSVersion[] = "$Id: pwm-player.cpp 285 2022-12-31 14:56:40Z maxwolf $";
@@ -35,153 +50,334 @@ __attribute__ ((used)) static char s_RCSsrc[] = "https://github.com/sthamster/pw
 //
 // global shared data
 //
-bool Debug = false; 
-int VolumeChange = 100; 
+const char *PWMDevList = NULL;  // PWM outputs, [<chip>:]<channel>[,...]
+static vector<const char *> PWMZones;   // outputs of the daemon zones after the first one
 
-int PWMDevN = -1;
-int PWMEnableF = -1;
-int PWMPeriodF = -1;
-int PWMDutyCycleF = -1;
+static vector<string> PidFiles;        // written by this player
 
 //
-// (Discover and) Setup PWM device 
+// PWM outputs given by the option or the environment
 //
-int SetupHW() {
-	int f = -1;
-	struct stat fs;
-	char pwmDevStr[16];
-	char fileName[FILENAME_MAX];
-
-	memset(pwmDevStr, 0, sizeof(pwmDevStr));
-	if (PWMDevN != -1) {
-		sprintf(pwmDevStr, "%d", PWMDevN);
+static int GetPWMDevice(char *pwmDevStr, size_t size) {
+	memset(pwmDevStr, 0, size);
+	if (PWMDevList) {
+		snprintf(pwmDevStr, size, "%s", PWMDevList);
 	} else {
 	  char *p = NULL;
     	if ((p = getenv("WB_PWM_BUZZER")) == NULL) {
         	fprintf(stderr, "No WB_PWM_BUZZER environment variable set or PWM device number given\n");	
         	return -1;
         }
-        strncpy(pwmDevStr, p, sizeof(pwmDevStr) - 1);
+        strncpy(pwmDevStr, p, size - 1);
         if (Debug) {
         	printf("WB_PWM_BUZZER points to pwm%s\n", pwmDevStr);
         }
     }
+	return 1;
+}
 
-	sprintf(fileName, "%s%s%s", PWM_CHIP_PATH, pwmDevStr, PWM_ENABLE);
-	if (stat(fileName, &fs) != 0) {
-		if (stat(PWM_CHIP_TRIGGER, &fs) != 0) {
-			fprintf(stderr, "No PWM trigger file %s\n", PWM_CHIP_TRIGGER);
-			return -1;
-		}
-		if ((f = open(PWM_CHIP_TRIGGER, O_WRONLY)) < 0) {
-			fprintf(stderr, "Error opening PWM trigger file %s(%d): %s\n", PWM_CHIP_TRIGGER, errno, strerror(errno));
-			return -1;
-		}
-		if (write(f, pwmDevStr, strlen(pwmDevStr)) == EOF) {
-			close(f);
-			fprintf(stderr, "Error writing PWM trigger file %s(%d): %s\n", PWM_CHIP_TRIGGER, errno, strerror(errno));
-			return -1;
-		}
-		close(f);
-		if (stat(fileName, &fs) != 0) {
-			fprintf(stderr, "Error accessing PWM file %s(%d): %s\n", fileName, errno, strerror(errno));
-			return -1;
-		}
-	}
-	if ((PWMEnableF = open(fileName, O_WRONLY)) < 0) {
-openerr:
-		fprintf(stderr, "Error opening PWM file %s(%d): %s\n", fileName, errno, strerror(errno));
+//
+// (Discover and) Setup PWM device 
+//
+int SetupHW() {
+	char pwmDevStr[PWM_DEV_LIST];
+
+	if (GetPWMDevice(pwmDevStr, sizeof(pwmDevStr)) < 0) {
 		return -1;
 	}
-	sprintf(fileName, "%s%s%s", PWM_CHIP_PATH, pwmDevStr, PWM_PERIOD);
-	if ((PWMPeriodF = open(fileName, O_WRONLY)) < 0) {
-		goto openerr;
+	return OpenPWMDevice(PWM, pwmDevStr);
+}
+
+void Cleanup() {
+	ClosePWMDevice(PWM);
+}
+
+void SigHandler(int n)
+{
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	exit(2);
+}
+
+//
+// Keep the pages in memory and run ahead of the normal processes, so the
+// notes are not delayed by page faults or a busy system (needs root or the
+// CAP_SYS_NICE/CAP_IPC_LOCK capabilities, the player goes on without them)
+//
+static int SetupRealtime() {
+	struct sched_param sp;
+	int rc = 1;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		fprintf(stderr, "Unable to lock memory(%d): %s\n", errno, strerror(errno));
+		rc = -1;
+	}
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = RT_PRIORITY;
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) != 0) {
+		fprintf(stderr, "Unable to set real-time priority(%d): %s\n", errno, strerror(errno));
+		rc = -1;
 	}
-	sprintf(fileName, "%s%s%s", PWM_CHIP_PATH, pwmDevStr, PWM_DUTYCYCLE);
-	if ((PWMDutyCycleF = open(fileName, O_WRONLY)) < 0) {
-		goto openerr;
+	return rc;
+}
+
+//
+// Receive stop (SIGHUP, SIGINT, SIGTERM), pause (SIGUSR1) and resume (SIGUSR2)
+// through a signalfd, so they are handled in the normal flow of the player
+// (all threads have to be started after that)
+//
+static int SetupSignals() {
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	if ((pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) || ((SignalF = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)) {
+		fprintf(stderr, "Error setting up signals(%d): %s\n", errno, strerror(errno));
+		pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		signal(SIGHUP, SigHandler);
+		signal(SIGINT, SigHandler);
+		signal(SIGTERM, SigHandler);
+		return -1;
 	}
 	return 1;
 }
 
-// approximate frequencies of MIDI notes (0 to 127)
-static int freqs[128] = {
-8,9,9,10,10,11,12,12,13,14,15,15,16,17,18,19,21,22,23,24,26,28,29,31,33,35,37,39,41,44,46,49,52,55,58,62,65,69,73,78,82,87,92,98,104,110,
-117,123,131,139,147,156,165,175,185,196,208,220,233,247,262,277,294,311,330,349,370,392,415,440,466,494,523,554,587,622,659,698,740,784,
-831,880,932,988,1047,1109,1175,1245,1319,1397,1480,1568,1661,1760,1865,1976,2093,2217,2349,2489,2637,2794,2960,3136,3322,3520,3729,3951,
-4186,4435,4699,4978,5274,5588,5920,6272,6645,7040,7459,7902,8372,8870,9397,9956,10548,11175,11840,12544 };
+static void RemovePidFiles() {
+	for (size_t i = 0; i < PidFiles.size(); ++i) {
+		FILE *f;
+		int pid = 0;
 
+		if ((f = fopen(PidFiles[i].c_str(), "r")) != NULL) {
+			if ((fscanf(f, "%d", &pid) == 1) && (pid == getpid())) {
+				unlink(PidFiles[i].c_str());
+			}
+			fclose(f);
+		}
+	}
+}
 
 //
-// Start playing of MIDI note 'pitch' with 'velocity' and hold on for duration_us microseconds
+// Pid files of the player owning the device: the one given by --pidfile, or
+// one for each output of the device
 //
-void Play(int pitch, int velocity, int duration_us) {
-	int freq, volume;
+static vector<string> GetPidFiles(const char *pidFile, const char *pwmDevStr) {
+	vector<string> paths;
 
-	/* freq = (int)round(440 * powf(2, (pitch - 69)/12.0));*/
-	if ((pitch >= 0) && (pitch < 128)) {
-		freq = freqs[pitch];
-	} else {
-		freq = 440;
+	if (pidFile) {
+		paths.push_back(pidFile);
+		return paths;
 	}
+	vector<string> outputs = DeviceOutputs(pwmDevStr, NULL);
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		paths.push_back(string(LOCK_PREFIX) + outputs[i] + PID_SUFFIX);
+	}
+	return paths;
+}
 
-	velocity = (velocity * VolumeChange) / 100;
-   	if (velocity < 0) velocity = 0;
-   	if (velocity > 127) velocity = 127;
-
-	volume = (velocity * 100) / 127; // midi velocity is in range (0; 127]
+//
+// Let --stop, --pause, --continue, --status and --set find the player by
+// any of its outputs
+//
+static void WritePidFiles(const vector<string> &paths) {
+	for (size_t i = 0; i < paths.size(); ++i) {
+		FILE *f;
+
+		if ((f = fopen(paths[i].c_str(), "w")) == NULL) {
+			if (Debug) {
+				printf("Unable to write pid file %s(%d): %s\n", paths[i].c_str(), errno, strerror(errno));
+			}
+			continue;
+		}
+		fprintf(f, "%d\n", (int)getpid());
+		fclose(f);
+		PidFiles.push_back(paths[i]);
+	}
+	atexit(RemovePidFiles);
+}
 
-	if (Debug) printf("Playing %dHz, vol %d, dur %d\n", freq, volume, duration_us/1000);
+//
+// Pid of the running player
+//
+static int ReadPidFile(const char *path) {
+	FILE *f;
+	int pid = 0;
 
-	long period;
-	char valStr[32];
-	int vl;
-	period = 1000000000 / freq;
-	vl = sprintf(valStr, "%ld\n", period);
-	write(PWMPeriodF, valStr, vl);
-	vl = sprintf(valStr, "%ld\n", (period * volume) / 200);
-	write(PWMDutyCycleF, valStr, vl);
-	write(PWMEnableF, "1\n", 2);
-	this_thread::sleep_for(microseconds(duration_us));
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "No player is running (%s: %s)\n", path, strerror(errno));
+		return -1;
+	}
+	if ((fscanf(f, "%d", &pid) != 1) || (pid <= 0)) {
+		fprintf(stderr, "Bad pid file %s\n", path);
+		pid = -1;
+	}
+	fclose(f);
+	return pid;
 }
 
 //
-// Stop PWM sound
+// Send the signal to the player of the pid file
 //
-void Mute() {
-	write(PWMEnableF, "0\n", 2);
+static int SignalPlayer(const char *path, int sig) {
+	int pid = ReadPidFile(path);
+
+	if (pid <= 0) {
+		return -1;
+	}
+	if (kill(pid, sig) != 0) {
+		fprintf(stderr, "Unable to signal player %d from %s\n", pid, path);
+		return -1;
+	}
+	return 1;
 }
 
+
 //
-// reclaim resources
+// Parse [[hh:]mm:]ss[.ms] time specification into microseconds
 //
-void Cleanup() {
-	if (PWMEnableF > 0) {
-		Mute();
-		close(PWMEnableF);
-		PWMEnableF = -1;
+static bool ParseTime(const char *str, unsigned long long *us) {
+	unsigned long long v = 0;
+	unsigned long part = 0;
+	const char *p = str;
+
+	for (;;) {
+		if (!isdigit(*p)) {
+			return false;
+		}
+		part = strtoul(p, (char**)&p, 10);
+		if (*p != ':') {
+			break;
+		}
+		v = (v + part) * 60;
+		++p;
 	}
-	if (PWMPeriodF > 0) {
-		close(PWMPeriodF);
-		PWMPeriodF = -1;
+	v = (v + part) * 1000000;
+	if (*p == '.') {
+		unsigned long frac = 0, scale = 1000000;
+		for (++p; isdigit(*p); ++p) {
+			scale /= 10;
+			frac += (*p - '0') * scale;
+		}
+		v += frac;
 	}
-	if (PWMDutyCycleF > 0) {
-		close(PWMDutyCycleF);
-		PWMDutyCycleF = -1;
+	if (*p) {
+		return false;
 	}
-
+	*us = v;
+	return true;
 }
 
+#define OPT_SEEK 256
+#define OPT_COMPILE 257
+#define OPT_NO_CACHE 258
+#define OPT_CONVERT 259
+#define OPT_CATALOG 260
+#define OPT_PACK 261
+#define OPT_DAEMON 262
+#define OPT_CLIENT 263
+#define OPT_SOCKET 264
+#define OPT_PRIORITY 265
+#define OPT_RESUME 266
+#define OPT_MELODY_RATE 267
+#define OPT_SOURCE_RATE 268
+#define OPT_FROM 269
+#define OPT_PIDFILE 270
+#define OPT_STOP 271
+#define OPT_PAUSE 272
+#define OPT_CONTINUE 273
+#define OPT_STATUS 274
+#define OPT_SET 275
+#define OPT_BUSY 276
+#define OPT_LIVE 277
+#define OPT_RT 278
+#define OPT_AT 279
+#define OPT_ZONE 280
+#define OPT_ARP 281
+
+static struct option LongOptions[] = {
+	{ "seek", required_argument, NULL, OPT_SEEK },
+	{ "compile", required_argument, NULL, OPT_COMPILE },
+	{ "no-cache", no_argument, NULL, OPT_NO_CACHE },
+	{ "convert", required_argument, NULL, OPT_CONVERT },
+	{ "catalog", required_argument, NULL, OPT_CATALOG },
+	{ "pack", required_argument, NULL, OPT_PACK },
+	{ "daemon", no_argument, NULL, OPT_DAEMON },
+	{ "client", required_argument, NULL, OPT_CLIENT },
+	{ "socket", required_argument, NULL, OPT_SOCKET },
+	{ "priority", required_argument, NULL, OPT_PRIORITY },
+	{ "resume", no_argument, NULL, OPT_RESUME },
+	{ "melody-rate", required_argument, NULL, OPT_MELODY_RATE },
+	{ "source-rate", required_argument, NULL, OPT_SOURCE_RATE },
+	{ "from", required_argument, NULL, OPT_FROM },
+	{ "pidfile", required_argument, NULL, OPT_PIDFILE },
+	{ "stop", no_argument, NULL, OPT_STOP },
+	{ "pause", no_argument, NULL, OPT_PAUSE },
+	{ "continue", no_argument, NULL, OPT_CONTINUE },
+	{ "status", no_argument, NULL, OPT_STATUS },
+	{ "set", required_argument, NULL, OPT_SET },
+	{ "busy", required_argument, NULL, OPT_BUSY },
+	{ "live", required_argument, NULL, OPT_LIVE },
+	{ "rt", no_argument, NULL, OPT_RT },
+	{ "at", required_argument, NULL, OPT_AT },
+	{ "zone", required_argument, NULL, OPT_ZONE },
+	{ "arp", required_argument, NULL, OPT_ARP },
+	{ NULL, 0, NULL, 0 }
+};
 
-void SigHandler(int n)
-{
-	signal(SIGTERM, SIG_IGN);
-	signal(SIGINT, SIG_IGN);
-	signal(SIGHUP, SIG_IGN);
-	exit(2);
+//
+// Melody source of a daemon request: the option letter and its argument,
+// files are given by absolute path as the daemon has its own working directory
+//
+static string ClientSource(char opt, const char *arg) {
+	string file = arg, rest;
+	char path[PATH_MAX];
+
+	if (opt == 'P') {
+		file = string(arg, strrchr(arg, ':') - arg);
+		rest = strrchr(arg, ':');
+	}
+	if ((strchr("mierP", opt) != NULL) && (realpath(file.c_str(), path) != NULL)) {
+		file = path;
+	}
+	return string("-") + opt + " " + file + rest;
 }
 
+//
+// Melody text coming through a pipe is played as it comes and never cached
+//
+static bool IsStream(const char *file) {
+	struct stat fs;
 
+	return (strcmp(file, "-") == 0) || ((stat(file, &fs) == 0) && !S_ISREG(fs.st_mode));
+}
+
+//
+// Wait for the wall clock start time given (microseconds since the epoch):
+// the bulk of it on the playback clock with the signals handled, the end on
+// CLOCK_REALTIME itself, so the start follows the NTP disciplined clock
+// exactly. The playback clock is monotonic, so players started together stay
+// in phase. Returns how late the start is, in microseconds.
+//
+static long long WaitStart(unsigned long long atUs) {
+	struct timespec at = { (time_t)(atUs / 1000000), (long)(atUs % 1000000) * 1000 }, now;
+	long long us;
+
+	// nothing left to write at the start but the offset
+	fflush(stdout);
+	clock_gettime(CLOCK_REALTIME, &now);
+	us = (long long)atUs - ((long long)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+	if (us > AT_REALTIME_US) {
+		WaitUntil(NOW + microseconds(us - AT_REALTIME_US));
+	}
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &at, NULL) == EINTR) {
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((long long)now.tv_sec * 1000000 + now.tv_nsec / 1000) - (long long)atUs;
+}
 
 int main(int argc, char *argv[])
 {
@@ -191,15 +387,55 @@ int main(int argc, char *argv[])
     const char *melodyFile = NULL;
     const char *iMelody = NULL;
     const char *eMelody = NULL;
+    const char *rtttlFile = NULL;
+    const char *rtttl = NULL;
+    const char *builtinName = NULL;
     int startNote = 0;
     int endNote = INT_MAX;
     char *p;
     int trkN = 0;
+    bool mergeTracks = false;
+    TVoicePolicy voicePolicy = VOICE_HIGHEST;
+    vector<int> chanOrder;
+    const char *voiceSpec = NULL;
+    TTimeline timeline;
+    TMelody *melody = NULL;
+    bool useTimeline = false;
+    bool useCache = true;
+    const char *compileDir = NULL;
+    bool convert = false;
+    TConvertFormat convertFormat = CONVERT_COMPILED;
+    const char *catalogDir = NULL;
+    const char *packSpec = NULL;
+    const char *packFile = NULL;
+    bool daemonMode = false;
+    const char *clientCmd = NULL;
+    const char *socketPath = DAEMON_SOCKET;
+    int priority = 0;
+    int zone = -1;
+    int arpHz = 0;
+    bool resume = false;
+    const char *from = NULL;
+    const char *pidFile = NULL;
+    int playerSignal = 0;
+    bool showStatus = false;
+    const char *controls = NULL;
+    TBusyMode busy = BUSY_FAIL;
+    const char *liveInput = NULL;
+    bool realtime = false;
+    TLockHolder lockSelf, lockHolder;
+    TRateLimit melodyLimit, sourceLimit;
+    vector<TPlaylistItem> playlist;
+    bool playlistFile = false;
+    unsigned long long seekUs = 0;
+    unsigned long long atUs = 0;
+    string cacheName;
     string rev("$Revision: 285 $");
 
+    ParseRateLimit(DAEMON_MELODY_RATE, &melodyLimit);
+    ParseRateLimit(DAEMON_SOURCE_RATE, &sourceLimit);
 
-    printf("pwm-player v0.1 %s Copyright (C) 2022 by MaxWolf\n", rev.substr(1, rev.length() - 2).c_str());
-    while ( (c = getopt(argc, argv, "m:e:E:i:I:bdv:n:p:t:h")) != -1) {
+    while ( (c = getopt_long(argc, argv, "m:e:E:i:I:r:R:N:P:L:bdv:n:p:t:a:h", LongOptions, NULL)) != -1) {
         switch (c) {
         case 'm': // MIDI file
         	midiFile = (optarg);
@@ -216,6 +452,24 @@ int main(int argc, char *argv[])
         case 'E': // eMelody string
         	eMelody = optarg;
             break;
+        case 'r': // RTTTL file
+        	rtttlFile = optarg;
+            break;
+        case 'R': // RTTTL string
+        	rtttl = optarg;
+            break;
+        case 'N': // built-in melody
+        	builtinName = optarg;
+            break;
+        case 'P': // melody of a pack
+        	packSpec = optarg;
+            break;
+        case 'L': // playlist file
+        	if (ReadPlaylist(optarg, playlist) < 0) {
+        		exit(1);
+        	}
+        	playlistFile = true;
+            break;
         case 'b': // play melody in background
         	background = true;
             break;
@@ -223,9 +477,9 @@ int main(int argc, char *argv[])
         	Debug = true;
             break;
         case 'v': // volume increase
-        	VolumeChange = atoi(optarg);
+        	PWM->volume = atoi(optarg);
 	        if (Debug) {
-	        	printf("Will increase volume by <%d>\n", VolumeChange);
+	        	printf("Will increase volume by <%d>\n", PWM->volume);
 	        }
         	break;
         case 'n': // start and end note numbers
@@ -237,13 +491,19 @@ int main(int argc, char *argv[])
 	        	printf("Will play notes <%d> to <%d>\n", startNote, endNote);
 	        }
         	break;
-        case 'p': // PWM device number to use (could also be taken from WB_PWM_BUZZER environment variable
-        	if (sscanf(optarg, "%d", &PWMDevN) != 1) {
+        case 'p': // PWM device number(s) to use (could also be taken from WB_PWM_BUZZER environment variable
+        	if ((*optarg == 0) || (strlen(optarg) >= PWM_DEV_LIST)) {
         		fprintf(stderr, "Invalid PWM device number '%s' given\n", optarg);
         		exit(1);
         	}
+        	// every -p after the first one is a zone of its own
+        	if (PWMDevList) {
+        		PWMZones.push_back(optarg);
+        	} else {
+        		PWMDevList = optarg;
+        	}
 	        if (Debug) {
-	        	printf("Will use PWM device %d\n", PWMDevN);
+	        	printf("Will use PWM device %s\n", optarg);
 	        }
         	break;
         case 't':
@@ -255,49 +515,391 @@ int main(int argc, char *argv[])
 	        	printf("Will try to play MIDI track %d\n", trkN);
 	        }
 	        break;
+        case 'a': // merge all MIDI tracks and reduce them to a single voice
+        	mergeTracks = true;
+        	voiceSpec = optarg;
+        	if (ParseVoicePolicy(voiceSpec, &voicePolicy, chanOrder) < 0) {
+        		exit(1);
+        	}
+	        if (Debug) {
+	        	printf("Will merge all MIDI tracks, voice policy %s\n", optarg);
+	        }
+	        break;
+        case OPT_SEEK: // start playing from the given time
+        	if (!ParseTime(optarg, &seekUs)) {
+        		fprintf(stderr, "Invalid time '%s' given (mm:ss.ms expected)\n", optarg);
+        		exit(1);
+        	}
+	        if (Debug) {
+	        	printf("Will seek to %llu ms\n", seekUs / 1000);
+	        }
+	        break;
+        case OPT_AT: // start at the given wall clock time
+        	if (!ParseTime(optarg, &atUs)) {
+        		fprintf(stderr, "Invalid start time '%s' given (seconds since the epoch[.ms] expected)\n", optarg);
+        		exit(1);
+        	}
+	        break;
+        case OPT_COMPILE: // precompile all melodies of the directory into the cache
+        	compileDir = optarg;
+	        break;
+        case OPT_NO_CACHE: // neither use nor fill compiled timelines cache
+        	useCache = false;
+	        break;
+        case OPT_CONVERT: // convert melody files into another format
+        	if (ParseConvertFormat(optarg, &convertFormat) < 0) {
+        		exit(1);
+        	}
+        	convert = true;
+	        break;
+        case OPT_CATALOG: // describe melody files as JSON records
+        	catalogDir = optarg;
+	        break;
+        case OPT_PACK: // compile melody files into a pack
+        	packFile = optarg;
+	        break;
+        case OPT_DAEMON: // serve play requests over the socket
+        	daemonMode = true;
+	        break;
+        case OPT_CLIENT: // send request to the daemon
+        	clientCmd = optarg;
+	        break;
+        case OPT_SOCKET: // daemon socket path
+        	socketPath = optarg;
+	        break;
+        case OPT_PRIORITY: // priority of the daemon request
+        	priority = atoi(optarg);
+	        break;
+        case OPT_RESUME: // resume the request after preemption
+        	resume = true;
+	        break;
+        case OPT_MELODY_RATE: // daemon rate limit for the same melody
+        	if (ParseRateLimit(optarg, &melodyLimit) < 0) {
+        		exit(1);
+        	}
+	        break;
+        case OPT_SOURCE_RATE: // daemon rate limit for the same client
+        	if (ParseRateLimit(optarg, &sourceLimit) < 0) {
+        		exit(1);
+        	}
+	        break;
+        case OPT_FROM: // client name the request is rate limited for
+        	from = optarg;
+	        break;
+        case OPT_ARP: // play the notes sounding together as an arpeggio
+        	if ((sscanf(optarg, "%d", &arpHz) != 1) || (arpHz < ARP_MIN_RATE) || (arpHz > ARP_MAX_RATE)) {
+        		fprintf(stderr, "Invalid arpeggio rate '%s' given (%d to %d Hz)\n", optarg, ARP_MIN_RATE, ARP_MAX_RATE);
+        		exit(1);
+        	}
+        	mergeTracks = true;
+	        break;
+        case OPT_ZONE: // daemon zone the request is for
+        	if ((sscanf(optarg, "%d", &zone) != 1) || (zone < 0)) {
+        		fprintf(stderr, "Invalid zone number '%s' given\n", optarg);
+        		exit(1);
+        	}
+	        break;
+        case OPT_PIDFILE: // pid file of the running player
+        	pidFile = optarg;
+	        break;
+        case OPT_STOP: // stop the running player
+        	playerSignal = SIGTERM;
+	        break;
+        case OPT_PAUSE: // pause the running player
+        	playerSignal = SIGUSR1;
+	        break;
+        case OPT_CONTINUE: // resume the paused player
+        	playerSignal = SIGUSR2;
+	        break;
+        case OPT_STATUS: // show the status of the running player
+        	showStatus = true;
+	        break;
+        case OPT_SET: // change volume, transpose or tempo of the running player
+        	controls = optarg;
+	        break;
+        case OPT_BUSY: // what to do when another player owns the device
+        	if (ParseBusyMode(optarg, &busy) < 0) {
+        		exit(1);
+        	}
+	        break;
+        case OPT_LIVE: // play MIDI bytes from stdin, a FIFO or a MIDI device as they come
+        	liveInput = optarg;
+	        break;
+        case OPT_RT: // locked memory and real-time scheduling
+        	realtime = true;
+	        break;
         
         case '?':
         case 'h':
-        	fprintf(stderr, "usage: %s [-p <pwmN>] <-m file.mid>|<-i file.imy>|<-e file.emy>|<-I iMelody>|<-E eMelody> [-d] [-h] [-v <Volume>] [-n [<StartNote>][:<EndNote>] [-t <TrackN>]\n", argv[0]);
+        	fprintf(stderr, "usage: %s [-p <pwmN>|<chip>:<pwmN>[,...]] <-m file.mid>|<-i file.imy|->|<-e file.emy|->|<-I iMelody>|<-E eMelody>|<-r file.rtttl>|<-R RTTTL>|<-N name|list>|<-P pack[:name]>|<-L playlist>... [-d] [-h] [-v <Volume>] [-n [<StartNote>][:<EndNote>] [-t <TrackN>|-a high|last|chan:<ch>[,<ch>...]] [--arp <Hz>] [--seek [mm:]ss[.ms]] [--at <epoch>[.ms]] [--no-cache] [--pidfile <path>] [--busy fail|wait|preempt|enqueue [--priority <n>]] [--rt]\n"
+        		"       %s [-a high|last|chan:<ch>[,<ch>...]] --compile <dir>\n"
+        		"       %s [-a high|last|chan:<ch>[,<ch>...]] --convert imy|emy|rtttl|mid|pwmt <file|dir>...\n"
+        		"       %s [-a high|last|chan:<ch>[,<ch>...]] --pack <pack> <file|dir>...\n"
+        		"       %s --catalog <dir>\n"
+        		"       %s [-p <pwmN>]... [-a high|last|chan:<ch>[,<ch>...]] [-b] [-d] --daemon [--socket <path>] [--melody-rate <n>[:<burst>]] [--source-rate <n>[:<burst>]]\n"
+        		"       %s [-p <pwmN>] [-d] [-v <Volume>] --live -|<fifo>|/dev/snd/midiC<n>D<n> [--rt] [--pidfile <path>]\n"
+        		"       %s --client play|queue|stop|stats [<melody option>] [--priority <n>] [--resume] [--from <id>] [--zone <n>] [--socket <path>]\n"
+        		"       %s [-p <pwmN>] --stop|--pause|--continue|--status|--set volume|transpose|tempo=<n>[,...] [--pidfile <path>]\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
         	exit(1);
             break;
         default:
             //fprintf(stderr, "getopt returned character code 0x%x", c);
         	break;
         }
+        // all melodies given are kept in order in case there is more than one
+        if ((c > 0) && (c < 128) && (strchr("mieIErRNP", c) != NULL)) {
+        	TPlaylistItem item = { (char)c, optarg };
+        	playlist.push_back(item);
+        }
     }
+    bool playlistMode = playlistFile || (playlist.size() > 1);
+
+	// the catalog and the status are the only output, so they go without the banner
+	if (catalogDir) {
+		exit((CatalogFiles(catalogDir) < 0) ? 1 : 0);
+	}
+	// the player to control is found by the pid file of the device
+	char pwmDevStr[PWM_DEV_LIST];
+	string devPidFile;
+	if ((showStatus || controls || playerSignal) && !pidFile) {
+		if (GetPWMDevice(pwmDevStr, sizeof(pwmDevStr)) < 0) {
+			exit(1);
+		}
+		devPidFile = GetPidFiles(NULL, pwmDevStr)[0];
+		pidFile = devPidFile.c_str();
+	}
+	if (showStatus || controls) {
+		int pid = ReadPidFile(pidFile);
+		if ((pid <= 0) || (controls && (SetControls(pid, controls) < 0)) || (showStatus && (ShowStatus(pid) < 0))) {
+			exit(1);
+		}
+		exit(0);
+	}
+    printf("pwm-player v0.1 %s Copyright (C) 2022 by MaxWolf\n", rev.substr(1, rev.length() - 2).c_str());
+
+	if (compileDir) {
+		exit((CompileDirectory(compileDir, voiceSpec) < 0) ? 1 : 0);
+	}
+
+	if (convert) {
+		vector<string> sources(argv + optind, argv + argc);
+		for (size_t i = 0; i < playlist.size(); ++i) {
+			if (strchr("mierf", playlist[i].type) != NULL) {
+				sources.push_back(playlist[i].arg);
+			}
+		}
+		if (sources.empty()) {
+			fprintf(stderr, "No melody files to convert\n");
+			exit(1);
+		}
+		exit((ConvertFiles(sources, convertFormat, voiceSpec) < 0) ? 1 : 0);
+	}
+
+	if (packFile) {
+		vector<string> sources(argv + optind, argv + argc);
+		if (sources.empty()) {
+			fprintf(stderr, "No melody files to pack\n");
+			exit(1);
+		}
+		exit((BuildPack(packFile, sources, voiceSpec) < 0) ? 1 : 0);
+	}
+
+	if (builtinName && (strcmp(builtinName, "list") == 0)) {
+		ListBuiltinMelodies();
+		exit(0);
+	}
+
+	// pack given without a melody name is listed
+	if (packSpec && (strchr(packSpec, ':') == NULL)) {
+		exit((ListPackMelodies(packSpec) < 0) ? 1 : 0);
+	}
 
-	if (!midiFile && !melodyFile && !eMelody && !iMelody) {
+	if (playerSignal) {
+		exit((SignalPlayer(pidFile, playerSignal) < 0) ? 1 : 0);
+	}
+
+	if (clientCmd) {
+		string request = clientCmd;
+		char attr[32];
+		if (priority != 0) {
+			snprintf(attr, sizeof(attr), " prio=%d", priority);
+			request += attr;
+		}
+		if (resume) {
+			request += " resume";
+		}
+		if (from) {
+			request += string(" from=") + from;
+		}
+		if (zone >= 0) {
+			snprintf(attr, sizeof(attr), " zone=%d", zone);
+			request += attr;
+		}
+		if (midiFile) {
+			request += " " + ClientSource('m', midiFile);
+		} else if (melodyFile) {
+			request += " " + ClientSource('i', melodyFile);
+		} else if (rtttlFile) {
+			request += " " + ClientSource('r', rtttlFile);
+		} else if (iMelody || eMelody) {
+			request += " " + ClientSource(iMelody ? 'I' : 'E', iMelody ? iMelody : eMelody);
+		} else if (rtttl) {
+			request += " " + ClientSource('R', rtttl);
+		} else if (builtinName) {
+			request += " " + ClientSource('N', builtinName);
+		} else if (packSpec) {
+			request += " " + ClientSource('P', packSpec);
+		}
+		exit((SendRequest(socketPath, request.c_str()) < 0) ? 1 : 0);
+	}
+
+	if ((atUs != 0) && (daemonMode || liveInput)) {
+		fprintf(stderr, "Start time can not be set for the daemon or live input\n");
+		exit(1);
+	}
+
+	if (!daemonMode && !PWMZones.empty()) {
+		fprintf(stderr, "Several PWM devices are played by the daemon only\n");
+		exit(1);
+	}
+	if (PWMZones.size() >= DAEMON_MAX_ZONES) {
+		fprintf(stderr, "Too many zones (%d at most)\n", DAEMON_MAX_ZONES);
+		exit(1);
+	}
+
+	if (!daemonMode && !liveInput && !playlistMode && !midiFile && !melodyFile && !eMelody && !iMelody && !rtttlFile && !rtttl && !builtinName && !packSpec) {
 		fprintf(stderr, "No melody specified\n");	
 		exit(1);
 	}
 
+	// own the device before anything is written to it
+	if (GetPWMDevice(pwmDevStr, sizeof(pwmDevStr)) < 0) {
+		exit(1);
+	}
+	// the daemon owns the outputs of all its zones
+	string lockDevStr = pwmDevStr;
+	for (size_t i = 0; i < PWMZones.size(); ++i) {
+		lockDevStr += string(";") + PWMZones[i];
+	}
+	lockSelf.priority = priority;
+	lockSelf.socket = daemonMode ? socketPath : "";
+	lockSelf.melody = daemonMode ? "requests" : liveInput ? "live" : playlistFile ? "playlist" : playlist[0].arg;
+	switch (LockDevice(lockDevStr.c_str(), lockSelf, busy, lockHolder)) {
+	case 0: {
+		// the daemon owning the device takes the melody over
+		string request = "queue";
+		char attr[32];
+		if (daemonMode || liveInput || playlistMode) {
+			fprintf(stderr, "pwm%s is owned by the daemon on %s, only a single melody may be passed to it\n", pwmDevStr, lockHolder.socket.c_str());
+			exit(1);
+		}
+		if (melodyFile && IsStream(melodyFile)) {
+			fprintf(stderr, "pwm%s is owned by the daemon on %s, it can not read %s\n", pwmDevStr, lockHolder.socket.c_str(), melodyFile);
+			exit(1);
+		}
+		// on the zone of the daemon that plays the output
+		snprintf(attr, sizeof(attr), " prio=%d zone=%d", priority, lockHolder.zone);
+		request += attr;
+		if (resume) {
+			request += " resume";
+		}
+		request += " " + ClientSource(playlist[0].type, playlist[0].arg.c_str());
+		exit((SendRequest(lockHolder.socket.c_str(), request.c_str()) < 0) ? 1 : 0);
+	}
+	case -1:
+		exit(1);
+	}
+
 	atexit(Cleanup);
 	if (SetupHW() < 0) {
 		exit(1);
 	}
 
-	if (midiFile) {
+	// built-in melodies are compiled into the binary
+	if (builtinName && !playlistMode) {
+		if (GetBuiltinMelody(builtinName, timeline) < 0) {
+			fprintf(stderr, "No built-in melody '%s' (use -N list to see them all)\n", builtinName);
+			exit(1);
+		}
+		useTimeline = true;
+	}
+
+	// pack melodies are compiled already
+	if (!useTimeline && !playlistMode && packSpec) {
+		if (LoadPackMelody(packSpec, timeline) < 0) {
+			exit(1);
+		}
+		useTimeline = true;
+	}
+
+	// compiled timeline from the cache skips parsing entirely
+	// (the cache keeps single voice timelines only)
+	if (!useTimeline && !playlistMode && useCache && ((midiFile && mergeTracks && (PWMVoices() == 1) && !arpHz) || (melodyFile && !IsStream(melodyFile)))) {
+		cacheName = CacheFileName(midiFile ? midiFile : melodyFile, voiceSpec);
+		if (!cacheName.empty() && (LoadCompiled(cacheName.c_str(), timeline) > 0)) {
+			useTimeline = true;
+			if (Debug) {
+				printf("Using compiled timeline %s\n", cacheName.c_str());
+			}
+		}
+	}
+
+	if (playlistMode) {
+	    printf("Playing %d melodies\n", (int)playlist.size());
+	} else if (builtinName) {
+	    printf("Playing built-in melody %s\n", builtinName);
+	} else if (packSpec) {
+	    printf("Playing %s\n", packSpec);
+	} else if (useTimeline) {
+	    printf("Playing %s\n", midiFile ? midiFile : melodyFile);
+	} else if (midiFile) {
 	    printf("Playing MIDI file %s\n", midiFile);
     	if (PrepareMIDIFile(midiFile) < 0) {
     		exit(1);
     	}
+    	if (mergeTracks) {
+    		if ((arpHz ? PrepareMIDIArpeggio(timeline, voicePolicy, chanOrder, arpHz) :
+    				PrepareMIDIVoices(timeline, voicePolicy, chanOrder, PWMVoices())) < 0) {
+    			exit(1);
+    		}
+    		CleanupMIDIFile();
+    		useTimeline = true;
+    		if (!cacheName.empty()) {
+    			SaveCompiled(cacheName.c_str(), timeline);
+    		}
+    	}
     } else if (melodyFile) {
 	    printf("Playing iMelody/eMelody file %s\n", melodyFile);
-    	if (PrepareMelodyFile(melodyFile) < 0) {
+    	melody = NewMelody();
+    	if (PrepareMelodyFile(melody, melodyFile) < 0) {
     		exit(1);
     	}
-    } else if (iMelody) {
-	    printf("Playing iMelody %s\n", iMelody);
-    	if (PrepareMelodyString(iMelody, 'I') < 0) {
+    	// melodies with endless loops are played by the melody program interpreter
+    	if (CompileMelody(melody, timeline) > 0) {
+    		useTimeline = true;
+    		if (!cacheName.empty()) {
+    			SaveCompiled(cacheName.c_str(), timeline);
+    		}
+    		DeleteMelody(melody);
+    	}
+    } else if (rtttlFile || rtttl) {
+	    // RTTTL is parsed straight into the timeline (that is as cheap as hashing it for the cache)
+	    printf("Playing RTTTL %s\n", rtttlFile ? rtttlFile : rtttl);
+    	if ((rtttlFile ? CompileRTTTLFile(rtttlFile, timeline) : CompileRTTTLString(rtttl, timeline)) < 0) {
     		exit(1);
     	}
-    } else if (eMelody) {
-	    printf("Playing eMelody %s\n", eMelody);
-    	if (PrepareMelodyString(eMelody, 'E') < 0) {
+    	useTimeline = true;
+    } else if (iMelody || eMelody) {
+	    printf("Playing %s %s\n", iMelody ? "iMelody" : "eMelody", iMelody ? iMelody : eMelody);
+    	melody = NewMelody();
+    	if (PrepareMelodyString(melody, iMelody ? iMelody : eMelody, iMelody ? 'I' : 'E') < 0) {
     		exit(1);
     	}
-    } else {
+    	if (CompileMelody(melody, timeline) > 0) {
+    		useTimeline = true;
+    		DeleteMelody(melody);
+    	}
+    } else if (!daemonMode && !liveInput) {
         exit(2);
     }
 
@@ -311,11 +913,58 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	signal( SIGHUP, SigHandler );
-	signal( SIGINT,  SigHandler );
-	signal( SIGTERM, SigHandler );
-	signal( SIGUSR1, SigHandler );
+	// before any thread is started, so they all run with it
+	if (realtime) {
+		SetupRealtime();
+	}
+	// before any thread is started, so they all have the signals blocked
+	SetupSignals();
+	UpdateLockHolder(lockSelf);
+	WritePidFiles(GetPidFiles(pidFile, lockDevStr.c_str()));
+	OpenStatusBlock();
+
+	if (liveInput) {
+		exit((PlayLiveMIDI(liveInput) < 0) ? 1 : 0);
+	}
+
+	if (daemonMode) {
+		exit((RunDaemon(socketPath, PWMZones, voiceSpec, melodyLimit, sourceLimit) < 0) ? 1 : 0);
+	}
+
+	if (playlistMode) {
+		if (seekUs != 0) {
+			fprintf(stderr, "Seeking is not supported for playlists\n");
+		}
+		// the first melody is compiled before the start time is waited for
+		exit((PlayPlaylist(playlist, voiceSpec, useCache, [atUs]() {
+			if (atUs != 0) {
+				printf("Start offset %+lld us\n", WaitStart(atUs));
+			}
+		}) < 0) ? 1 : 0);
+	}
 
+	if (seekUs != 0) {
+		int seekNote = 1;
+		if (useTimeline) {
+			seekNote = SeekTimeline(timeline, seekUs);
+		} else if (midiFile) {
+			seekNote = SeekMIDIFile(trkN, seekUs);
+		} else {
+			fprintf(stderr, "Seeking is not supported for this melody\n");
+		}
+		if (seekNote > startNote) {
+			startNote = seekNote;
+		}
+	}
+
+	if (atUs != 0) {
+		printf("Start offset %+lld us\n", WaitStart(atUs));
+	}
+	StatusMelody(playlist.empty() ? "" : playlist[0].arg.c_str(), useTimeline ? timeline.length : 0, NOW - microseconds(seekUs));
+	if (useTimeline) {
+		PlayTimeline(timeline, startNote, endNote);
+    	exit(0);
+	}
 	if (midiFile) {
 		if (PlayMIDIFile(trkN, startNote, endNote) < 0) {
 			CleanupMIDIFile();
@@ -324,10 +973,10 @@ int main(int argc, char *argv[])
     	CleanupMIDIFile();
     	exit(0);
 	}
-	if (PlayMelody() < 0) {
-		CleanupMelody();
+	if (PlayMelody(melody) < 0) {
+		DeleteMelody(melody);
 		exit(1);
 	}
-	CleanupMelody();
+	DeleteMelody(melody);
 	return 0;
 }
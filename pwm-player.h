@@ -30,11 +30,20 @@ typedef std::chrono::steady_clock TClock;
 typedef std::chrono::time_point<TClock> TPoint;
 
 #define TP2MSEC(tp) std::chrono::duration_cast<std::chrono::milliseconds>(tp.time_since_epoch()).count()
-#define NOW TClock::now()
+// playback clock: runs at the live tempo and stands still while the player is paused
+#define NOW PlaybackNow()
 #define NOWMSEC TP2MSEC(NOW)
 
 
 extern bool Debug;
+TPoint PlaybackNow();
+TPoint RealTime(TPoint tp);
+extern int SignalF;
+int NextSignal();
 void Play(int pitch, int velocity, int duration_us);
+void Sound(int pitch, int velocity);
+void SoundPeriod(int pitch);
+void WaitUntil(TPoint tp);
+int WaitReadable(int fd, const TPoint *tp);
 void Mute();
 
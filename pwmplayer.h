@@ -0,0 +1,82 @@
+/*
+ * libpwmplayer: melodies on a PWM buzzer for other programs
+ * Copyright (C) 2022 MaxWolf d5713fb35e03d9aa55881eaa23f86fb6f09982ed4da2a59410639a1c9d35bfbf
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * see https://www.gnu.org/licenses/ for license terms
+ */
+#ifndef _PWMPLAYER_H_
+#define _PWMPLAYER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A player owns one PWM device and plays one melody at a time on a thread of
+ * its own, so several players may play on different devices at once.
+ * Melodies are compiled once and may be played any number of times by any
+ * player; a melody may be freed while it is still playing.
+ *
+ *   pwmplayer_t *p = pwmplayer_open(0);
+ *   pwmplayer_melody_t *m = pwmplayer_compile('N', "beep", NULL);
+ *   pwmplayer_play(p, m, NULL, NULL);
+ *   pwmplayer_wait(p);
+ */
+typedef struct pwmplayer pwmplayer_t;
+typedef struct pwmplayer_melody pwmplayer_melody_t;
+
+#define PWMPLAYER_DONE      0       // the melody was played to the end
+#define PWMPLAYER_STOPPED   1       // it was cut short by pwmplayer_stop/play/close
+
+/*
+ * Called on the player thread when the melody is over; it must not call
+ * pwmplayer_play, pwmplayer_stop, pwmplayer_wait or pwmplayer_close of the same player
+ */
+typedef void (*pwmplayer_callback_t)(pwmplayer_t *player, int status, void *arg);
+
+/*
+ * Open device pwm<n> (WB_PWM_BUZZER environment variable if n < 0), NULL on failure
+ * or when it is owned by another player (the device lock of pwm-player --busy fail),
+ * the device is owned until pwmplayer_close
+ */
+pwmplayer_t *pwmplayer_open(int n);
+void pwmplayer_close(pwmplayer_t *player);
+void pwmplayer_set_volume(pwmplayer_t *player, int percent);
+
+/*
+ * Compile a melody given the way the player options give it: type is the
+ * option letter ('m', 'i', 'e', 'r' for files, 'f' for a file of any format,
+ * 'I', 'E', 'R' for melody text, 'N' for a built-in melody, 'P' for
+ * <pack>:<name>). voice is the MIDI merging policy ("high", "last" or
+ * "chan:<ch>,..."; NULL for the default). Returns NULL on failure.
+ */
+pwmplayer_melody_t *pwmplayer_compile(char type, const char *source, const char *voice);
+unsigned long pwmplayer_length(const pwmplayer_melody_t *melody);  // milliseconds, 0 for NULL
+void pwmplayer_free(pwmplayer_melody_t *melody);
+
+/*
+ * Start playing the melody (stopping the current one) and return at once;
+ * done is called with arg when it is over (may be NULL); -1 for a NULL melody
+ */
+int pwmplayer_play(pwmplayer_t *player, const pwmplayer_melody_t *melody, pwmplayer_callback_t done, void *arg);
+
+/*
+ * Cut the melody short: returns once the device is muted
+ */
+int pwmplayer_stop(pwmplayer_t *player);
+
+/*
+ * Wait for the melody to be over, returns PWMPLAYER_DONE or PWMPLAYER_STOPPED
+ */
+int pwmplayer_wait(pwmplayer_t *player);
+
+/*
+ * Debug output of all the players to stdout
+ */
+void pwmplayer_set_debug(int on);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif